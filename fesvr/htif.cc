@@ -115,7 +115,7 @@ void htif_t::load_program()
     htif_t* htif;
   } preload_aware_memif(this);
 
-  std::map<std::string, uint64_t> symbols = load_elf(path.c_str(), &preload_aware_memif, &entry);
+  symbols = load_elf(path.c_str(), &preload_aware_memif, &entry);
 
   if (symbols.count("tohost") && symbols.count("fromhost")) {
     tohost_addr = symbols["tohost"];
@@ -7,6 +7,8 @@
 #include "syscall.h"
 #include "device.h"
 #include <string.h>
+#include <map>
+#include <string>
 #include <vector>
 
 class htif_t : public chunked_memif_t
@@ -43,6 +45,9 @@ class htif_t : public chunked_memif_t
 
   reg_t get_entry_point() { return entry; }
 
+  // the symbols of the program loaded by load_program()
+  const std::map<std::string, uint64_t>& get_symbols() { return symbols; }
+
   // indicates that the initial program load can skip writing this address
   // range to memory, because it has already been loaded through a sideband
   virtual bool is_address_preloaded(addr_t taddr, size_t len) { return false; }
@@ -54,6 +59,7 @@ class htif_t : public chunked_memif_t
 
   memif_t mem;
   reg_t entry;
+  std::map<std::string, uint64_t> symbols;
   bool writezeros;
   std::vector<std::string> hargs;
   std::vector<std::string> targs;
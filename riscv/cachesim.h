@@ -28,6 +28,7 @@ class cache_sim_t
 
   void access(uint64_t addr, size_t bytes, bool store);
   void print_stats();
+  uint64_t misses() const { return read_misses + write_misses; }
   void set_miss_handler(cache_sim_t* mh) { miss_handler = mh; }
   void set_log(bool _log) { log = _log; }
 
@@ -94,6 +95,10 @@ class cache_memtracer_t : public memtracer_t
   {
     cache->set_log(log);
   }
+  uint64_t misses()
+  {
+    return cache->misses();
+  }
 
  protected:
   cache_sim_t* cache;
@@ -0,0 +1,165 @@
+// See LICENSE for license details.
+
+#include "callgraph.h"
+#include "symtab.h"
+#include <algorithm>
+#include <cinttypes>
+#include <string>
+#include <tuple>
+
+const reg_t callgraph_t::ROOT;
+
+callgraph_t::callgraph_t() : last(0)
+{
+  stack.push_back({ROOT, ROOT, 0, false});
+  fns[ROOT].calls = 1;
+  active[ROOT] = 1;
+}
+
+void callgraph_t::charge(reg_t now)
+{
+  fns[stack.back().fn].self += now - last;
+  last = now;
+}
+
+void callgraph_t::push(reg_t fn, reg_t ret, reg_t now, bool trap)
+{
+  charge(now);
+  if (stack.size() == MAX_DEPTH) {
+    while (stack.size() > 1)
+      pop(now);
+  }
+  edges[std::make_pair(stack.back().fn, fn)].calls++;
+  fns[fn].calls++;
+  active[fn]++;
+  stack.push_back({fn, ret, now, trap});
+}
+
+// A function called recursively only counts once towards its inclusive
+// total, from its outermost frame.
+void callgraph_t::pop(reg_t now)
+{
+  frame_t f = stack.back();
+  stack.pop_back();
+  if (--active[f.fn] == 0)
+    fns[f.fn].inclusive += now - f.entered;
+  edges[std::make_pair(stack.back().fn, f.fn)].inclusive += now - f.entered;
+}
+
+void callgraph_t::call_or_return(processor_t* p, unsigned hint, insn_bits_t insn,
+                                 reg_t npc, reg_t now)
+{
+  charge(now);
+
+  if (hint & POP) {
+    // Unwind to the frame that returns to npc, which skips the frames of
+    // tail calls and of functions left by longjmp. A return that matches
+    // no frame, or only one beyond a trap, pops just the innermost frame,
+    // unless that is a trap's.
+    size_t i = stack.size() - 1;
+    while (i > 0 && !stack[i].trap && stack[i].ret != npc)
+      i--;
+    if (i == 0 || stack[i].trap)
+      i = stack.size() - 1;
+    if (i > 0 && !stack[i].trap) {
+      while (stack.size() > i)
+        pop(now);
+    }
+  }
+
+  if (hint & PUSH) {
+    unsigned rd = (insn & 3) == 3 ? (insn >> 7) & 31 : 1;
+    push(npc, p->get_state()->XPR[rd], now, false);
+  }
+}
+
+void callgraph_t::apply_pending(reg_t now)
+{
+  charge(now);
+  for (auto& e : pending) {
+    if (e.kind == TRAP) {
+      push(e.handler, e.epc, now, true);
+    } else {
+      auto trap = std::find_if(stack.rbegin(), stack.rend() - 1,
+                               [](const frame_t& f) { return f.trap; });
+      if (trap != stack.rend() - 1) {
+        size_t depth = stack.rend() - trap - 1;
+        while (stack.size() > depth)
+          pop(now);
+      }
+    }
+  }
+  pending.clear();
+}
+
+void callgraph_t::backtrace(std::vector<reg_t>& pcs) const
+{
+  for (size_t i = stack.size() - 1; i > 0; i--)
+    pcs.push_back(stack[i].trap ? stack[i].ret : stack[i].ret - 1);
+}
+
+static std::string name(reg_t fn, const symtab_t& symbols)
+{
+  return fn == reg_t(-1) ? "(root)" : symbols.lookup(fn);
+}
+
+void callgraph_t::write(FILE* out, const std::vector<std::pair<callgraph_t*, reg_t>>& harts,
+                        const symtab_t& symbols)
+{
+  std::map<std::string, fn_stats_t> fns;
+  std::map<std::pair<std::string, std::string>, edge_stats_t> edges;
+
+  for (auto& hart : harts) {
+    callgraph_t* g = hart.first;
+    reg_t now = hart.second;
+
+    // Charge the frames that are still on the stack as if they returned now.
+    std::unordered_map<reg_t, fn_stats_t> hart_fns = g->fns;
+    auto hart_edges = g->edges;
+    hart_fns[g->stack.back().fn].self += now - g->last;
+    std::unordered_map<reg_t, bool> counted;
+    for (size_t i = 0; i < g->stack.size(); i++) {
+      const frame_t& f = g->stack[i];
+      if (!counted[f.fn])
+        hart_fns[f.fn].inclusive += now - f.entered;
+      counted[f.fn] = true;
+      if (i > 0)
+        hart_edges[std::make_pair(g->stack[i - 1].fn, f.fn)].inclusive += now - f.entered;
+    }
+
+    for (auto& f : hart_fns) {
+      fn_stats_t& s = fns[name(f.first, symbols)];
+      s.self += f.second.self;
+      s.inclusive += f.second.inclusive;
+      s.calls += f.second.calls;
+    }
+    for (auto& e : hart_edges) {
+      edge_stats_t& s = edges[std::make_pair(name(e.first.first, symbols),
+                                             name(e.first.second, symbols))];
+      s.inclusive += e.second.inclusive;
+      s.calls += e.second.calls;
+    }
+  }
+
+  std::vector<std::tuple<uint64_t, uint64_t, uint64_t, std::string>> fn_rows;
+  for (auto& f : fns)
+    fn_rows.emplace_back(f.second.inclusive, f.second.self, f.second.calls, f.first);
+  std::sort(fn_rows.rbegin(), fn_rows.rend());
+
+  fprintf(out, "# Functions, by instructions retired in them and their callees\n");
+  fprintf(out, "#      inclusive             self        calls  function\n");
+  for (auto& r : fn_rows)
+    fprintf(out, "%16" PRIu64 " %16" PRIu64 " %12" PRIu64 "  %s\n",
+            std::get<0>(r), std::get<1>(r), std::get<2>(r), std::get<3>(r).c_str());
+
+  std::vector<std::tuple<uint64_t, uint64_t, std::string, std::string>> edge_rows;
+  for (auto& e : edges)
+    edge_rows.emplace_back(e.second.inclusive, e.second.calls, e.first.first, e.first.second);
+  std::sort(edge_rows.rbegin(), edge_rows.rend());
+
+  fprintf(out, "\n# Calls, by instructions retired in the callee and its callees\n");
+  fprintf(out, "#      inclusive        calls  caller -> callee\n");
+  for (auto& r : edge_rows)
+    fprintf(out, "%16" PRIu64 " %12" PRIu64 "  %s -> %s\n",
+            std::get<0>(r), std::get<1>(r), std::get<2>(r).c_str(), std::get<3>(r).c_str());
+}
@@ -0,0 +1,126 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_CALLGRAPH_H
+#define _RISCV_CALLGRAPH_H
+
+#include "processor.h"
+#include <cstdio>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+class symtab_t;
+
+// An exact call graph, counting the instructions retired in each function
+// and in its callees, built from a shadow call stack that follows the
+// return-address stack hints of the calling convention: a jal or jalr
+// whose rd is ra or t0 pushes, and a jalr x0 through ra or t0 pops.  A
+// trap pushes a frame for its handler, and mret or sret pops everything
+// down to and including that frame.  So that calls that are never returned
+// from, as across a context switch, can't grow the stack without bound, a
+// return that matches no frame pops the innermost one, and a stack
+// MAX_DEPTH frames deep is unwound to the root.
+//
+// step() reports the instruction that ends each block, as only those can be
+// calls or returns.  Traps and trap returns end a batch, and are only
+// applied by sync() at the start of the next one, where the number of
+// instructions retired is known; none retire in between.
+class callgraph_t
+{
+ public:
+  callgraph_t();
+
+  // insn retired, jumping to npc, making now instructions retired in all.
+  void retire(processor_t* p, insn_bits_t insn, reg_t npc, reg_t now)
+  {
+    if (unsigned hint = ras_hint(insn, p->get_xlen()))
+      call_or_return(p, hint, insn, npc, now);
+    else if (uint32_t(insn) == MATCH_MRET || uint32_t(insn) == MATCH_SRET)
+      pending.push_back({TRAP_RETURN, 0, 0});
+  }
+  // take_trap() sent the hart to handler.
+  void trap(reg_t handler, reg_t epc) { pending.push_back({TRAP, handler, epc}); }
+  void sync(reg_t now)
+  {
+    if (unlikely(!pending.empty()))
+      apply_pending(now);
+  }
+
+  // The pcs the functions on the stack will return to, innermost first,
+  // less one so that they lie in the calls.
+  void backtrace(std::vector<reg_t>& pcs) const;
+
+  // Write the call graph of every hart in harts, with functions named by
+  // symbols.  now is each hart's minstret; frames still on the stack are
+  // counted up to then.
+  static void write(FILE* out, const std::vector<std::pair<callgraph_t*, reg_t>>& harts,
+                    const symtab_t& symbols);
+
+ private:
+  friend class callgraph_test_t; // callgraph.t.cc
+  enum { POP = 1, PUSH = 2 };
+  static bool is_link(unsigned reg) { return reg == 1 || reg == 5; }
+  static unsigned ras_hint(insn_bits_t insn, unsigned xlen)
+  {
+    if ((insn & 3) == 3) {
+      unsigned rd = (insn >> 7) & 31, rs1 = (insn >> 15) & 31;
+      if ((insn & 0x7f) == 0x6f) // jal
+        return is_link(rd) ? PUSH : 0;
+      if ((insn & 0x707f) == 0x67) { // jalr
+        if (!is_link(rd))
+          return is_link(rs1) ? POP : 0;
+        return is_link(rs1) && rs1 != rd ? POP | PUSH : PUSH;
+      }
+      return 0;
+    }
+    if ((insn & 0xe003) == 0x2001) // c.jal
+      return xlen == 32 ? PUSH : 0;
+    if ((insn & 0xe07f) == 0x8002 && (insn & 0xf80)) { // c.jr, c.jalr
+      unsigned rs1 = (insn >> 7) & 31;
+      if (!(insn & 0x1000))
+        return is_link(rs1) ? POP : 0;
+      return rs1 == 5 ? POP | PUSH : PUSH;
+    }
+    return 0;
+  }
+  void call_or_return(processor_t* p, unsigned hint, insn_bits_t insn, reg_t npc, reg_t now);
+
+  static const reg_t ROOT = -1;
+  static const size_t MAX_DEPTH = 65536;
+  struct frame_t {
+    reg_t fn; // entry point, or ROOT
+    reg_t ret; // return address; for a trap, the epc
+    reg_t entered; // instructions retired when it was pushed
+    bool trap;
+  };
+  struct fn_stats_t {
+    uint64_t self;
+    uint64_t inclusive;
+    uint64_t calls;
+  };
+  struct edge_stats_t {
+    uint64_t inclusive;
+    uint64_t calls;
+  };
+  std::vector<frame_t> stack;
+  reg_t last; // when the innermost frame was last charged for its instructions
+  std::unordered_map<reg_t, fn_stats_t> fns;
+  std::map<std::pair<reg_t, reg_t>, edge_stats_t> edges;
+  std::unordered_map<reg_t, unsigned> active; // frames of each function on the stack
+
+  enum { TRAP, TRAP_RETURN };
+  struct pending_t {
+    int kind;
+    reg_t handler;
+    reg_t epc;
+  };
+  std::vector<pending_t> pending;
+  void apply_pending(reg_t now);
+
+  void charge(reg_t now);
+  void push(reg_t fn, reg_t ret, reg_t now, bool trap);
+  void pop(reg_t now);
+};
+
+#endif
@@ -0,0 +1,149 @@
+// See LICENSE for license details.
+
+// Check the shadow call stack and the counts callgraph_t keeps, by feeding
+// it calls, returns and traps the way step() and take_trap() would.
+
+#include "config.h"
+#include "callgraph.h"
+#include "test_sim.h"
+#include <memory>
+
+static const insn_bits_t JAL_RA = 0x000000ef;      // jal ra, .
+static const insn_bits_t JAL_T0 = 0x000002ef;      // jal t0, .
+static const insn_bits_t JALR_RA_A0 = 0x000500e7;  // jalr ra, 0(a0)
+static const insn_bits_t JALR_RA_RA = 0x000080e7;  // jalr ra, 0(ra)
+static const insn_bits_t JALR_T0_RA = 0x000082e7;  // jalr t0, 0(ra)
+static const insn_bits_t JR_A0 = 0x00050067;       // jr a0
+static const insn_bits_t RET = 0x00008067;         // ret
+static const insn_bits_t JR_T0 = 0x00028067;       // jr t0
+static const insn_bits_t C_JALR_A0 = 0x9502;       // c.jalr a0
+static const insn_bits_t C_JALR_T0 = 0x9282;       // c.jalr t0
+static const insn_bits_t C_JR_RA = 0x8082;         // c.jr ra
+static const insn_bits_t MRET = 0x30200073;
+
+static const reg_t ROOT = -1;
+static const reg_t F = 0x1000, G = 0x2000, H = 0x3000, K = 0x5000;
+static const reg_t HANDLER = 0x4000;
+
+class callgraph_test_t
+{
+public:
+  callgraph_test_t(processor_t* p) : p(p) {}
+
+  // insn at pc retired at now, jumping to npc and writing the address
+  // after it to its rd: ra for c.jalr, nothing for c.jr.
+  void retire(insn_bits_t insn, reg_t pc, reg_t npc, reg_t now)
+  {
+    unsigned rd = insn_length(insn) == 2 ? 1 : (insn >> 7) & 31;
+    if (insn_length(insn) == 4 || (insn & 0x1000))
+      p->get_state()->XPR.write(rd, pc + insn_length(insn));
+    g->retire(p, insn, npc, now);
+  }
+
+  size_t depth() { return g->stack.size() - 1; }
+  reg_t top() { return g->stack.back().fn; }
+  const callgraph_t::fn_stats_t& fn(reg_t f) { return g->fns[f]; }
+  const callgraph_t::edge_stats_t& edge(reg_t from, reg_t to)
+  {
+    return g->edges[std::make_pair(from, to)];
+  }
+
+  void run()
+  {
+    // ra and t0 both link, and a function's instructions count towards
+    // its callers' inclusive totals.
+    reset();
+    retire(JAL_RA, 0x100, F, 10);
+    retire(JAL_T0, F + 8, G, 15);
+    TEST_CHECK(depth() == 2 && top() == G);
+    retire(JR_T0, G + 4, F + 12, 25);
+    retire(RET, F + 16, 0x104, 30);
+    TEST_CHECK(depth() == 0);
+    TEST_CHECK(fn(F).calls == 1 && fn(F).self == 10 && fn(F).inclusive == 20);
+    TEST_CHECK(fn(G).calls == 1 && fn(G).self == 10 && fn(G).inclusive == 10);
+    TEST_CHECK(fn(ROOT).self == 10);
+    TEST_CHECK(edge(ROOT, F).calls == 1 && edge(ROOT, F).inclusive == 20);
+    TEST_CHECK(edge(F, G).calls == 1 && edge(F, G).inclusive == 10);
+
+    // A jalr through the register it links only calls; through the other
+    // link register, it returns and calls, as does c.jalr t0.  c.jalr
+    // through anything else calls.
+    reset();
+    retire(JAL_RA, 0x100, F, 10);
+    retire(JALR_RA_RA, F + 4, G, 20);
+    TEST_CHECK(depth() == 2 && top() == G);
+    retire(JALR_T0_RA, G + 4, H, 30);
+    TEST_CHECK(depth() == 2 && top() == H);
+    TEST_CHECK(fn(G).inclusive == 10 && edge(F, H).calls == 1);
+    retire(C_JALR_T0, H + 4, G, 40);
+    TEST_CHECK(depth() == 2 && top() == G);
+    TEST_CHECK(fn(H).inclusive == 10 && fn(G).calls == 2);
+    retire(C_JALR_A0, G + 4, H, 50);
+    TEST_CHECK(depth() == 3 && top() == H);
+    retire(C_JR_RA, H + 4, G + 6, 60);
+    TEST_CHECK(depth() == 2 && top() == G);
+
+    // A return unwinds to the frame it returns to, past the frames of tail
+    // calls; one that matches no frame pops just the innermost.
+    reset();
+    retire(JAL_RA, 0x100, F, 10);
+    retire(JAL_RA, F + 4, G, 20);
+    retire(JALR_RA_A0, G + 4, H, 30);
+    retire(JR_A0, H + 4, K, 40);
+    TEST_CHECK(depth() == 3 && top() == H);
+    retire(RET, K + 8, 0x104, 50);
+    TEST_CHECK(depth() == 0);
+    TEST_CHECK(fn(F).inclusive == 40 && fn(G).inclusive == 30 && fn(H).inclusive == 20);
+    TEST_CHECK(fn(H).self == 20);
+    retire(JAL_RA, 0x200, F, 60);
+    retire(JAL_RA, F + 4, G, 70);
+    retire(RET, G + 4, 0x999, 80);
+    TEST_CHECK(depth() == 1 && top() == F);
+
+    // A trap pushes a frame for its handler that only mret or sret pops,
+    // with whatever the handler called, once sync() sees the next batch.
+    reset();
+    retire(JAL_RA, 0x100, F, 10);
+    g->trap(HANDLER, F + 4);
+    g->sync(20);
+    TEST_CHECK(depth() == 2 && top() == HANDLER);
+    retire(JAL_RA, HANDLER + 4, G, 30);
+    retire(RET, G + 4, 0x104, 35);
+    TEST_CHECK(depth() == 2 && top() == HANDLER);
+    retire(RET, HANDLER + 8, 0x104, 40);
+    TEST_CHECK(depth() == 2 && top() == HANDLER);
+    retire(JAL_RA, HANDLER + 12, G, 45);
+    retire(MRET, G + 4, F + 4, 50);
+    TEST_CHECK(depth() == 3);
+    g->sync(50);
+    TEST_CHECK(depth() == 1 && top() == F);
+    TEST_CHECK(fn(HANDLER).calls == 1 && fn(HANDLER).inclusive == 30);
+    TEST_CHECK(fn(G).calls == 2 && fn(G).inclusive == 10);
+
+    // A stack MAX_DEPTH frames deep is unwound to the root.
+    reset();
+    for (size_t i = 1; i < callgraph_t::MAX_DEPTH; i++)
+      retire(JAL_RA, F + 4, F, i);
+    TEST_CHECK(depth() == callgraph_t::MAX_DEPTH - 1);
+    TEST_CHECK(fn(F).inclusive == 0);
+    retire(JAL_RA, 0x100, G, callgraph_t::MAX_DEPTH);
+    TEST_CHECK(depth() == 1 && top() == G);
+    TEST_CHECK(fn(F).calls == callgraph_t::MAX_DEPTH - 1);
+    TEST_CHECK(fn(F).inclusive == callgraph_t::MAX_DEPTH - 1);
+    TEST_CHECK(edge(ROOT, G).calls == 1);
+  }
+
+private:
+  processor_t* p;
+  std::unique_ptr<callgraph_t> g;
+
+  void reset() { g.reset(new callgraph_t); }
+};
+
+int main()
+{
+  test_sim_t sim(0);
+  processor_t p(DEFAULT_ISA, DEFAULT_VARCH, &sim, 0);
+  callgraph_test_t(&p).run();
+  return test_finish("callgraph");
+}
@@ -1,9 +1,23 @@
 #include "devices.h"
 #include "processor.h"
 
-clint_t::clint_t(std::vector<processor_t*>& procs)
-  : procs(procs), mtimecmp(procs.size())
+clint_t::clint_t(std::vector<processor_t*>& procs, event_queue_t& events,
+                 reg_t insns_per_tick)
+  : procs(procs), events(events), insns_per_tick(insns_per_tick),
+    mtime_offset(0), mtimecmp(procs.size())
 {
+  for (size_t i = 0; i < procs.size(); i++)
+    arm_timer(i);
+}
+
+// A reset hart comes back with MTIP clear, so raise it again if its timer
+// has already gone off.
+void clint_t::proc_reset(unsigned id)
+{
+  std::lock_guard<std::mutex> guard(lock);
+  for (size_t i = 0; i < procs.size(); i++)
+    if (procs[i]->id == id)
+      arm_timer(i);
 }
 
 /* 0000 msip hart 0
@@ -22,15 +36,20 @@ clint_t::clint_t(std::vector<processor_t*>& procs)
 
 bool clint_t::load(reg_t addr, size_t len, uint8_t* bytes)
 {
+  std::lock_guard<std::mutex> guard(lock);
   if (addr >= MSIP_BASE && addr + len <= MSIP_BASE + procs.size()*sizeof(msip_t)) {
-    std::vector<msip_t> msip(procs.size());
-    for (size_t i = 0; i < procs.size(); ++i)
-      msip[i] = !!(procs[i]->state.mip & MIP_MSIP);
-    memcpy(bytes, (uint8_t*)&msip[0] + addr - MSIP_BASE, len);
+    // msip is 0 or 1, so only the low byte of each register is nonzero
+    memset(bytes, 0, len);
+    for (size_t i = 0; i < len; i++) {
+      reg_t offset = addr - MSIP_BASE + i;
+      if (offset % sizeof(msip_t) == 0)
+        bytes[i] = !!(procs[offset / sizeof(msip_t)]->state.mip & MIP_MSIP);
+    }
   } else if (addr >= MTIMECMP_BASE && addr + len <= MTIMECMP_BASE + procs.size()*sizeof(mtimecmp_t)) {
     memcpy(bytes, (uint8_t*)&mtimecmp[0] + addr - MTIMECMP_BASE, len);
   } else if (addr >= MTIME_BASE && addr + len <= MTIME_BASE + sizeof(mtime_t)) {
-    memcpy(bytes, (uint8_t*)&mtime + addr - MTIME_BASE, len);
+    mtime_t now = mtime();
+    memcpy(bytes, (uint8_t*)&now + addr - MTIME_BASE, len);
   } else {
     return false;
   }
@@ -39,34 +58,52 @@ bool clint_t::load(reg_t addr, size_t len, uint8_t* bytes)
 
 bool clint_t::store(reg_t addr, size_t len, const uint8_t* bytes)
 {
+  std::lock_guard<std::mutex> guard(lock);
   if (addr >= MSIP_BASE && addr + len <= MSIP_BASE + procs.size()*sizeof(msip_t)) {
-    std::vector<msip_t> msip(procs.size());
-    std::vector<msip_t> mask(procs.size(), 0);
-    memcpy((uint8_t*)&msip[0] + addr - MSIP_BASE, bytes, len);
-    memset((uint8_t*)&mask[0] + addr - MSIP_BASE, 0xff, len);
-    for (size_t i = 0; i < procs.size(); ++i) {
-      if (!(mask[i] & 0xFF)) continue;
-      procs[i]->state.mip &= ~MIP_MSIP;
-      if (!!(msip[i] & 1))
-        procs[i]->state.mip |= MIP_MSIP;
+    // a write that covers the low byte of an msip register sets it
+    for (size_t i = 0; i < len; i++) {
+      reg_t offset = addr - MSIP_BASE + i;
+      if (offset % sizeof(msip_t) == 0)
+        procs[offset / sizeof(msip_t)]->set_mip(MIP_MSIP, (bytes[i] & 1) ? MIP_MSIP : 0);
     }
   } else if (addr >= MTIMECMP_BASE && addr + len <= MTIMECMP_BASE + procs.size()*sizeof(mtimecmp_t)) {
+    size_t first = (addr - MTIMECMP_BASE) / sizeof(mtimecmp_t);
+    size_t last = (addr + len - 1 - MTIMECMP_BASE) / sizeof(mtimecmp_t);
     memcpy((uint8_t*)&mtimecmp[0] + addr - MTIMECMP_BASE, bytes, len);
+    for (size_t i = first; i <= last; i++)
+      arm_timer(i);
   } else if (addr >= MTIME_BASE && addr + len <= MTIME_BASE + sizeof(mtime_t)) {
-    memcpy((uint8_t*)&mtime + addr - MTIME_BASE, bytes, len);
+    mtime_t now = mtime();
+    memcpy((uint8_t*)&now + addr - MTIME_BASE, bytes, len);
+    mtime_offset = now - events.time() / insns_per_tick;
+    for (size_t i = 0; i < procs.size(); i++)
+      arm_timer(i);
   } else {
     return false;
   }
-  increment(0);
   return true;
 }
 
-void clint_t::increment(reg_t inc)
+// Raise or lower MTIP for a hart whose mtimecmp or mtime changed. If the
+// interrupt is yet to fire, schedule an event for the instruction at which
+// mtime reaches mtimecmp. Events made stale by a later write find mtimecmp
+// changed, or mtime short of it, and do nothing.
+void clint_t::arm_timer(size_t hart)
 {
-  mtime += inc;
-  for (size_t i = 0; i < procs.size(); i++) {
-    procs[i]->state.mip &= ~MIP_MTIP;
-    if (mtime >= mtimecmp[i])
-      procs[i]->state.mip |= MIP_MTIP;
+  mtimecmp_t cmp = mtimecmp[hart];
+  if (mtime() >= cmp) {
+    procs[hart]->set_mip(MIP_MTIP, MIP_MTIP);
+    return;
   }
+
+  procs[hart]->set_mip(MIP_MTIP, 0);
+  reg_t ticks = cmp - mtime_offset;
+  if (ticks > reg_t(-1) / insns_per_tick)
+    return; // never, as far as the simulation is concerned
+
+  events.schedule(ticks * insns_per_tick, [this, hart, cmp] {
+    std::lock_guard<std::mutex> guard(lock);
+    if (mtimecmp[hart] == cmp && mtime() >= cmp)
+      procs[hart]->set_mip(MIP_MTIP, MIP_MTIP);
+  });
 }
@@ -0,0 +1,257 @@
+// See LICENSE for license details.
+
+#include "commit_log.h"
+#include <cerrno>
+#include <cinttypes>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <pthread.h>
+#include <sys/wait.h>
+
+static int print_value(char* buf, int width, uint64_t hi, uint64_t lo)
+{
+  switch (width) {
+    case 16:
+      return sprintf(buf, "0x%04" PRIx16, (uint16_t)lo);
+    case 32:
+      return sprintf(buf, "0x%08" PRIx32, (uint32_t)lo);
+    case 64:
+      return sprintf(buf, "0x%016" PRIx64, lo);
+    case 128:
+      return sprintf(buf, "0x%016" PRIx64 "%016" PRIx64, hi, lo);
+    default:
+      abort();
+  }
+}
+
+// The line is formatted in full before it is written, so an unbuffered
+// stream like stderr costs one write per instruction.
+void commit_log_print(FILE* out, int priv, int xlen, int flen, reg_t pc,
+                      insn_t insn, const commit_log_reg_t& reg,
+                      const uint64_t* mem_addr)
+{
+  char buf[128];
+  char* p = buf;
+
+  p += sprintf(p, "%1d ", priv);
+  p += print_value(p, xlen, 0, pc);
+  p += sprintf(p, " (");
+  p += print_value(p, insn.length() * 8, 0, insn.bits());
+
+  if (reg.addr) {
+    bool fp = reg.addr & 1;
+    int rd = reg.addr >> 1;
+    int size = fp ? flen : xlen;
+    p += sprintf(p, ") %c%2d ", fp ? 'f' : 'x', rd);
+    p += print_value(p, size, reg.data.v[1], reg.data.v[0]);
+  } else {
+    p += sprintf(p, ")");
+  }
+  if (mem_addr)
+    p += sprintf(p, " mem 0x%016" PRIx64, *mem_addr);
+  p += sprintf(p, "\n");
+
+  fwrite(buf, 1, p - buf, out);
+}
+
+bool commit_log_decode(const std::vector<uint8_t>& records, size_t* pos,
+                       commit_log_record_t* r, commit_log_reg_t* reg,
+                       uint64_t* mem_addr)
+{
+  if (*pos + sizeof(*r) > records.size())
+    return false;
+  memcpy(r, &records[*pos], sizeof(*r));
+  *pos += sizeof(*r);
+
+  memset(reg, 0, sizeof(*reg));
+  if (r->flags & COMMIT_LOG_REG) {
+    bool fp = r->flags & COMMIT_LOG_FREG;
+    size_t bytes = fp && r->flen == 128 ? 16 : 8;
+    if (*pos + bytes > records.size())
+      return false;
+    reg->addr = (reg_t(r->reg) << 1) | fp;
+    memcpy(&reg->data, &records[*pos], bytes);
+    *pos += bytes;
+  }
+
+  if (r->flags & COMMIT_LOG_MEM) {
+    if (*pos + sizeof(*mem_addr) > records.size())
+      return false;
+    memcpy(mem_addr, &records[*pos], sizeof(*mem_addr));
+    *pos += sizeof(*mem_addr);
+  }
+  return true;
+}
+
+std::string shell_quote(const std::string& s)
+{
+  std::string quoted = "'";
+  for (char c : s) {
+    if (c == '\'')
+      quoted += "'\\''";
+    else
+      quoted += c;
+  }
+  return quoted + "'";
+}
+
+bool command_exists(const char* cmd)
+{
+  std::string program(cmd, strcspn(cmd, " "));
+  std::string probe = "command -v " + shell_quote(program) + " > /dev/null 2>&1";
+  return system(probe.c_str()) == 0;
+}
+
+std::string pclose_error(FILE* pipe)
+{
+  int status = pclose(pipe);
+  if (status == -1)
+    return strerror(errno);
+  if (WIFSIGNALED(status))
+    return "killed by signal " + std::to_string(WTERMSIG(status));
+  if (WEXITSTATUS(status) != 0)
+    return "exited with status " + std::to_string(WEXITSTATUS(status));
+  return "";
+}
+
+static bool ends_with(const std::string& s, const std::string& suffix)
+{
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+commit_log_writer_t::commit_log_writer_t(const char* path)
+  : name(path), piped(false), failed(false), exiting(false)
+{
+  const char* compressor = ends_with(name, ".zst") ? "zstd -q -c" :
+                           ends_with(name, ".lz4") ? "lz4 -q -c" :
+                           ends_with(name, ".gz") ? "gzip -c" : NULL;
+  if (compressor) {
+    // The shell starts even if the compressor doesn't.
+    if (!command_exists(compressor)) {
+      std::cerr << "Unable to open commit log " << name << ": cannot run "
+                << compressor << std::endl;
+      exit(1);
+    }
+    std::string cmd = std::string(compressor) + " > " + shell_quote(name);
+    file = popen(cmd.c_str(), "w");
+    piped = true;
+  } else {
+    file = fopen(path, "wb");
+  }
+
+  if (!file) {
+    std::cerr << "Unable to open commit log " << name << ": " << strerror(errno) << std::endl;
+    exit(1);
+  }
+
+  thread = std::thread(&commit_log_writer_t::main, this);
+}
+
+commit_log_writer_t::~commit_log_writer_t()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    exiting = true;
+  }
+  ready.notify_one();
+  thread.join();
+}
+
+void commit_log_writer_t::write(uint32_t hartid, std::vector<uint8_t>& records)
+{
+  {
+    std::unique_lock<std::mutex> guard(lock);
+    space.wait(guard, [&]{ return queue.size() < MAX_QUEUED; });
+    queue.emplace_back(hartid, std::move(records));
+  }
+  records.clear();
+  ready.notify_one();
+}
+
+// If the compressor exits early, writes to the pipe fail with EPIPE rather
+// than raise SIGPIPE and kill spike.  Only this thread writes to the file,
+// closing included, so only it blocks the signal.
+void commit_log_writer_t::main()
+{
+  sigset_t sigpipe;
+  sigemptyset(&sigpipe);
+  sigaddset(&sigpipe, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &sigpipe, NULL);
+
+  put(COMMIT_LOG_MAGIC, strlen(COMMIT_LOG_MAGIC));
+
+  std::unique_lock<std::mutex> guard(lock);
+  while (true) {
+    ready.wait(guard, [&]{ return !queue.empty() || exiting; });
+    if (queue.empty())
+      break;
+
+    auto chunk = std::move(queue.front());
+    queue.pop_front();
+    guard.unlock();
+    space.notify_all();
+
+    commit_log_chunk_t header = {chunk.first, uint32_t(chunk.second.size())};
+    put(&header, sizeof(header));
+    put(chunk.second.data(), chunk.second.size());
+
+    guard.lock();
+  }
+  guard.unlock();
+
+  if (piped) {
+    std::string error = pclose_error(file);
+    if (!error.empty())
+      std::cerr << "Unable to write commit log " << name << ": compressor "
+                << error << std::endl;
+  } else if (fclose(file) != 0 && !failed) {
+    std::cerr << "Unable to write commit log " << name << ": " << strerror(errno) << std::endl;
+  }
+}
+
+void commit_log_writer_t::put(const void* data, size_t bytes)
+{
+  if (!failed && fwrite(data, 1, bytes, file) != bytes) {
+    std::cerr << "Unable to write commit log " << name << ": " << strerror(errno) << std::endl;
+    failed = true;
+  }
+}
+
+void commit_log_buffer_t::record(int priv, int xlen, int flen, reg_t pc,
+                                 insn_t insn, const commit_log_reg_t& reg)
+{
+  commit_log_record_t r;
+  r.pc = pc;
+  r.insn = insn.bits();
+  r.flags = (xlen == 64 ? COMMIT_LOG_RV64 : 0) |
+            (reg.addr ? COMMIT_LOG_REG : 0) |
+            (reg.addr & 1 ? COMMIT_LOG_FREG : 0) |
+            (mem_valid ? COMMIT_LOG_MEM : 0);
+  r.priv = priv;
+  r.reg = reg.addr >> 1;
+  r.flen = flen;
+
+  size_t value_bytes = !reg.addr ? 0 : (reg.addr & 1) && flen == 128 ? 16 : 8;
+  size_t n = records.size();
+  records.resize(n + sizeof(r) + value_bytes + (mem_valid ? sizeof(mem_addr) : 0));
+  uint8_t* p = &records[n];
+  memcpy(p, &r, sizeof(r));
+  p += sizeof(r);
+  memcpy(p, &reg.data, value_bytes);
+  p += value_bytes;
+  if (mem_valid)
+    memcpy(p, &mem_addr, sizeof(mem_addr));
+
+  if (records.size() >= FLUSH_BYTES)
+    flush();
+}
+
+void commit_log_buffer_t::flush()
+{
+  if (!records.empty())
+    writer->write(hartid, records);
+}
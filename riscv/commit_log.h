@@ -0,0 +1,140 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_COMMIT_LOG_H
+#define _RISCV_COMMIT_LOG_H
+
+#include "processor.h"
+#include "memtracer.h"
+#include <cstdint>
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// Binary commit log format.  A file starts with the 8 bytes of
+// COMMIT_LOG_MAGIC and goes on with chunks, each a commit_log_chunk_t
+// followed by that many bytes of records retired by one hart, in order.
+// A record is a commit_log_record_t, then the value written if
+// COMMIT_LOG_REG is set (16 bytes for a 128-bit FP register, else 8), then
+// the physical address of the memory access if COMMIT_LOG_MEM is set (8
+// bytes).  Everything is in host byte order.
+#define COMMIT_LOG_MAGIC "SPIKECL1"
+
+enum {
+  COMMIT_LOG_REG = 1,  // wrote register reg
+  COMMIT_LOG_FREG = 2, // reg is an FP register
+  COMMIT_LOG_MEM = 4,  // accessed memory
+  COMMIT_LOG_RV64 = 8, // XLEN was 64 rather than 32
+};
+
+struct commit_log_chunk_t
+{
+  uint32_t hartid;
+  uint32_t bytes;
+};
+
+struct commit_log_record_t
+{
+  uint64_t pc;
+  uint32_t insn; // every instruction spike implements fits
+  uint8_t flags;
+  uint8_t priv;
+  uint8_t reg;
+  uint8_t flen;
+};
+
+// Print one retired instruction in the text commit log format, followed by
+// the address of its memory access if mem_addr isn't NULL.
+void commit_log_print(FILE* out, int priv, int xlen, int flen, reg_t pc,
+                      insn_t insn, const commit_log_reg_t& reg,
+                      const uint64_t* mem_addr = NULL);
+
+// Decode the record at *pos in a chunk's records, moving *pos past it.
+// reg.addr is 0 if the instruction wrote no register, and *mem_addr is only
+// set if r->flags has COMMIT_LOG_MEM.  Returns false if the record runs
+// past the end of the chunk.
+bool commit_log_decode(const std::vector<uint8_t>& records, size_t* pos,
+                       commit_log_record_t* r, commit_log_reg_t* reg,
+                       uint64_t* mem_addr);
+
+// s quoted for the shell, for the commands that compress and decompress
+// commit logs.
+std::string shell_quote(const std::string& s);
+
+// Whether the program that starts the shell command cmd can be found, so
+// that a missing compressor is reported before anything is written.
+bool command_exists(const char* cmd);
+
+// pclose(pipe), and why the command failed if it did: an empty string if
+// it exited with status 0.
+std::string pclose_error(FILE* pipe);
+
+// Writes chunks of records to a file on a thread of its own, so a hart only
+// pays for copying its records into a buffer, unless MAX_QUEUED chunks are
+// already waiting, when it waits for the file to catch up.  A file name
+// ending in .zst, .lz4 or .gz is piped through zstd, lz4 or gzip.  A failed
+// write is reported, and the rest of the log dropped, without stopping the
+// simulation.
+class commit_log_writer_t
+{
+ public:
+  commit_log_writer_t(const char* path);
+  ~commit_log_writer_t();
+  // Queue records for writing, leaving records empty.
+  void write(uint32_t hartid, std::vector<uint8_t>& records);
+
+ private:
+  static const size_t MAX_QUEUED = 64;
+  std::string name;
+  FILE* file;
+  bool piped;
+  bool failed; // a write failed; only the thread touches file after open
+  std::thread thread;
+  std::mutex lock;
+  std::condition_variable ready; // the queue isn't empty
+  std::condition_variable space; // the queue isn't full
+  std::deque<std::pair<uint32_t, std::vector<uint8_t>>> queue;
+  bool exiting;
+  void main();
+  void put(const void* data, size_t bytes);
+};
+
+// One hart's side of the binary commit log.  It is also a memtracer on the
+// hart's MMU, which tells it the address of each load and store while
+// commit logging is enabled.
+class commit_log_buffer_t : public memtracer_t
+{
+ public:
+  commit_log_buffer_t(commit_log_writer_t* writer, processor_t* proc, uint32_t hartid)
+    : writer(writer), proc(proc), hartid(hartid), mem_valid(false) {}
+  ~commit_log_buffer_t() { flush(); }
+
+  bool interested_in_range(uint64_t begin, uint64_t end, access_type type) {
+    return type != FETCH && proc->get_log_commits();
+  }
+  void trace(uint64_t addr, size_t bytes, access_type type) {
+    mem_addr = addr;
+    mem_valid = true;
+  }
+
+  // Called before and after each instruction executes.
+  void start() { mem_valid = false; }
+  void record(int priv, int xlen, int flen, reg_t pc, insn_t insn,
+              const commit_log_reg_t& reg);
+  void flush();
+
+ private:
+  static const size_t FLUSH_BYTES = 256 * 1024;
+  commit_log_writer_t* writer;
+  processor_t* proc;
+  uint32_t hartid;
+  std::vector<uint8_t> records;
+  uint64_t mem_addr;
+  bool mem_valid;
+};
+
+#endif
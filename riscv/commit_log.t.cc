@@ -0,0 +1,122 @@
+// See LICENSE for license details.
+
+// Check that the binary commit log round-trips: records written through
+// commit_log_buffer_t and commit_log_writer_t, then decoded the way
+// spike-trace decodes them, print the same text as the instructions they
+// were made from, and a chunk cut short doesn't decode.
+
+#include "config.h"
+#include "commit_log.h"
+#include "test_sim.h"
+#include <cstdlib>
+#include <unistd.h>
+
+struct retired_t
+{
+  int priv, xlen, flen;
+  reg_t pc;
+  insn_bits_t insn;
+  commit_log_reg_t reg;
+  bool has_mem;
+  uint64_t mem_addr;
+};
+
+static const retired_t retired[] = {
+  // addi a0, a0, 1
+  {PRV_M, 64, 64, 0x80000000, 0x00150513, {10 << 1, {{0xfedcba9876543210, 0}}}, false, 0},
+  // addi a0, a0, 1 on RV32
+  {PRV_U, 32, 64, 0x80000004, 0x00150513, {10 << 1, {{0x89abcdef, 0}}}, false, 0},
+  // c.li a1, 3
+  {PRV_S, 64, 64, 0x80000008, 0x458d, {11 << 1, {{3, 0}}}, false, 0},
+  // fadd.d fa0, fa1, fa2
+  {PRV_M, 64, 64, 0x8000000a, 0x02c58553, {10 << 1 | 1, {{0x400921fb54442d18, 0}}}, false, 0},
+  // fadd.q fa0, fa1, fa2
+  {PRV_M, 64, 128, 0x8000000e, 0x06c58553, {10 << 1 | 1, {{0x8000000000000001, 0x4000921fb54442d1}}}, false, 0},
+  // fence
+  {PRV_M, 64, 64, 0x80000012, 0x0ff0000f, {0, {{0, 0}}}, false, 0},
+  // ld a2, 8(a0)
+  {PRV_M, 64, 64, 0x80000016, 0x00853603, {12 << 1, {{0x1122334455667788, 0}}}, true, 0x80001008},
+  // sd a2, 16(a0)
+  {PRV_M, 64, 64, 0x8000001a, 0x00c53823, {0, {{0, 0}}}, true, 0x80001010},
+  // fld fa3, 0(a0) on RV32
+  {PRV_M, 32, 64, 0x8000001e, 0x00053687, {13 << 1 | 1, {{0xc000000000000000, 0}}}, true, 0x80001000},
+};
+static const size_t RETIRED = sizeof(retired) / sizeof(retired[0]);
+
+int main()
+{
+  test_sim_t sim(0);
+  processor_t p(DEFAULT_ISA, DEFAULT_VARCH, &sim, 0);
+
+  char path[] = "/tmp/commit_log.t.XXXXXX";
+  int fd = mkstemp(path);
+  TEST_CHECK(fd >= 0);
+  close(fd);
+
+  char* expected;
+  size_t expected_size;
+  FILE* text = open_memstream(&expected, &expected_size);
+  {
+    commit_log_writer_t writer(path);
+    commit_log_buffer_t buffer(&writer, &p, 3);
+    for (auto& i : retired) {
+      buffer.start();
+      if (i.has_mem)
+        buffer.trace(i.mem_addr, 8, LOAD);
+      buffer.record(i.priv, i.xlen, i.flen, i.pc, insn_t(i.insn), i.reg);
+      commit_log_print(text, i.priv, i.xlen, i.flen, i.pc, insn_t(i.insn), i.reg,
+                       i.has_mem ? &i.mem_addr : NULL);
+    }
+  }
+  fclose(text);
+
+  FILE* in = fopen(path, "rb");
+  TEST_CHECK(in != NULL);
+  char magic[sizeof(COMMIT_LOG_MAGIC) - 1];
+  TEST_CHECK(fread(magic, 1, sizeof(magic), in) == sizeof(magic));
+  TEST_CHECK(memcmp(magic, COMMIT_LOG_MAGIC, sizeof(magic)) == 0);
+  commit_log_chunk_t chunk;
+  TEST_CHECK(fread(&chunk, sizeof(chunk), 1, in) == 1);
+  TEST_CHECK(chunk.hartid == 3);
+  std::vector<uint8_t> records(chunk.bytes);
+  TEST_CHECK(fread(records.data(), 1, chunk.bytes, in) == chunk.bytes);
+  TEST_CHECK(fread(&chunk, 1, 1, in) == 0);
+  fclose(in);
+  unlink(path);
+
+  char* actual;
+  size_t actual_size;
+  text = open_memstream(&actual, &actual_size);
+  size_t decoded = 0;
+  for (size_t pos = 0; pos < records.size(); decoded++) {
+    commit_log_record_t r;
+    commit_log_reg_t reg;
+    uint64_t mem_addr;
+    if (!commit_log_decode(records, &pos, &r, &reg, &mem_addr)) {
+      TEST_CHECK(!"record runs past the end of the chunk");
+      break;
+    }
+    int xlen = r.flags & COMMIT_LOG_RV64 ? 64 : 32;
+    commit_log_print(text, r.priv, xlen, r.flen, r.pc, insn_t(r.insn), reg,
+                     r.flags & COMMIT_LOG_MEM ? &mem_addr : NULL);
+  }
+  fclose(text);
+  TEST_CHECK(decoded == RETIRED);
+  TEST_CHECK(actual_size == expected_size && memcmp(actual, expected, actual_size) == 0);
+  if (test_failures)
+    printf("expected:\n%sactual:\n%s", expected, actual);
+  free(expected);
+  free(actual);
+
+  // Every record but the last still decodes from a chunk that ends early.
+  records.pop_back();
+  size_t pos = 0;
+  commit_log_record_t r;
+  commit_log_reg_t reg;
+  uint64_t mem_addr;
+  for (size_t i = 0; i + 1 < RETIRED; i++)
+    TEST_CHECK(commit_log_decode(records, &pos, &r, &reg, &mem_addr));
+  TEST_CHECK(!commit_log_decode(records, &pos, &r, &reg, &mem_addr));
+
+  return test_finish("commit_log");
+}
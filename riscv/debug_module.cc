@@ -113,7 +113,7 @@ void debug_module_t::reset()
 }
 
 void debug_module_t::add_device(bus_t *bus) {
-  bus->add_device(DEBUG_START, this);
+  bus->add_device(DEBUG_START, this, "debug");
 }
 
 bool debug_module_t::load(reg_t addr, size_t len, uint8_t* bytes)
@@ -203,6 +203,7 @@ bool debug_module_t::store(reg_t addr, size_t len, const uint8_t* bytes)
               hart_state[i].haltgroup == hart_state[id].haltgroup) {
             processor_t *proc = sim->get_core(i);
             proc->halt_request = true;
+            sim->proc_wake(proc);
             // TODO: What if the debugger comes and writes dmcontrol before the
             // halt occurs?
           }
@@ -402,7 +403,11 @@ bool debug_module_t::dmi_read(unsigned address, uint32_t *value)
           dmstatus.allnonexistant = true;
           dmstatus.allresumeack = true;
           dmstatus.anyresumeack = false;
-          for (unsigned i = 0; i < nprocs; i++) {
+          // Without hasel, only hartsel can be selected, so there's no need
+          // to visit every hart.
+          unsigned first = dmcontrol.hasel ? 0 : dmcontrol.hartsel;
+          unsigned last = dmcontrol.hasel ? nprocs : std::min(dmcontrol.hartsel + 1, nprocs);
+          for (unsigned i = first; i < last; i++) {
             if (hart_selected(i)) {
               dmstatus.allnonexistant = false;
               if (hart_state[i].resumeack) {
@@ -768,6 +773,7 @@ bool debug_module_t::dmi_write(unsigned address, uint32_t value)
                 proc->halt_request = dmcontrol.haltreq;
                 if (dmcontrol.haltreq) {
                   D(fprintf(stderr, "halt hart %d\n", i));
+                  sim->proc_wake(proc);
                 }
                 if (dmcontrol.resumereq) {
                   D(fprintf(stderr, "resume hart %d\n", i));
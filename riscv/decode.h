@@ -16,6 +16,7 @@
 #include <string.h>
 #include <strings.h>
 #include "encoding.h"
+#include "hpm_encoding.h"
 #include "config.h"
 #include "common.h"
 #include "softfloat_types.h"
@@ -157,21 +158,23 @@ private:
 #define RS3 READ_REG(insn.rs3())
 #define WRITE_RD(value) WRITE_REG(insn.rd(), value)
 
-#ifndef RISCV_ENABLE_COMMITLOG
-# define WRITE_REG(reg, value) STATE.XPR.write(reg, value)
-# define WRITE_FREG(reg, value) DO_WRITE_FREG(reg, freg(value))
-#else
-# define WRITE_REG(reg, value) ({ \
+// Handlers compiled with DECODE_MACRO_USAGE_LOGGED set to 1 record their
+// register writes for the commit log; see insn_template.cc.
+#ifndef DECODE_MACRO_USAGE_LOGGED
+# define DECODE_MACRO_USAGE_LOGGED 0
+#endif
+#define WRITE_REG(reg, value) ({ \
     reg_t wdata = (value); /* value may have side effects */ \
-    STATE.log_reg_write = (commit_log_reg_t){(reg) << 1, {wdata, 0}}; \
+    if (DECODE_MACRO_USAGE_LOGGED) \
+      STATE.log_reg_write = (commit_log_reg_t){(reg) << 1, {wdata, 0}}; \
     STATE.XPR.write(reg, wdata); \
   })
-# define WRITE_FREG(reg, value) ({ \
+#define WRITE_FREG(reg, value) ({ \
     freg_t wdata = freg(value); /* value may have side effects */ \
-    STATE.log_reg_write = (commit_log_reg_t){((reg) << 1) | 1, wdata}; \
+    if (DECODE_MACRO_USAGE_LOGGED) \
+      STATE.log_reg_write = (commit_log_reg_t){((reg) << 1) | 1, wdata}; \
     DO_WRITE_FREG(reg, wdata); \
   })
-#endif
 
 // RVC macros
 #define WRITE_RVC_RS1S(value) WRITE_REG(insn.rvc_rs1s(), value)
@@ -237,18 +240,47 @@ private:
 
 class wait_for_interrupt_t {};
 
+/* WFI always ends a decoded block, so it returns its sentinel PC rather than
+   throwing; processor_t::step() then stalls the hart. */
 #define wfi() \
   do { set_pc_and_serialize(npc); \
-       npc = PC_SERIALIZE_WFI; \
-       throw wait_for_interrupt_t(); \
+       return PC_SERIALIZE_WFI; \
      } while(0)
 
 #define serialize() set_pc_and_serialize(npc)
 
+/* Take trap t without unwinding the host stack.  step() checks for
+   PC_SERIALIZE_TRAP after every instruction, in or at the end of a block. */
+#define defer_trap(t) \
+  do { auto __trap = (t); \
+       STATE.deferred_trap = {__trap.cause(), __trap.get_tval(), \
+                              __trap.has_tval(), __trap.name()}; \
+       return PC_SERIALIZE_TRAP; \
+     } while(0)
+
+/* Loads and stores through these have a page, access or misaligned fault
+   taken as a deferred trap rather than thrown. */
+#define MMU_LOAD(type, addr) ({ \
+    auto __val = MMU.load_##type(addr, true); \
+    if (unlikely(MMU.faulted)) { \
+      MMU.faulted = false; \
+      return PC_SERIALIZE_TRAP; \
+    } \
+    __val; \
+  })
+#define MMU_STORE(type, addr, val) \
+  do { MMU.store_##type(addr, val, true); \
+       if (unlikely(MMU.faulted)) { \
+         MMU.faulted = false; \
+         return PC_SERIALIZE_TRAP; \
+       } \
+     } while(0)
+
 /* Sentinel PC values to serialize simulator pipeline */
 #define PC_SERIALIZE_BEFORE 3
 #define PC_SERIALIZE_AFTER 5
 #define PC_SERIALIZE_WFI 7
+#define PC_SERIALIZE_TRAP 9
 #define invalid_pc(pc) ((pc) & 1)
 
 /* Convenience wrappers to simplify softfloat code sequences */
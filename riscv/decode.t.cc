@@ -0,0 +1,64 @@
+// See LICENSE for license details.
+
+// Check processor_t's decode tree against the linear search it replaced:
+// the first instruction, in the order build_opcode_map sorts them into,
+// whose mask and match fit the bits.
+
+#include "config.h"
+#include "processor.h"
+#include "test_sim.h"
+#include <cinttypes>
+#include <random>
+
+class decode_test_t
+{
+public:
+  decode_test_t(processor_t* p) : p(p) {}
+
+  insn_func_t linear(insn_bits_t bits)
+  {
+    for (auto& desc : p->instructions)
+      if ((bits & desc.mask) == desc.match)
+        return p->get_xlen() == 64 ? desc.rv64 : desc.rv32;
+    return NULL;
+  }
+
+  void check(insn_bits_t bits)
+  {
+    if (p->decode_insn(insn_t(bits)) != linear(bits)) {
+      TEST_CHECK(p->decode_insn(insn_t(bits)) == linear(bits));
+      printf("  isa %s, bits 0x%08" PRIx64 "\n", p->get_isa_string().c_str(), bits);
+    }
+  }
+
+  void run()
+  {
+    std::mt19937_64 rng(1);
+
+    // every instruction, with its don't-care bits filled in at random
+    for (auto& desc : p->instructions)
+      for (int i = 0; i < 64; i++)
+        check(((rng() & ~desc.mask) | desc.match) & 0xffffffff);
+
+    // the encodings that decode to nothing in particular
+    for (int i = 0; i < 1000000; i++) {
+      insn_bits_t bits = rng() & 0xffffffff;
+      check(bits);
+      check(bits & 0xffff);
+    }
+  }
+
+private:
+  processor_t* p;
+};
+
+int main()
+{
+  test_sim_t sim(0);
+  const char* isas[] = {DEFAULT_ISA, "RV32IMAFDC", "RV64IMAFDQC"};
+  for (auto isa : isas) {
+    processor_t p(isa, DEFAULT_VARCH, &sim, 0);
+    decode_test_t(&p).run();
+  }
+  return test_finish("decode");
+}
@@ -1,13 +1,13 @@
 #include "devices.h"
 
-void bus_t::add_device(reg_t addr, abstract_device_t* dev)
+void bus_t::add_device(reg_t addr, abstract_device_t* dev, const std::string& name)
 {
   // Searching devices via lower_bound/upper_bound
   // implicitly relies on the underlying std::map 
   // container to sort the keys and provide ordered
   // iteration over this sort, which it does. (python's
   // SortedDict is a good analogy)
-  devices[addr] = dev;
+  devices[addr] = {dev, name, 0, 0};
 }
 
 bool bus_t::load(reg_t addr, size_t len, uint8_t* bytes)
@@ -24,7 +24,8 @@ bool bus_t::load(reg_t addr, size_t len, uint8_t* bytes)
   // The iterator points to the device after this, so
   // go back by one item.
   it--;
-  return it->second->load(addr - it->first, len, bytes);
+  __atomic_fetch_add(&it->second.loads, 1, __ATOMIC_RELAXED);
+  return it->second.dev->load(addr - it->first, len, bytes);
 }
 
 bool bus_t::store(reg_t addr, size_t len, const uint8_t* bytes)
@@ -35,7 +36,8 @@ bool bus_t::store(reg_t addr, size_t len, const uint8_t* bytes)
     return false;
   }
   it--;
-  return it->second->store(addr - it->first, len, bytes);
+  __atomic_fetch_add(&it->second.stores, 1, __ATOMIC_RELAXED);
+  return it->second.dev->store(addr - it->first, len, bytes);
 }
 
 std::pair<reg_t, abstract_device_t*> bus_t::find_device(reg_t addr)
@@ -46,5 +48,15 @@ std::pair<reg_t, abstract_device_t*> bus_t::find_device(reg_t addr)
     return std::make_pair((reg_t)0, (abstract_device_t*)NULL);
   }
   it--;
-  return std::make_pair(it->first, it->second);
+  return std::make_pair(it->first, it->second.dev);
+}
+
+std::vector<bus_t::device_stats_t> bus_t::get_device_stats()
+{
+  std::vector<device_stats_t> stats;
+  for (auto& d : devices)
+    stats.push_back({d.first, d.second.name,
+                     __atomic_load_n(&d.second.loads, __ATOMIC_RELAXED),
+                     __atomic_load_n(&d.second.stores, __ATOMIC_RELAXED)});
+  return stats;
 }
@@ -2,9 +2,11 @@
 #define _RISCV_DEVICES_H
 
 #include "decode.h"
+#include "events.h"
 #include <cstdlib>
 #include <string>
 #include <map>
+#include <mutex>
 #include <vector>
 
 class processor_t;
@@ -20,12 +22,30 @@ class bus_t : public abstract_device_t {
  public:
   bool load(reg_t addr, size_t len, uint8_t* bytes);
   bool store(reg_t addr, size_t len, const uint8_t* bytes);
-  void add_device(reg_t addr, abstract_device_t* dev);
+  // name labels the device in the simulator's statistics
+  void add_device(reg_t addr, abstract_device_t* dev, const std::string& name = "");
 
   std::pair<reg_t, abstract_device_t*> find_device(reg_t addr);
 
+  // The loads and stores that have reached each device through the bus,
+  // in order of base address.  Harts on different host threads may use the
+  // bus at once, so the counts are kept with atomic adds.
+  struct device_stats_t {
+    reg_t base;
+    std::string name;
+    uint64_t loads;
+    uint64_t stores;
+  };
+  std::vector<device_stats_t> get_device_stats();
+
  private:
-  std::map<reg_t, abstract_device_t*> devices;
+  struct device_t {
+    abstract_device_t* dev;
+    std::string name;
+    uint64_t loads;
+    uint64_t stores;
+  };
+  std::map<reg_t, device_t> devices;
 };
 
 class rom_device_t : public abstract_device_t {
@@ -62,18 +82,26 @@ class mem_t : public abstract_device_t {
 
 class clint_t : public abstract_device_t {
  public:
-  clint_t(std::vector<processor_t*>&);
+  clint_t(std::vector<processor_t*>&, event_queue_t& events, reg_t insns_per_tick);
   bool load(reg_t addr, size_t len, uint8_t* bytes);
   bool store(reg_t addr, size_t len, const uint8_t* bytes);
   size_t size() { return CLINT_SIZE; }
-  void increment(reg_t inc);
+  void proc_reset(unsigned id);
  private:
   typedef uint64_t mtime_t;
   typedef uint64_t mtimecmp_t;
   typedef uint32_t msip_t;
   std::vector<processor_t*>& procs;
-  mtime_t mtime;
+  // mtime is derived from simulated time rather than stored, so it costs
+  // nothing to keep up to date
+  event_queue_t& events;
+  reg_t insns_per_tick;
+  mtime_t mtime_offset;
   std::vector<mtimecmp_t> mtimecmp;
+  // harts on different host threads may access the CLINT concurrently
+  std::mutex lock;
+  mtime_t mtime() { return mtime_offset + events.time() / insns_per_tick; }
+  void arm_timer(size_t hart);
 };
 
 #endif
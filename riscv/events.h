@@ -0,0 +1,60 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_EVENTS_H
+#define _RISCV_EVENTS_H
+
+#include "decode.h"
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <mutex>
+
+// Callbacks that devices want run at a given simulated time.  Time is
+// measured in instructions retired by each hart, and only moves forward when
+// sim_t finishes a round, so events run on the simulation thread while no
+// hart is executing.  schedule() may be called from any hart's thread.
+class event_queue_t
+{
+ public:
+  event_queue_t() : now(0) {}
+
+  reg_t time() const { return now; }
+
+  // Time of the earliest pending event, or reg_t(-1) if there is none.
+  reg_t next()
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    return events.empty() ? reg_t(-1) : events.begin()->first;
+  }
+
+  void schedule(reg_t when, std::function<void()> callback)
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    events.insert(std::make_pair(when, std::move(callback)));
+  }
+
+  // Advance time to t, running the events that come due in time order.
+  void advance(reg_t t)
+  {
+    while (true) {
+      std::function<void()> callback;
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        if (events.empty() || events.begin()->first > t)
+          break;
+        now = std::max(now, events.begin()->first);
+        callback = std::move(events.begin()->second);
+        events.erase(events.begin());
+      }
+      callback();
+    }
+    now = t;
+  }
+
+ private:
+  reg_t now;
+  std::multimap<reg_t, std::function<void()>> events;
+  std::mutex lock;
+};
+
+#endif
@@ -2,71 +2,36 @@
 
 #include "processor.h"
 #include "mmu.h"
+#include "jit.h"
+#include "commit_log.h"
+#include "profiler.h"
+#include "callgraph.h"
 #include <cassert>
 
 
 static void commit_log_stash_privilege(processor_t* p)
 {
-#ifdef RISCV_ENABLE_COMMITLOG
   state_t* state = p->get_state();
   state->last_inst_priv = state->prv;
   state->last_inst_xlen = p->get_xlen();
   state->last_inst_flen = p->get_flen();
-#endif
+  if (commit_log_buffer_t* buffer = p->get_commit_log())
+    buffer->start();
 }
 
-static void commit_log_print_value(int width, uint64_t hi, uint64_t lo)
+static void commit_log_print_insn(processor_t* p, reg_t pc, insn_t insn)
 {
-  switch (width) {
-    case 16:
-      fprintf(stderr, "0x%04" PRIx16, (uint16_t)lo);
-      break;
-    case 32:
-      fprintf(stderr, "0x%08" PRIx32, (uint32_t)lo);
-      break;
-    case 64:
-      fprintf(stderr, "0x%016" PRIx64, lo);
-      break;
-    case 128:
-      fprintf(stderr, "0x%016" PRIx64 "%016" PRIx64, hi, lo);
-      break;
-    default:
-      abort();
-  }
-}
-
-static void commit_log_print_insn(state_t* state, reg_t pc, insn_t insn)
-{
-#ifdef RISCV_ENABLE_COMMITLOG
+  state_t* state = p->get_state();
   auto& reg = state->log_reg_write;
   int priv = state->last_inst_priv;
   int xlen = state->last_inst_xlen;
   int flen = state->last_inst_flen;
 
-  fprintf(stderr, "%1d ", priv);
-  commit_log_print_value(xlen, 0, pc);
-  fprintf(stderr, " (");
-  commit_log_print_value(insn.length() * 8, 0, insn.bits());
-
-  if (reg.addr) {
-    bool fp = reg.addr & 1;
-    int rd = reg.addr >> 1;
-    int size = fp ? flen : xlen;
-    fprintf(stderr, ") %c%2d ", fp ? 'f' : 'x', rd);
-    commit_log_print_value(size, reg.data.v[1], reg.data.v[0]);
-    fprintf(stderr, "\n");
-  } else {
-    fprintf(stderr, ")\n");
-  }
+  if (commit_log_buffer_t* buffer = p->get_commit_log())
+    buffer->record(priv, xlen, flen, pc, insn, reg);
+  else
+    commit_log_print(stderr, priv, xlen, flen, pc, insn, reg);
   reg.addr = 0;
-#endif
-}
-
-inline void processor_t::update_histogram(reg_t pc)
-{
-#ifdef RISCV_ENABLE_HISTOGRAM
-  pc_histogram[pc]++;
-#endif
 }
 
 // This is expected to be inlined by the compiler so each use of execute_insn
@@ -74,23 +39,118 @@ inline void processor_t::update_histogram(reg_t pc)
 // function calls.
 static reg_t execute_insn(processor_t* p, reg_t pc, insn_fetch_t fetch)
 {
-  commit_log_stash_privilege(p);
+  return fetch.func(p, fetch.insn, pc);
+}
+
+// The slow path's version of execute_insn, which also feeds the commit log
+// when it is enabled. While commit logging is enabled, fetch.func is a
+// logged handler that records its register write.
+static reg_t execute_insn_logged(processor_t* p, reg_t pc, insn_fetch_t fetch)
+{
+  bool log_commits = p->get_log_commits();
+  if (log_commits)
+    commit_log_stash_privilege(p);
   reg_t npc = fetch.func(p, fetch.insn, pc);
-  if (npc != PC_SERIALIZE_BEFORE) {
-    commit_log_print_insn(p->get_state(), pc, fetch.insn);
-    p->update_histogram(pc);
+  if (npc != PC_SERIALIZE_BEFORE && npc != PC_SERIALIZE_TRAP) {
+    if (log_commits)
+      commit_log_print_insn(p, pc, fetch.insn);
   }
   return npc;
 }
 
+// How many of the first len instructions of the block at pc run before it
+// reaches the pc range of the trace window.  The first always runs: step()
+// stopped before it if it was in the range.
+size_t processor_t::insns_before_trace_pc(reg_t pc, const insn_fetch_t* fetch, size_t len)
+{
+  for (size_t i = 1; i < len; i++) {
+    insn_t insn = fetch[i - 1].insn;
+    pc += insn_length(insn.bits());
+    if (entering_trace_pc(pc))
+      return i;
+  }
+  return len;
+}
+
+// Snapshot the registers and the number of stores the first time around a
+// suspected spin loop, and compare against the snapshot the next time
+// around.
+bool processor_t::spin_state_unchanged()
+{
+  uint64_t stores = mmu->get_tlb_hits(STORE) + mmu->get_tlb_slow_paths(STORE);
+  if (spin_count == SPIN_ITERATIONS) {
+    for (size_t i = 0; i < NXPR; i++)
+      spin_regs[i] = state.XPR[i];
+    for (size_t i = 0; i < NFPR; i++)
+      spin_fregs[i] = state.FPR[i];
+    spin_stores = stores;
+    return false;
+  }
+
+  spin_count = 0;
+  if (stores != spin_stores)
+    return false;
+  for (size_t i = 0; i < NXPR; i++) {
+    if (spin_regs[i] != state.XPR[i])
+      return false;
+  }
+  for (size_t i = 0; i < NFPR; i++) {
+    if (spin_fregs[i].v[0] != state.FPR[i].v[0] || spin_fregs[i].v[1] != state.FPR[i].v[1])
+      return false;
+  }
+  return true;
+}
+
+void processor_t::take_deferred_trap()
+{
+  deferred_trap_t t(state.deferred_trap);
+  take_trap(t, state.pc);
+  end_step_on_trap();
+}
+
+void processor_t::end_step_on_trap()
+{
+  if (unlikely(state.single_step == state.STEP_STEPPED)) {
+    state.single_step = state.STEP_NONE;
+    enter_debug_mode(DCSR_CAUSE_STEP);
+  }
+}
+
 bool processor_t::slow_path()
 {
-  return debug || state.single_step != state.STEP_NONE || state.dcsr.cause;
+  return debug || tracing || state.single_step != state.STEP_NONE || state.dcsr.cause ||
+         log_commits_enabled;
 }
 
 // fetch/decode/execute loop
 void processor_t::step(size_t n)
 {
+  if (unlikely(profiler != NULL) && state.minstret >= profile_next) {
+    profiler->sample(this);
+    profile_next = state.minstret + profiler->get_interval();
+  }
+
+  if (unlikely(trace_window_enabled || profiler != NULL)) {
+    // Split the step where minstret enters or leaves the trace window, so
+    // that each part lies entirely inside or outside it, and where the next
+    // profile sample is due.
+    reg_t minstret = state.minstret;
+    reg_t edge = minstret;
+    if (trace_window_enabled)
+      edge = minstret < trace_window.instret_start ? trace_window.instret_start :
+             minstret < trace_window.instret_end ? trace_window.instret_end :
+             minstret;
+    if (profiler != NULL && (edge == minstret || profile_next < edge))
+      edge = profile_next;
+    if (edge != minstret && edge - minstret < n) {
+      size_t first = edge - minstret;
+      step(first);
+      if (state.minstret - minstret == first && !yielded)
+        step(n - first);
+      return;
+    }
+  }
+
   if (state.dcsr.cause == DCSR_CAUSE_NONE) {
     if (halt_request) {
       enter_debug_mode(DCSR_CAUSE_DEBUGINT);
@@ -100,17 +160,37 @@ void processor_t::step(size_t n)
     }
   }
 
+  if (unlikely(state.wfi)) {
+    if (waiting_for_interrupt())
+      return;
+    state.wfi = false;
+  }
+
+  yielded = false;
+  executing = true;
+
   while (n > 0) {
     size_t instret = 0;
+    // instret when the latest flight record began, if it began in this batch
+    const size_t NO_RUN = -1;
+    size_t run_start = NO_RUN;
     reg_t pc = state.pc;
     mmu_t* _mmu = mmu;
 
     #define advance_pc() \
      if (unlikely(invalid_pc(pc))) { \
        switch (pc) { \
-         case PC_SERIALIZE_BEFORE: state.serialized = true; break; \
+         case PC_SERIALIZE_BEFORE: \
+           truncate_run(instret - run_start); \
+           state.serialized = true; \
+           break; \
          case PC_SERIALIZE_AFTER: ++instret; break; \
-         case PC_SERIALIZE_WFI: n = ++instret; break; \
+         case PC_SERIALIZE_WFI: n = ++instret; state.wfi = !halted(); break; \
+         case PC_SERIALIZE_TRAP: \
+           truncate_run(instret - run_start); \
+           take_deferred_trap(); \
+           n = instret; \
+           break; \
          default: abort(); \
        } \
        pc = state.pc; \
@@ -120,12 +200,25 @@ void processor_t::step(size_t n)
        instret++; \
      }
 
+    if (unlikely(trace_window_enabled))
+      tracing = in_trace_window();
+    if (unlikely(callgraph != NULL))
+      callgraph->sync(state.minstret);
+
     try
     {
-      take_pending_interrupt();
+      // check_interrupts() acquired whatever set the flag.
+      if (check_interrupts())
+        __atomic_store_n(&interrupt_pending, false, __ATOMIC_RELEASE);
+      // Traps taken without a throw end the step just as thrown ones do.
+      if (unlikely(take_pending_interrupt())) {
+        n = instret;
+        end_step_on_trap();
+      }
 
       if (unlikely(slow_path()))
       {
+        host_stats.slow_path_batches++;
         while (instret < n)
         {
           if (unlikely(!state.serialized && state.single_step == state.STEP_STEPPED)) {
@@ -141,72 +234,170 @@ void processor_t::step(size_t n)
             state.single_step = state.STEP_STEPPED;
           }
 
-          insn_fetch_t fetch = mmu->load_insn(pc);
-          if (debug && !state.serialized)
+          reg_t paddr;
+          insn_fetch_t fetch = mmu->load_insn(pc, &paddr);
+          host_stats.slow_path_insns++;
+          if ((debug || tracing) && !state.serialized)
             disasm(fetch.insn);
-          pc = execute_insn(this, pc, fetch);
+          run_start = instret;
+          start_run(pc, paddr, &fetch, 1);
+          if (unlikely(histogram_enabled) && !state.serialized) {
+            if (pc != histogram_npc)
+              pc_histogram.count(paddr);
+            histogram_npc = mmu->insn_ends_block(fetch.insn.bits()) ? -1 :
+                            pc + insn_length(fetch.insn.bits());
+          }
+          pc = execute_insn_logged(this, pc, fetch);
+          if (unlikely(insn_mix_enabled))
+            count_taken(fetch.insn.bits(), pc);
+          if (unlikely(callgraph != NULL))
+            callgraph->retire(this, fetch.insn.bits(), pc, state.minstret + instret + 1);
           advance_pc();
+          if (check_interrupts() ||
+              (unlikely(trace_window_enabled) && tracing != in_trace_window()))
+            break;
         }
       }
       else while (instret < n)
       {
-        // This code uses a modified Duff's Device to improve the performance
-        // of executing instructions. While typical Duff's Devices are used
-        // for software pipelining, the switch statement below primarily
-        // benefits from separate call points for the fetch.func function call
-        // found in each execute_insn. This function call is an indirect jump
-        // that depends on the current instruction. By having an indirect jump
-        // dedicated for each icache entry, you improve the performance of the
-        // host's next address predictor. Each case in the switch statement
-        // allows for the program flow to contine to the next case if it
-        // corresponds to the next instruction in the program and instret is
-        // still less than n.
+        // The JIT can only empty its code buffer, which flushes the icache,
+        // between blocks.
+        if (unlikely(jit != NULL))
+          jit->make_room();
+
+        // Instructions are fetched a basic block at a time. Within a block,
+        // every instruction but the last is known to fall through, so the
+        // only per-instruction work is the call to fetch.func. Each block
+        // remembers the blocks reached through its taken and not-taken exits,
+        // so a branch usually lands on its successor without an icache
+        // lookup; the successor only has to be validated against its tag and
+        // translation context.
         //
-        // According to Andrew Waterman's recollection, this optimization
-        // resulted in approximately a 2x performance increase.
+        // The block body is executed with a Duff's device that enters the
+        // switch below at the right distance from the end of the block. As
+        // with the old per-instruction icache, the point is to give each
+        // slot its own indirect call to fetch.func, which helps the host's
+        // next address predictor.
+        auto ic_entry = _mmu->access_icache(pc);
 
-        // This figures out where to jump to in the switch statement
-        size_t idx = _mmu->icache_index(pc);
+        while (true)
+        {
+          size_t len = std::min(ic_entry->n, n - instret);
+          if (unlikely(trace_pc_len) && pc < trace_window.pc_end &&
+              ic_entry->npc > trace_window.pc_start)
+            len = insns_before_trace_pc(pc, ic_entry->data, len);
+          insn_fetch_t* fetch = ic_entry->data + len - ICACHE_BLOCK_INSNS;
+          run_start = instret;
+          start_run(pc, ic_entry->paddr, ic_entry->data, len);
+          if (unlikely(histogram_enabled))
+            pc_histogram.count(ic_entry->paddr);
 
-        // This gets the cached decoded instruction from the MMU. If the MMU
-        // does not have the current pc cached, it will refill the MMU and
-        // return the correct entry. ic_entry->data.func is the C++ function
-        // corresponding to the instruction.
-        auto ic_entry = _mmu->access_icache(pc);
+          if (ic_entry->jit && len == ic_entry->n) {
+            // A translated block runs as a list of ops, each either native
+            // code for several instructions or a single handler. Logging
+            // always takes the slow path, so execute_insn isn't needed.
+            jit_block_t* block = ic_entry->jit;
+            size_t i;
+            for (i = 0; i < block->n; i++) {
+              jit_op_t* op = &block->op[i];
+              reg_t npc = op->func(this, op->insn, pc);
+              if (unlikely(npc != op->npc)) {
+                if (invalid_pc(npc)) {
+                  pc = npc;
+                  goto stop_in_block;
+                }
+                // Native code stopped short at npc. Count what it retired,
+                // interpret the instruction it stopped at, and continue with
+                // the block that follows.
+                size_t j = op->first;
+                for (; pc != npc; j++, instret++)
+                  pc += insn_length(ic_entry->data[j].insn.bits());
+                state.pc = pc;
+                pc = execute_insn(this, pc, ic_entry->data[j]);
+                if (unlikely(invalid_pc(pc)))
+                  goto stop_in_block;
+                instret++;
+                state.pc = pc;
+                truncate_run(instret - run_start);
+                break;
+              }
+              pc = npc;
+              instret += op->n;
+              state.pc = pc;
+            }
+            if (unlikely(i != block->n)) {
+              ic_entry = _mmu->access_icache(pc);
+              continue;
+            }
+          } else {
+            if (unlikely(jit != NULL) && ++ic_entry->hits == jit_t::HOT_THRESHOLD)
+              jit->translate(ic_entry);
 
-        // This macro is included in "icache.h" included within the switch
-        // statement below. The indirect jump corresponding to the instruction
-        // is located within the execute_insn() function call.
-        #define ICACHE_ACCESS(i) { \
-          insn_fetch_t fetch = ic_entry->data; \
-          pc = execute_insn(this, pc, fetch); \
-          ic_entry = ic_entry->next; \
-          if (i == mmu_t::ICACHE_ENTRIES-1) break; \
-          if (unlikely(ic_entry->tag != pc)) break; \
-          if (unlikely(instret+1 == n)) break; \
-          instret++; \
-          state.pc = pc; \
-        }
+            // A load or store in the block may stop it with a deferred
+            // trap.
+            #define BLOCK_ACCESS(i) \
+              case i: \
+                pc = execute_insn(this, pc, fetch[i]); \
+                if (unlikely(invalid_pc(pc))) \
+                  goto stop_in_block; \
+                instret++; \
+                state.pc = pc;
+
+            static_assert(ICACHE_BLOCK_INSNS == 16, "one BLOCK_ACCESS per slot");
+            switch (ICACHE_BLOCK_INSNS - len) {
+              BLOCK_ACCESS(0) BLOCK_ACCESS(1) BLOCK_ACCESS(2) BLOCK_ACCESS(3)
+              BLOCK_ACCESS(4) BLOCK_ACCESS(5) BLOCK_ACCESS(6) BLOCK_ACCESS(7)
+              BLOCK_ACCESS(8) BLOCK_ACCESS(9) BLOCK_ACCESS(10) BLOCK_ACCESS(11)
+              BLOCK_ACCESS(12) BLOCK_ACCESS(13) BLOCK_ACCESS(14)
+              case 15: break;
+            }
+          }
+
+          pc = execute_insn(this, pc, fetch[ICACHE_BLOCK_INSNS-1]);
+          if (unlikely(insn_mix_enabled))
+            count_taken(fetch[ICACHE_BLOCK_INSNS-1].insn.bits(), pc);
+          if (unlikely(callgraph != NULL))
+            callgraph->retire(this, fetch[ICACHE_BLOCK_INSNS-1].insn.bits(), pc,
+                              state.minstret + instret + 1);
+          if (unlikely(invalid_pc(pc)) || unlikely(instret+1 == n) ||
+              check_interrupts() || entering_trace_pc(pc))
+            break;
+          if (unlikely(pc <= ic_entry->tag) && spinning(pc)) {
+            // Give the other harts a chance to do whatever this one is
+            // waiting for.
+            yielded = true;
+            n = instret + 1;
+            break;
+          }
+          instret++;
+          state.pc = pc;
 
-        // This switch statement implements the modified Duff's device as
-        // explained above.
-        switch (idx) {
-          // "icache.h" is generated by the gen_icache script
-          #include "icache.h"
+          bool fell_through = pc == ic_entry->npc;
+          icache_entry_t* next = ic_entry->succ[fell_through];
+          if (unlikely(!_mmu->icache_hit(next, pc))) {
+            next = _mmu->access_icache(pc);
+            ic_entry->succ[fell_through] = next;
+          }
+          ic_entry = next;
         }
 
+      stop_in_block:
         advance_pc();
+        // Go back to the top of the batch to take the new interrupt, or to
+        // start tracing.
+        if (check_interrupts() ||
+            (unlikely(trace_window_enabled) && in_trace_window()))
+          break;
       }
     }
     catch(trap_t& t)
     {
+      host_stats.traps_thrown++;
+      if (run_start != NO_RUN)
+        truncate_run(instret - run_start);
       take_trap(t, pc);
       n = instret;
-
-      if (unlikely(state.single_step == state.STEP_STEPPED)) {
-        state.single_step = state.STEP_NONE;
-        enter_debug_mode(DCSR_CAUSE_STEP);
-      }
+      end_step_on_trap();
     }
     catch (trigger_matched_t& t)
     {
@@ -217,7 +408,7 @@ void processor_t::step(size_t n)
         // instructions are idempotent so restarting is safe.)
 
         insn_fetch_t fetch = mmu->load_insn(pc);
-        pc = execute_insn(this, pc, fetch);
+        pc = execute_insn_logged(this, pc, fetch);
         advance_pc();
 
         delete mmu->matched_trigger;
@@ -248,6 +439,10 @@ void processor_t::step(size_t n)
     }
 
     state.minstret += instret;
+    host_stats.host_insns += instret;
     n -= instret;
+    if (unlikely(hpm_active))
+      check_hpm_overflow();
   }
+  executing = false;
 }
@@ -0,0 +1,80 @@
+// See LICENSE for license details.
+
+#include "flight_recorder.h"
+#include "processor.h"
+#include "mmu.h"
+#include "disasm.h"
+#include <cinttypes>
+
+void flight_recorder_t::resize(size_t size)
+{
+  size_t n = 1;
+  while (n < size)
+    n *= 2;
+  ring.assign(n, record_t());
+  mask = n - 1;
+  head = 0;
+}
+
+// The instructions of a run are read back from the physical memory they
+// were fetched from, without going through the hart's MMU, so dumping has no
+// side effects and doesn't depend on the current translation.  Code that has
+// been overwritten since is shown as it is now.  A block never crosses a
+// page, so neither does a run.  Code that isn't in memory, like the boot
+// ROM's, and an instruction that straddles the end of a page are shown as
+// unavailable.
+void flight_recorder_t::dump(processor_t* p, FILE* out)
+{
+  uint32_t id = p->get_id();
+  size_t begin = head > ring.size() ? head - ring.size() : 0;
+  fprintf(out, "core %3d: last %zu flight records\n", id, head - begin);
+
+  for (size_t i = begin; i < head; i++) {
+    const record_t& r = ring[i & mask];
+    if (r.n == TRAP) {
+      fprintf(out, "core %3d: trap cause 0x%016" PRIx64 ", epc 0x%016" PRIx64
+              ", tval 0x%016" PRIx64 "\n", id, r.cause, r.pc, r.tval);
+      continue;
+    }
+
+    // Show a run that repeats back to back, like a spin loop, only once.
+    size_t repeats = 1;
+    while (i + 1 < head && ring[(i + 1) & mask].pc == r.pc &&
+           ring[(i + 1) & mask].paddr == r.paddr &&
+           ring[(i + 1) & mask].n == r.n)
+      i++, repeats++;
+
+    const char* host = p->sim->addr_to_mem(r.paddr);
+    reg_t pc = r.pc;
+    reg_t offset = r.paddr % PGSIZE;
+    for (reg_t j = 0; j < r.n; j++) {
+      reg_t in_page = offset + (pc - r.pc);
+      const char* parcels = host ? host + (pc - r.pc) : NULL;
+      int length = parcels && in_page + 2 <= PGSIZE ? insn_length(*(const uint16_t*)parcels) : 0;
+      if (length == 0 || in_page + length > PGSIZE) {
+        fprintf(out, "core %3d: 0x%016" PRIx64 " (unavailable)\n", id, pc);
+        break;
+      }
+      // Sign-extended from the last parcel, as the MMU fetches it.
+      insn_bits_t raw = (insn_bits_t)*(const int16_t*)(parcels + length - 2) << (8 * (length - 2));
+      for (int k = 0; k < length - 2; k += 2)
+        raw |= (insn_bits_t)*(const uint16_t*)(parcels + k) << (8 * k);
+      insn_t insn(raw);
+      uint64_t bits = insn.bits() & ((1ULL << (8 * insn_length(insn.bits()))) - 1);
+      fprintf(out, "core %3d: 0x%016" PRIx64 " (0x%08" PRIx64 ") %s\n",
+              id, pc, bits, p->get_disassembler()->disassemble(insn).c_str());
+      pc += insn_length(insn.bits());
+    }
+    if (repeats > 1)
+      fprintf(out, "core %3d: Executed %zu times\n", id, repeats);
+  }
+
+  state_t* state = p->get_state();
+  fprintf(out, "core %3d: pc 0x%016" PRIx64 "\n", id, state->pc);
+  for (size_t r = 0; r < NXPR; r += 4) {
+    fprintf(out, "core %3d:", id);
+    for (size_t j = r; j < r + 4; j++)
+      fprintf(out, " %-4s 0x%016" PRIx64, xpr_name[j], state->XPR[j]);
+    fprintf(out, "\n");
+  }
+}
@@ -0,0 +1,65 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_FLIGHT_RECORDER_H
+#define _RISCV_FLIGHT_RECORDER_H
+
+#include "decode.h"
+#include <cstdio>
+#include <vector>
+
+class processor_t;
+
+// A ring of what a hart did most recently, cheap enough to leave on all the
+// time and dumped when something goes wrong.  step() records each run of
+// instructions it starts rather than each instruction, cutting the run short
+// if it stops early, and take_trap() records each trap.
+class flight_recorder_t
+{
+ public:
+  static const size_t DEFAULT_SIZE = 1024;
+
+  flight_recorder_t() { resize(DEFAULT_SIZE); }
+  // Keep the last size records, rounded up to a power of two.
+  void resize(size_t size);
+
+  // n instructions starting at pc, fetched from one icache block, the first
+  // from physical address paddr
+  void record(reg_t pc, reg_t paddr, reg_t n)
+  {
+    record_t& r = ring[head++ & mask];
+    r.pc = pc;
+    r.paddr = paddr;
+    r.n = n;
+  }
+  // Cut the latest run short after its first n instructions.
+  void truncate(reg_t n) { ring[(head - 1) & mask].n = n; }
+  void record_trap(reg_t epc, reg_t cause, reg_t tval)
+  {
+    record_t& r = ring[head++ & mask];
+    r.pc = epc;
+    r.n = TRAP;
+    r.cause = cause;
+    r.tval = tval;
+  }
+
+  // Print the records, oldest first, with the instructions of each run
+  // disassembled, followed by the integer registers.
+  void dump(processor_t* p, FILE* out);
+
+ private:
+  struct record_t
+  {
+    reg_t pc;
+    reg_t paddr;
+    reg_t n; // or TRAP
+    reg_t cause;
+    reg_t tval;
+  };
+
+  static const reg_t TRAP = -1;
+  std::vector<record_t> ring;
+  size_t mask;
+  size_t head;
+};
+
+#endif
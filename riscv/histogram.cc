@@ -0,0 +1,30 @@
+// See LICENSE for license details.
+
+#include "histogram.h"
+#include <algorithm>
+
+void pc_histogram_t::find_page(reg_t page)
+{
+  auto& counts = pages[page];
+  if (!counts)
+    counts.reset(new uint64_t[PAGE_COUNTERS]());
+  last_page = page;
+  last_counts = counts.get();
+}
+
+std::vector<std::pair<reg_t, uint64_t>> pc_histogram_t::sorted() const
+{
+  std::vector<std::pair<reg_t, uint64_t>> result;
+  for (auto& page : pages) {
+    for (size_t i = 0; i < PAGE_COUNTERS; i++) {
+      if (page.second[i])
+        result.emplace_back((page.first << PAGE_SHIFT) + i * PAGE_GRANULE, page.second[i]);
+    }
+  }
+
+  std::sort(result.begin(), result.end(), [](const std::pair<reg_t, uint64_t>& a,
+                                             const std::pair<reg_t, uint64_t>& b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  });
+  return result;
+}
@@ -0,0 +1,44 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_HISTOGRAM_H
+#define _RISCV_HISTOGRAM_H
+
+#include "decode.h"
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Counts how many times each block of code was entered, by the physical
+// address the block starts at.  Counters live in flat per-page arrays, one
+// for every halfword of a page that has held code, and the page counted last
+// is remembered, so counting a block entry is usually an increment.
+class pc_histogram_t
+{
+ public:
+  pc_histogram_t() : last_page(-1), last_counts(NULL) {}
+
+  void count(reg_t paddr)
+  {
+    if (unlikely((paddr >> PAGE_SHIFT) != last_page))
+      find_page(paddr >> PAGE_SHIFT);
+    last_counts[(paddr % PAGE_BYTES) / PAGE_GRANULE]++;
+  }
+
+  // The nonzero counters as (physical address, count) pairs, most frequently
+  // entered first.
+  std::vector<std::pair<reg_t, uint64_t>> sorted() const;
+
+ private:
+  static const int PAGE_SHIFT = 12;
+  static const reg_t PAGE_BYTES = reg_t(1) << PAGE_SHIFT;
+  static const size_t PAGE_GRANULE = 2; // smallest instruction
+  static const size_t PAGE_COUNTERS = PAGE_BYTES / PAGE_GRANULE;
+  std::unordered_map<reg_t, std::unique_ptr<uint64_t[]>> pages;
+  reg_t last_page;
+  uint64_t* last_counts;
+  void find_page(reg_t page);
+};
+
+#endif
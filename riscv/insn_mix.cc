@@ -0,0 +1,137 @@
+// See LICENSE for license details.
+
+#include "insn_mix.h"
+#include "mmu.h"
+#include <cinttypes>
+#include <cstring>
+
+static_assert(ICACHE_BLOCK_INSNS <= insn_mix_t::MAX_RUN,
+              "insn_mix_t::MAX_RUN must hold an icache block");
+
+const char* const insn_mix_t::class_names[NCLASSES] = {
+  "int", "muldiv", "load", "store", "amo", "branch", "jump", "fence",
+  "system", "fp", "vector", "other"
+};
+
+// The class of each major opcode, bits 6:2 of a 32-bit instruction.
+static const signed char major_class[32] = {
+  insn_mix_t::LOAD,   insn_mix_t::LOAD,   insn_mix_t::OTHER,  insn_mix_t::FENCE,  // LOAD, LOAD-FP, custom-0, MISC-MEM
+  insn_mix_t::INT,    insn_mix_t::INT,    insn_mix_t::INT,    insn_mix_t::OTHER,  // OP-IMM, AUIPC, OP-IMM-32
+  insn_mix_t::STORE,  insn_mix_t::STORE,  insn_mix_t::OTHER,  insn_mix_t::AMO,    // STORE, STORE-FP, custom-1, AMO
+  insn_mix_t::INT,    insn_mix_t::INT,    insn_mix_t::INT,    insn_mix_t::OTHER,  // OP, LUI, OP-32
+  insn_mix_t::FP,     insn_mix_t::FP,     insn_mix_t::FP,     insn_mix_t::FP,     // MADD, MSUB, NMSUB, NMADD
+  insn_mix_t::FP,     insn_mix_t::VECTOR, insn_mix_t::OTHER,  insn_mix_t::OTHER,  // OP-FP, OP-V, custom-2
+  insn_mix_t::BRANCH, insn_mix_t::JUMP,   insn_mix_t::OTHER,  insn_mix_t::JUMP,   // BRANCH, JALR, JAL
+  insn_mix_t::SYSTEM, insn_mix_t::OTHER,  insn_mix_t::OTHER,  insn_mix_t::OTHER,  // SYSTEM, custom-3
+};
+
+// The class of each compressed instruction, by funct3 and quadrant.
+static const signed char compressed_class[8][3] = {
+  {insn_mix_t::INT,   insn_mix_t::INT,    insn_mix_t::INT},   // c.addi4spn, c.addi, c.slli
+  {insn_mix_t::LOAD,  insn_mix_t::INT,    insn_mix_t::LOAD},  // c.fld, c.addiw or c.jal, c.fldsp
+  {insn_mix_t::LOAD,  insn_mix_t::INT,    insn_mix_t::LOAD},  // c.lw, c.li, c.lwsp
+  {insn_mix_t::LOAD,  insn_mix_t::INT,    insn_mix_t::LOAD},  // c.ld, c.lui, c.ldsp
+  {insn_mix_t::OTHER, insn_mix_t::INT,    insn_mix_t::INT},   // -, c.srli etc., c.mv etc.
+  {insn_mix_t::STORE, insn_mix_t::JUMP,   insn_mix_t::STORE}, // c.fsd, c.j, c.fsdsp
+  {insn_mix_t::STORE, insn_mix_t::BRANCH, insn_mix_t::STORE}, // c.sw, c.beqz, c.swsp
+  {insn_mix_t::STORE, insn_mix_t::BRANCH, insn_mix_t::STORE}, // c.sd, c.bnez, c.sdsp
+};
+
+int insn_mix_t::classify(insn_bits_t insn, unsigned xlen)
+{
+  if ((insn & 3) != 3) {
+    unsigned funct3 = (insn >> 13) & 7, quadrant = insn & 3;
+    if (funct3 == 1 && quadrant == 1 && xlen == 32) // c.jal
+      return JUMP;
+    if (funct3 == 4 && quadrant == 2 && !(insn & 0x7c)) { // c.jr, c.jalr, c.ebreak
+      if (insn & 0xf80)
+        return JUMP;
+      if (insn & 0x1000)
+        return SYSTEM;
+    }
+    return compressed_class[funct3][quadrant];
+  }
+
+  unsigned opcode = (insn >> 2) & 31, funct3 = (insn >> 12) & 7;
+  int cls = major_class[opcode];
+  switch (opcode) {
+    case 0x01: case 0x09: // LOAD-FP and STORE-FP widths 0 and 5-7 are vector
+      return funct3 == 0 || funct3 >= 5 ? VECTOR : cls;
+    case 0x0c: case 0x0e: // OP and OP-32 with funct7 1 are M
+      return ((insn >> 25) & 0x7f) == 1 ? MULDIV : cls;
+  }
+  return cls;
+}
+
+void insn_mix_t::clear()
+{
+  memset(counts, 0, sizeof(counts));
+  memset(taken_counts, 0, sizeof(taken_counts));
+  run_len = 0;
+}
+
+void insn_mix_t::start(const insn_fetch_t* fetch, size_t len, reg_t prv, unsigned xlen)
+{
+  for (size_t i = 0; i < len; i++) {
+    insn_t insn = fetch[i].insn;
+    run_classes[i] = classify(insn.bits(), xlen);
+    counts[prv][run_classes[i]]++;
+  }
+  run_len = len;
+  run_prv = prv;
+}
+
+void insn_mix_t::truncate(size_t n)
+{
+  for (size_t i = n; i < run_len; i++)
+    counts[run_prv][run_classes[i]]--;
+  run_len = n;
+}
+
+uint64_t insn_mix_t::get_total(reg_t prv) const
+{
+  uint64_t total = 0;
+  for (int cls = 0; cls < NCLASSES; cls++)
+    total += counts[prv][cls];
+  return total;
+}
+
+void insn_mix_t::print(FILE* out, uint32_t id) const
+{
+  static const char* const modes[] = {"U", "S", "H", "M"};
+  uint64_t totals[PRV_M + 2] = {0};
+
+  fprintf(out, "core %3d: %-8s", id, "class");
+  for (reg_t prv = 0; prv <= PRV_M; prv++)
+    if (prv != PRV_H)
+      fprintf(out, " %16s", modes[prv]);
+  fprintf(out, " %16s\n", "total");
+
+  for (int cls = 0; cls < NCLASSES; cls++) {
+    uint64_t total = 0;
+    fprintf(out, "core %3d: %-8s", id, class_names[cls]);
+    for (reg_t prv = 0; prv <= PRV_M; prv++) {
+      total += counts[prv][cls];
+      totals[prv] += counts[prv][cls];
+      if (prv != PRV_H)
+        fprintf(out, " %16" PRIu64, counts[prv][cls]);
+    }
+    totals[PRV_M + 1] += total;
+    fprintf(out, " %16" PRIu64 "\n", total);
+  }
+
+  fprintf(out, "core %3d: %-8s", id, "total");
+  for (reg_t prv = 0; prv <= PRV_M + 1; prv++)
+    if (prv != PRV_H)
+      fprintf(out, " %16" PRIu64, totals[prv]);
+  fprintf(out, "\n");
+
+  uint64_t taken = 0;
+  fprintf(out, "core %3d: %-8s", id, "taken");
+  for (reg_t prv = 0; prv <= PRV_M; prv++) {
+    taken += taken_counts[prv];
+    if (prv != PRV_H)
+      fprintf(out, " %16" PRIu64, taken_counts[prv]);
+  }
+  fprintf(out, " %16" PRIu64 "\n", taken);
+}
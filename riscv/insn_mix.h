@@ -0,0 +1,56 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_INSN_MIX_H
+#define _RISCV_INSN_MIX_H
+
+#include "decode.h"
+#include <cstdio>
+
+struct insn_fetch_t;
+
+// Counts of the instructions a hart retired in each privilege mode, by
+// class, and of the branches and jumps among them that were taken.  step()
+// hands it each run of instructions before executing it, as it does the
+// flight recorder, and cuts the run short if it stops early, so the cost is
+// a table lookup per instruction while counting is enabled and nothing
+// while it isn't.
+class insn_mix_t
+{
+ public:
+  enum insn_class_t {
+    INT, MULDIV, LOAD, STORE, AMO, BRANCH, JUMP, FENCE, SYSTEM, FP, VECTOR,
+    OTHER, NCLASSES
+  };
+  static const char* const class_names[NCLASSES];
+
+  insn_mix_t() { clear(); }
+  void clear();
+
+  // len instructions, at most MAX_RUN, are about to run in privilege mode
+  // prv.  Their classes are kept, not fetch, which may not outlive the run.
+  static const size_t MAX_RUN = 16;
+  void start(const insn_fetch_t* fetch, size_t len, reg_t prv, unsigned xlen);
+  // Only the first n of them retired.
+  void truncate(size_t n);
+  // A branch or jump retired in privilege mode prv went somewhere other than
+  // the next instruction.
+  void taken(reg_t prv) { taken_counts[prv]++; }
+
+  uint64_t get(reg_t prv, int cls) const { return counts[prv][cls]; }
+  uint64_t get_total(reg_t prv) const;
+  uint64_t get_taken(reg_t prv) const { return taken_counts[prv]; }
+
+  static int classify(insn_bits_t insn, unsigned xlen);
+
+  // Print a table of the counts, one row per class.
+  void print(FILE* out, uint32_t id) const;
+
+ private:
+  uint64_t counts[PRV_M + 1][NCLASSES];
+  uint64_t taken_counts[PRV_M + 1];
+  signed char run_classes[MAX_RUN];
+  size_t run_len;
+  reg_t run_prv;
+};
+
+#endif
@@ -0,0 +1,159 @@
+// See LICENSE for license details.
+
+// Check insn_mix_t::classify against the class each instruction processor_t
+// registers should land in, going by its name: every instruction, with its
+// don't-care bits filled in at random, on RV32 and RV64.  Fillings that
+// decode to some other instruction, like c.mv with rs2 = 0, are that other
+// instruction's to check.
+
+#include "config.h"
+#include "processor.h"
+#include "insn_mix.h"
+#include "test_sim.h"
+#include <cinttypes>
+#include <random>
+#include <string>
+
+#define DECLARE_INSN(name, match, mask) \
+  static const insn_bits_t name##_match = (match), name##_mask = (mask);
+#include "encoding.h"
+#undef DECLARE_INSN
+
+#define DEFINE_INSN(name) \
+  reg_t rv32_##name(processor_t*, insn_t, reg_t); \
+  reg_t rv64_##name(processor_t*, insn_t, reg_t);
+#include "insn_list.h"
+#undef DEFINE_INSN
+
+struct named_insn_t
+{
+  const char* name;
+  insn_bits_t match, mask;
+  insn_func_t rv32, rv64;
+};
+
+static const named_insn_t insns[] = {
+  #define DEFINE_INSN(name) \
+    {#name, name##_match, name##_mask, rv32_##name, rv64_##name},
+  #include "insn_list.h"
+  #undef DEFINE_INSN
+};
+
+static bool starts_with(const std::string& s, const char* prefix)
+{
+  return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+static int expected_class(const std::string& name, unsigned xlen)
+{
+  static const char* const loads[] = {
+    "lb", "lh", "lw", "ld", "lbu", "lhu", "lwu", "flw", "fld", "flq",
+    "c_lw", "c_flw", "c_fld", "c_lwsp", "c_flwsp", "c_fldsp"
+  };
+  static const char* const stores[] = {
+    "sb", "sh", "sw", "sd", "fsw", "fsd", "fsq",
+    "c_sw", "c_fsw", "c_fsd", "c_swsp", "c_fswsp", "c_fsdsp"
+  };
+  static const char* const branches[] = {
+    "beq", "bne", "blt", "bge", "bltu", "bgeu", "c_beqz", "c_bnez"
+  };
+  static const char* const jumps[] = {"jal", "jalr", "c_j", "c_jr", "c_jalr"};
+  static const char* const system[] = {
+    "ecall", "ebreak", "c_ebreak", "mret", "sret", "dret", "wfi", "sfence_vma"
+  };
+
+  for (auto n : loads)
+    if (name == n)
+      return insn_mix_t::LOAD;
+  for (auto n : stores)
+    if (name == n)
+      return insn_mix_t::STORE;
+  for (auto n : branches)
+    if (name == n)
+      return insn_mix_t::BRANCH;
+  for (auto n : jumps)
+    if (name == n)
+      return insn_mix_t::JUMP;
+  for (auto n : system)
+    if (name == n)
+      return insn_mix_t::SYSTEM;
+
+  if (name == "c_jal") // c.addiw on RV64
+    return xlen == 32 ? insn_mix_t::JUMP : insn_mix_t::INT;
+  if (starts_with(name, "csr"))
+    return insn_mix_t::SYSTEM;
+  if (starts_with(name, "amo") || starts_with(name, "lr_") || starts_with(name, "sc_"))
+    return insn_mix_t::AMO;
+  if (starts_with(name, "fence"))
+    return insn_mix_t::FENCE;
+  if (starts_with(name, "mul") || starts_with(name, "div") || starts_with(name, "rem"))
+    return insn_mix_t::MULDIV;
+  if (starts_with(name, "f"))
+    return insn_mix_t::FP;
+  if (starts_with(name, "v"))
+    return insn_mix_t::VECTOR;
+  return insn_mix_t::INT;
+}
+
+class insn_mix_test_t
+{
+public:
+  insn_mix_test_t(processor_t* p) : p(p) {}
+
+  void check(const named_insn_t& i, insn_bits_t bits)
+  {
+    unsigned xlen = p->get_xlen();
+    if (p->decode_insn(insn_t(bits)) != (xlen == 64 ? i.rv64 : i.rv32))
+      return;
+    if (i.rv64 == rv64_c_jr && !(bits & 0xf80)) // reserved, never retires
+      return;
+    checked++;
+    int cls = insn_mix_t::classify(bits, xlen);
+    int expected = expected_class(i.name, xlen);
+    if (cls != expected) {
+      TEST_CHECK(cls == expected);
+      printf("  %s, RV%u, bits 0x%08" PRIx64 ": %s, not %s\n", i.name, xlen, bits,
+             insn_mix_t::class_names[cls], insn_mix_t::class_names[expected]);
+    }
+  }
+
+  void run()
+  {
+    std::mt19937_64 rng(1);
+    for (auto& i : insns) {
+      checked = 0;
+      check(i, i.match);
+      for (int n = 0; n < 64; n++)
+        check(i, ((rng() & ~i.mask) | i.match) & (insn_length(i.match) == 2 ? 0xffff : 0xffffffff));
+      if (!checked) {
+        TEST_CHECK(checked);
+        printf("  %s, RV%u: never decoded\n", i.name, p->get_xlen());
+      }
+    }
+
+    // The compressed encodings whose class isn't their quadrant and funct3's.
+    unsigned xlen = p->get_xlen();
+    TEST_CHECK(insn_mix_t::classify(0x8082, xlen) == insn_mix_t::JUMP);   // c.jr ra
+    TEST_CHECK(insn_mix_t::classify(0x9502, xlen) == insn_mix_t::JUMP);   // c.jalr a0
+    TEST_CHECK(insn_mix_t::classify(0x9002, xlen) == insn_mix_t::SYSTEM); // c.ebreak
+    TEST_CHECK(insn_mix_t::classify(0x852e, xlen) == insn_mix_t::INT);    // c.mv a0, a1
+    TEST_CHECK(insn_mix_t::classify(0x952e, xlen) == insn_mix_t::INT);    // c.add a0, a1
+    TEST_CHECK(insn_mix_t::classify(0x2505, xlen) ==                      // c.jal or c.addiw
+               (xlen == 32 ? insn_mix_t::JUMP : insn_mix_t::INT));
+  }
+
+private:
+  processor_t* p;
+  size_t checked;
+};
+
+int main()
+{
+  test_sim_t sim(0);
+  const char* isas[] = {DEFAULT_ISA, "RV32IMAFDC"};
+  for (auto isa : isas) {
+    processor_t p(isa, DEFAULT_VARCH, &sim, 0);
+    insn_mix_test_t(&p).run();
+  }
+  return test_finish("insn_mix");
+}
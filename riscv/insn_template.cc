@@ -2,6 +2,12 @@
 
 #include "insn_template.h"
 
+// Each instruction is compiled twice: a lean handler, and one that records
+// its register write for the commit log. processor_t decodes to the logged
+// handlers only while commit logging is enabled.
+
+#define DECODE_MACRO_USAGE_LOGGED 0
+
 reg_t rv32_NAME(processor_t* p, insn_t insn, reg_t pc)
 {
   int xlen = 32;
@@ -19,3 +25,24 @@ reg_t rv64_NAME(processor_t* p, insn_t insn, reg_t pc)
   trace_opcode(p, OPCODE, insn);
   return npc;
 }
+
+#undef DECODE_MACRO_USAGE_LOGGED
+#define DECODE_MACRO_USAGE_LOGGED 1
+
+reg_t logged_rv32_NAME(processor_t* p, insn_t insn, reg_t pc)
+{
+  int xlen = 32;
+  reg_t npc = sext_xlen(pc + insn_length(OPCODE));
+  #include "insns/NAME.h"
+  trace_opcode(p, OPCODE, insn);
+  return npc;
+}
+
+reg_t logged_rv64_NAME(processor_t* p, insn_t insn, reg_t pc)
+{
+  int xlen = 64;
+  reg_t npc = sext_xlen(pc + insn_length(OPCODE));
+  #include "insns/NAME.h"
+  trace_opcode(p, OPCODE, insn);
+  return npc;
+}
@@ -1 +1 @@
-throw trap_breakpoint(pc);
+defer_trap(trap_breakpoint(pc));
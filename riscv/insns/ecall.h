@@ -1,7 +1,7 @@
 switch (STATE.prv)
 {
-  case PRV_U: throw trap_user_ecall();
-  case PRV_S: throw trap_supervisor_ecall();
-  case PRV_M: throw trap_machine_ecall();
+  case PRV_U: defer_trap(trap_user_ecall());
+  case PRV_S: defer_trap(trap_supervisor_ecall());
+  case PRV_M: defer_trap(trap_machine_ecall());
   default: abort();
 }
@@ -1 +1 @@
-MMU.flush_icache();
+MMU.flush_icache(FLUSH_FENCE_I);
@@ -1,3 +1,2 @@
 require_extension('A');
-MMU.acquire_load_reservation(RS1);
-WRITE_RD(MMU.load_int32(RS1));
+WRITE_RD(MMU.load_reserved_int32(RS1));
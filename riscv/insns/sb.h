@@ -1 +1 @@
-MMU.store_uint8(RS1 + insn.s_imm(), RS2);
+MMU_STORE(uint8, RS1 + insn.s_imm(), RS2);
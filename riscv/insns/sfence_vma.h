@@ -1,2 +1,7 @@
 require_privilege(get_field(STATE.mstatus, MSTATUS_TVM) ? PRV_M : PRV_S);
-MMU.flush_tlb();
+if (insn.rs1() != 0)
+  MMU.flush_tlb_page(RS1);
+else if (insn.rs2() != 0)
+  MMU.flush_tlb_asid(RS2);
+else
+  MMU.flush_tlb(FLUSH_SFENCE_VMA);
@@ -77,6 +77,10 @@ void sim_t::interactive()
   funcs["until"] = &sim_t::interactive_until_silent;
   funcs["untiln"] = &sim_t::interactive_until_noisy;
   funcs["while"] = &sim_t::interactive_until_silent;
+  funcs["mode"] = &sim_t::interactive_mode;
+  funcs["flight"] = &sim_t::interactive_flight;
+  funcs["mix"] = &sim_t::interactive_mix;
+  funcs["stats"] = &sim_t::interactive_stats;
   funcs["quit"] = &sim_t::interactive_quit;
   funcs["q"] = funcs["quit"];
   funcs["help"] = &sim_t::interactive_help;
@@ -131,6 +135,12 @@ void sim_t::interactive_help(const std::string& cmd, const std::vector<std::stri
     "while reg <core> <reg> <val>    # Run while <reg> in <core> is <val>\n"
     "while pc <core> <val>           # Run while PC in <core> is <val>\n"
     "while mem <addr> <val>          # Run while memory <addr> is <val>\n"
+    "mode <name> <on|off>            # Switch commitlog, histogram, insnmix,\n"
+    "                                  misaligned or dirty mode on or off in every core\n"
+    "flight [core]                   # Show the flight recorder of [core] (all if omitted)\n"
+    "mix [core]                      # Show the instruction mix of [core] (all if omitted)\n"
+    "stats [core]                    # Show the simulator's statistics for [core] as JSON\n"
+    "                                  (for the whole simulation if omitted)\n"
     "run [count]                     # Resume noisy execution (until CTRL+C, or [count] insns)\n"
     "r [count]                         Alias for run\n"
     "rs [count]                      # Resume silent execution (until CTRL+C, or [count] insns)\n"
@@ -194,6 +204,7 @@ reg_t sim_t::get_reg(const std::vector<std::string>& args)
     if (*ptr) {
       #define DECLARE_CSR(name, number) if (args[1] == #name) return p->get_csr(number);
       #include "encoding.h"              // generates if's for all csrs
+      #include "hpm_encoding.h"
       r = NXPR;                          // else case (csr name not found)
       #undef DECLARE_CSR
     }
@@ -417,3 +428,60 @@ void sim_t::interactive_until(const std::string& cmd, const std::vector<std::str
     step(1);
   }
 }
+
+void sim_t::interactive_mode(const std::string& cmd, const std::vector<std::string>& args)
+{
+  if (args.size() != 2 || (args[1] != "on" && args[1] != "off"))
+    throw trap_interactive();
+
+  bool value = args[1] == "on";
+  if (args[0] == "commitlog")
+    set_log_commits(value);
+  else if (args[0] == "histogram")
+    set_histogram(value);
+  else if (args[0] == "insnmix")
+    set_insn_mix(value);
+  else if (args[0] == "misaligned")
+    set_misaligned(value);
+  else if (args[0] == "dirty")
+    set_dirty(value);
+  else
+    throw trap_interactive();
+}
+
+void sim_t::interactive_flight(const std::string& cmd, const std::vector<std::string>& args)
+{
+  if (args.size() > 1)
+    throw trap_interactive();
+
+  if (args.size() == 1)
+    get_core(args[0])->dump_flight_recorder(stderr);
+  else
+    dump_flight_recorders();
+}
+
+void sim_t::interactive_mix(const std::string& cmd, const std::vector<std::string>& args)
+{
+  if (args.size() > 1)
+    throw trap_interactive();
+
+  if (args.size() == 1) {
+    processor_t* p = get_core(args[0]);
+    p->get_insn_mix().print(stderr, p->get_id());
+  } else {
+    print_insn_mix();
+  }
+}
+
+void sim_t::interactive_stats(const std::string& cmd, const std::vector<std::string>& args)
+{
+  if (args.size() > 1)
+    throw trap_interactive();
+
+  if (args.size() == 1) {
+    write_hart_stats(stderr, get_core(args[0]), "");
+    fprintf(stderr, "\n");
+  } else {
+    write_stats(stderr);
+  }
+}
@@ -0,0 +1,580 @@
+// See LICENSE for license details.
+
+#include "jit.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <string.h>
+#include <initializer_list>
+#include <vector>
+
+#ifdef __x86_64__
+
+#define DECLARE_HANDLER(name) reg_t rv64_##name(processor_t*, insn_t, reg_t);
+DECLARE_HANDLER(lui) DECLARE_HANDLER(auipc)
+DECLARE_HANDLER(addi) DECLARE_HANDLER(slti) DECLARE_HANDLER(sltiu)
+DECLARE_HANDLER(xori) DECLARE_HANDLER(ori) DECLARE_HANDLER(andi)
+DECLARE_HANDLER(slli) DECLARE_HANDLER(srli) DECLARE_HANDLER(srai)
+DECLARE_HANDLER(add) DECLARE_HANDLER(sub) DECLARE_HANDLER(sll)
+DECLARE_HANDLER(slt) DECLARE_HANDLER(sltu) DECLARE_HANDLER(xor)
+DECLARE_HANDLER(srl) DECLARE_HANDLER(sra) DECLARE_HANDLER(or)
+DECLARE_HANDLER(and)
+DECLARE_HANDLER(addiw) DECLARE_HANDLER(slliw) DECLARE_HANDLER(srliw)
+DECLARE_HANDLER(sraiw) DECLARE_HANDLER(addw) DECLARE_HANDLER(subw)
+DECLARE_HANDLER(sllw) DECLARE_HANDLER(srlw) DECLARE_HANDLER(sraw)
+DECLARE_HANDLER(mul) DECLARE_HANDLER(mulw)
+DECLARE_HANDLER(lb) DECLARE_HANDLER(lh) DECLARE_HANDLER(lw)
+DECLARE_HANDLER(ld) DECLARE_HANDLER(lbu) DECLARE_HANDLER(lhu)
+DECLARE_HANDLER(lwu)
+DECLARE_HANDLER(sb) DECLARE_HANDLER(sh) DECLARE_HANDLER(sw)
+DECLARE_HANDLER(sd)
+DECLARE_HANDLER(c_addi) DECLARE_HANDLER(c_li) DECLARE_HANDLER(c_lui)
+DECLARE_HANDLER(c_addi4spn) DECLARE_HANDLER(c_jal) DECLARE_HANDLER(c_slli)
+DECLARE_HANDLER(c_srli) DECLARE_HANDLER(c_srai) DECLARE_HANDLER(c_andi)
+DECLARE_HANDLER(c_sub) DECLARE_HANDLER(c_xor) DECLARE_HANDLER(c_or)
+DECLARE_HANDLER(c_and) DECLARE_HANDLER(c_subw) DECLARE_HANDLER(c_addw)
+DECLARE_HANDLER(c_mv) DECLARE_HANDLER(c_add)
+DECLARE_HANDLER(c_lw) DECLARE_HANDLER(c_flw) DECLARE_HANDLER(c_lwsp)
+DECLARE_HANDLER(c_flwsp) DECLARE_HANDLER(c_sw) DECLARE_HANDLER(c_fsw)
+DECLARE_HANDLER(c_swsp) DECLARE_HANDLER(c_fswsp)
+#undef DECLARE_HANDLER
+
+enum alu_op_t {
+  ALU_ADD, ALU_SUB, ALU_SLL, ALU_SLT, ALU_SLTU, ALU_XOR, ALU_SRL, ALU_SRA,
+  ALU_OR, ALU_AND, ALU_MUL
+};
+
+// an instruction in a form the code generator understands
+struct jit_insn_t
+{
+  enum { ALU, LI, LOAD, STORE } kind;
+  alu_op_t op;
+  bool word;      // ALU: operate on and sign-extend the low 32 bits
+  bool has_imm;   // ALU: the second operand is imm rather than rs2
+  bool is_signed; // LOAD: sign-extend the loaded value
+  unsigned size;  // LOAD, STORE: access size in bytes
+  unsigned rd, rs1, rs2;
+  int64_t imm;
+};
+
+static jit_insn_t alu_rr(alu_op_t op, bool word, unsigned rd, unsigned rs1, unsigned rs2)
+{
+  return {jit_insn_t::ALU, op, word, false, false, 0, rd, rs1, rs2, 0};
+}
+
+static jit_insn_t alu_ri(alu_op_t op, bool word, unsigned rd, unsigned rs1, int64_t imm)
+{
+  return {jit_insn_t::ALU, op, word, true, false, 0, rd, rs1, 0, imm};
+}
+
+static jit_insn_t li(unsigned rd, int64_t imm)
+{
+  return {jit_insn_t::LI, ALU_ADD, false, true, false, 0, rd, 0, 0, imm};
+}
+
+static jit_insn_t load(unsigned size, bool is_signed, unsigned rd, unsigned rs1, int64_t imm)
+{
+  return {jit_insn_t::LOAD, ALU_ADD, false, true, is_signed, size, rd, rs1, 0, imm};
+}
+
+static jit_insn_t store(unsigned size, unsigned rs1, unsigned rs2, int64_t imm)
+{
+  return {jit_insn_t::STORE, ALU_ADD, false, true, false, size, 0, rs1, rs2, imm};
+}
+
+// Recognize an RV64 instruction the code generator can handle, by the handler
+// the processor decoded it to.  Instructions that would trap in the current
+// configuration are rejected, as are extensions that misa may disable later
+// on unless they are enabled now; writes to misa flush the icache.
+static bool decode(processor_t* p, insn_fetch_t fetch, reg_t pc, jit_insn_t* ji)
+{
+  insn_func_t f = fetch.func;
+  insn_t insn = fetch.insn;
+
+  #define RI(name, op, word, imm) \
+    if (f == rv64_##name) return *ji = alu_ri(op, word, insn.rd(), insn.rs1(), imm), true;
+  #define RR(name, op, word) \
+    if (f == rv64_##name) return *ji = alu_rr(op, word, insn.rd(), insn.rs1(), insn.rs2()), true;
+  #define LOAD(name, size, is_signed) \
+    if (f == rv64_##name) return *ji = load(size, is_signed, insn.rd(), insn.rs1(), insn.i_imm()), true;
+  #define STORE(name, size) \
+    if (f == rv64_##name) return *ji = store(size, insn.rs1(), insn.rs2(), insn.s_imm()), true;
+
+  if (f == rv64_lui) return *ji = li(insn.rd(), insn.u_imm()), true;
+  if (f == rv64_auipc) return *ji = li(insn.rd(), pc + insn.u_imm()), true;
+  RI(addi, ALU_ADD, false, insn.i_imm())
+  RI(slti, ALU_SLT, false, insn.i_imm())
+  RI(sltiu, ALU_SLTU, false, insn.i_imm())
+  RI(xori, ALU_XOR, false, insn.i_imm())
+  RI(ori, ALU_OR, false, insn.i_imm())
+  RI(andi, ALU_AND, false, insn.i_imm())
+  RI(slli, ALU_SLL, false, insn.i_imm() & 0x3f)
+  RI(srli, ALU_SRL, false, insn.i_imm() & 0x3f)
+  RI(srai, ALU_SRA, false, insn.i_imm() & 0x3f)
+  RR(add, ALU_ADD, false)
+  RR(sub, ALU_SUB, false)
+  RR(sll, ALU_SLL, false)
+  RR(slt, ALU_SLT, false)
+  RR(sltu, ALU_SLTU, false)
+  RR(xor, ALU_XOR, false)
+  RR(srl, ALU_SRL, false)
+  RR(sra, ALU_SRA, false)
+  RR(or, ALU_OR, false)
+  RR(and, ALU_AND, false)
+  RI(addiw, ALU_ADD, true, insn.i_imm())
+  RI(slliw, ALU_SLL, true, insn.i_imm() & 0x1f)
+  RI(srliw, ALU_SRL, true, insn.i_imm() & 0x1f)
+  RI(sraiw, ALU_SRA, true, insn.i_imm() & 0x1f)
+  RR(addw, ALU_ADD, true)
+  RR(subw, ALU_SUB, true)
+  RR(sllw, ALU_SLL, true)
+  RR(srlw, ALU_SRL, true)
+  RR(sraw, ALU_SRA, true)
+  LOAD(lb, 1, true)
+  LOAD(lh, 2, true)
+  LOAD(lw, 4, true)
+  LOAD(ld, 8, true)
+  LOAD(lbu, 1, false)
+  LOAD(lhu, 2, false)
+  LOAD(lwu, 4, false)
+  STORE(sb, 1)
+  STORE(sh, 2)
+  STORE(sw, 4)
+  STORE(sd, 8)
+
+  if (p->supports_extension('M')) {
+    RR(mul, ALU_MUL, false)
+    RR(mulw, ALU_MUL, true)
+  }
+
+  if (!p->supports_extension('C'))
+    return false;
+
+  unsigned rd = insn.rvc_rd(), rs1s = insn.rvc_rs1s(), rs2s = insn.rvc_rs2s();
+  unsigned rs2 = insn.rvc_rs2();
+  if (f == rv64_c_addi)
+    return *ji = alu_ri(ALU_ADD, false, rd, rd, insn.rvc_imm()), true;
+  if (f == rv64_c_li)
+    return *ji = li(rd, insn.rvc_imm()), true;
+  if (f == rv64_c_lui && rd == X_SP && insn.rvc_addi16sp_imm() != 0)
+    return *ji = alu_ri(ALU_ADD, false, X_SP, X_SP, insn.rvc_addi16sp_imm()), true;
+  if (f == rv64_c_lui && rd != X_SP && insn.rvc_imm() != 0)
+    return *ji = li(rd, insn.rvc_imm() << 12), true;
+  if (f == rv64_c_addi4spn && insn.rvc_addi4spn_imm() != 0)
+    return *ji = alu_ri(ALU_ADD, false, rs2s, X_SP, insn.rvc_addi4spn_imm()), true;
+  if (f == rv64_c_jal && rd != 0) // c.addiw
+    return *ji = alu_ri(ALU_ADD, true, rd, rd, insn.rvc_imm()), true;
+  if (f == rv64_c_slli)
+    return *ji = alu_ri(ALU_SLL, false, rd, rd, insn.rvc_zimm()), true;
+  if (f == rv64_c_srli)
+    return *ji = alu_ri(ALU_SRL, false, rs1s, rs1s, insn.rvc_zimm()), true;
+  if (f == rv64_c_srai)
+    return *ji = alu_ri(ALU_SRA, false, rs1s, rs1s, insn.rvc_zimm()), true;
+  if (f == rv64_c_andi)
+    return *ji = alu_ri(ALU_AND, false, rs1s, rs1s, insn.rvc_imm()), true;
+  if (f == rv64_c_sub)
+    return *ji = alu_rr(ALU_SUB, false, rs1s, rs1s, rs2s), true;
+  if (f == rv64_c_xor)
+    return *ji = alu_rr(ALU_XOR, false, rs1s, rs1s, rs2s), true;
+  if (f == rv64_c_or)
+    return *ji = alu_rr(ALU_OR, false, rs1s, rs1s, rs2s), true;
+  if (f == rv64_c_and)
+    return *ji = alu_rr(ALU_AND, false, rs1s, rs1s, rs2s), true;
+  if (f == rv64_c_subw)
+    return *ji = alu_rr(ALU_SUB, true, rs1s, rs1s, rs2s), true;
+  if (f == rv64_c_addw)
+    return *ji = alu_rr(ALU_ADD, true, rs1s, rs1s, rs2s), true;
+  if (f == rv64_c_mv && rs2 != 0)
+    return *ji = alu_rr(ALU_ADD, false, rd, 0, rs2), true;
+  if (f == rv64_c_add && rs2 != 0)
+    return *ji = alu_rr(ALU_ADD, false, rd, rd, rs2), true;
+  if (f == rv64_c_lw)
+    return *ji = load(4, true, rs2s, rs1s, insn.rvc_lw_imm()), true;
+  if (f == rv64_c_flw) // c.ld
+    return *ji = load(8, true, rs2s, rs1s, insn.rvc_ld_imm()), true;
+  if (f == rv64_c_lwsp && rd != 0)
+    return *ji = load(4, true, rd, X_SP, insn.rvc_lwsp_imm()), true;
+  if (f == rv64_c_flwsp && rd != 0) // c.ldsp
+    return *ji = load(8, true, rd, X_SP, insn.rvc_ldsp_imm()), true;
+  if (f == rv64_c_sw)
+    return *ji = store(4, rs1s, rs2s, insn.rvc_lw_imm()), true;
+  if (f == rv64_c_fsw) // c.sd
+    return *ji = store(8, rs1s, rs2s, insn.rvc_ld_imm()), true;
+  if (f == rv64_c_swsp)
+    return *ji = store(4, X_SP, rs2, insn.rvc_swsp_imm()), true;
+  if (f == rv64_c_fswsp) // c.sdsp
+    return *ji = store(8, X_SP, rs2, insn.rvc_sdsp_imm()), true;
+
+  return false;
+
+  #undef RI
+  #undef RR
+  #undef LOAD
+  #undef STORE
+}
+
+// x86-64 registers used by the generated code.  A translated run is a leaf
+// function called as an insn_func_t, so everything it touches is
+// caller-saved: rdx holds the PC of the run, r8 points to the integer
+// register file, r9-r11 to the TLB and rdi holds the TLB context, and rax,
+// rcx and rsi are scratch.
+enum { RAX = 0, RCX = 1, RDX = 2, RSI = 6, RDI = 7, R8 = 8, R9 = 9, R10 = 10, R11 = 11 };
+
+// the longest sequence emitted for one instruction, including its exit stub
+static const size_t MAX_INSN_BYTES = 132;
+
+class x86_emitter_t
+{
+public:
+  x86_emitter_t(uint8_t* p) : p(p) {}
+  uint8_t* p;
+
+  void byte(uint8_t x) { *p++ = x; }
+  void imm32(int32_t x) { memcpy(p, &x, 4); p += 4; }
+  void imm64(uint64_t x) { memcpy(p, &x, 8); p += 8; }
+
+  // opc reg, rm
+  void rr(bool w, std::initializer_list<uint8_t> opc, int reg, int rm)
+  {
+    rex(w, reg, 0, rm);
+    for (auto b : opc)
+      byte(b);
+    byte(0xc0 | (reg & 7) << 3 | (rm & 7));
+  }
+
+  // opc reg, [base + disp]
+  void mem(bool w, std::initializer_list<uint8_t> opc, int reg, int base, int32_t disp)
+  {
+    rex(w, reg, 0, base);
+    for (auto b : opc)
+      byte(b);
+    if (disp == (int8_t)disp) {
+      byte(0x40 | (reg & 7) << 3 | (base & 7));
+      byte(disp);
+    } else {
+      byte(0x80 | (reg & 7) << 3 | (base & 7));
+      imm32(disp);
+    }
+  }
+
+  // opc reg, [base + index << scale]
+  void sib(bool w, std::initializer_list<uint8_t> opc, int reg, int base, int index, int scale)
+  {
+    rex(w, reg, index, base);
+    for (auto b : opc)
+      byte(b);
+    byte((reg & 7) << 3 | 4);
+    byte(scale << 6 | (index & 7) << 3 | (base & 7));
+  }
+
+  void movabs(int reg, uint64_t imm)
+  {
+    rex(true, 0, 0, reg);
+    byte(0xb8 | (reg & 7));
+    imm64(imm);
+  }
+
+  // jne to a label that is bound later; returns the location to patch
+  uint8_t* jne()
+  {
+    byte(0x0f);
+    byte(0x85);
+    imm32(0);
+    return p - 4;
+  }
+
+  static void patch(uint8_t* at, uint8_t* target)
+  {
+    int32_t rel = target - (at + 4);
+    memcpy(at, &rel, 4);
+  }
+
+private:
+  void rex(bool w, int reg, int index, int base)
+  {
+    uint8_t r = 0x40 | w << 3 | (reg & 8) >> 1 | (index & 8) >> 2 | (base & 8) >> 3;
+    if (r != 0x40)
+      byte(r);
+  }
+};
+
+static void emit_alu(x86_emitter_t& e, const jit_insn_t& ji)
+{
+  // ModRM reg-field extensions of the 0x81 group, indexed by alu_op_t
+  static const int group1[] = {0, 5, -1, 7, 7, 6, -1, -1, 1, 4, -1};
+  // opcodes of "op r, r/m", indexed by alu_op_t
+  static const uint8_t rm_op[] = {0x03, 0x2b, 0, 0x3b, 0x3b, 0x33, 0, 0, 0x0b, 0x23, 0};
+  // ModRM reg-field extensions of the shift group
+  static const int shift_ext[] = {-1, -1, 4, -1, -1, -1, 5, 7, -1, -1, -1};
+
+  bool w = !ji.word;
+  e.mem(true, {0x8b}, RAX, R8, ji.rs1 * 8);
+
+  switch (ji.op) {
+    case ALU_SLL:
+    case ALU_SRL:
+    case ALU_SRA:
+      if (ji.has_imm) {
+        e.rr(w, {0xc1}, shift_ext[ji.op], RAX);
+        e.byte(ji.imm);
+      } else {
+        e.mem(true, {0x8b}, RCX, R8, ji.rs2 * 8);
+        e.rr(w, {0xd3}, shift_ext[ji.op], RAX);
+      }
+      break;
+    case ALU_MUL:
+      e.mem(w, {0x0f, 0xaf}, RAX, R8, ji.rs2 * 8);
+      break;
+    default:
+      if (ji.has_imm) {
+        e.rr(w, {0x81}, group1[ji.op], RAX);
+        e.imm32(ji.imm);
+      } else {
+        e.mem(w, {rm_op[ji.op]}, RAX, R8, ji.rs2 * 8);
+      }
+      if (ji.op == ALU_SLT || ji.op == ALU_SLTU) {
+        e.rr(false, {0x0f, uint8_t(ji.op == ALU_SLT ? 0x9c : 0x92)}, 0, RAX); // setl/setb al
+        e.rr(false, {0x0f, 0xb6}, RAX, RAX); // movzx eax, al
+      }
+      break;
+  }
+
+  if (ji.word)
+    e.rr(true, {0x63}, RAX, RAX); // movsxd rax, eax
+  if (ji.rd != 0)
+    e.mem(true, {0x89}, RAX, R8, ji.rd * 8);
+}
+
+// Emit the TLB lookup for a load or store.  Leaves the address in rax and the
+// host address of its page in rsi; every case the interpreter's fast path
+// does not handle jumps to the instruction's exit stub.
+static void emit_translate(x86_emitter_t& e, const jit_insn_t& ji, reg_t set_mask,
+                           unsigned way_shift, std::vector<uint8_t*>& exits)
+{
+  e.mem(true, {0x8b}, RAX, R8, ji.rs1 * 8);
+  if (ji.imm)
+    e.rr(true, {0x81}, 0, RAX), e.imm32(ji.imm);
+  if (ji.size > 1) {
+    e.byte(0xa8), e.byte(ji.size - 1); // test al, size-1
+    exits.push_back(e.jne());
+  }
+  e.rr(true, {0x89}, RAX, RCX);                  // mov rcx, rax
+  e.rr(true, {0xc1}, 5, RCX), e.byte(PGSHIFT);   // shr rcx, PGSHIFT
+  e.rr(false, {0x89}, RCX, RSI);                 // mov esi, ecx
+  e.rr(false, {0x81}, 4, RSI), e.imm32(set_mask); // and esi, tlb_set_mask
+  if (way_shift)
+    e.rr(false, {0xc1}, 4, RSI), e.byte(way_shift); // shl esi, tlb_way_shift
+  e.rr(true, {0x09}, RDI, RCX);                  // or rcx, rdi
+  e.sib(true, {0x3b}, RCX, ji.kind == jit_insn_t::LOAD ? R9 : R10, RSI, 3);
+  exits.push_back(e.jne());
+  static_assert(sizeof(tlb_entry_t) == 16, "tlb_data is indexed by idx << 4");
+  e.rr(false, {0xc1}, 4, RSI), e.byte(4);        // shl esi, 4
+  e.sib(true, {0x8b}, RSI, R11, RSI, 0);         // mov rsi, [r11 + rsi]
+}
+
+static void emit_load(x86_emitter_t& e, const jit_insn_t& ji)
+{
+  switch (ji.size) {
+    case 1: e.sib(ji.is_signed, {0x0f, uint8_t(ji.is_signed ? 0xbe : 0xb6)}, RAX, RSI, RAX, 0); break;
+    case 2: e.sib(ji.is_signed, {0x0f, uint8_t(ji.is_signed ? 0xbf : 0xb7)}, RAX, RSI, RAX, 0); break;
+    case 4: e.sib(ji.is_signed, {uint8_t(ji.is_signed ? 0x63 : 0x8b)}, RAX, RSI, RAX, 0); break;
+    case 8: e.sib(true, {0x8b}, RAX, RSI, RAX, 0); break;
+  }
+  if (ji.rd != 0)
+    e.mem(true, {0x89}, RAX, R8, ji.rd * 8);
+}
+
+static void emit_store(x86_emitter_t& e, const jit_insn_t& ji)
+{
+  e.mem(true, {0x8b}, RCX, R8, ji.rs2 * 8);
+  switch (ji.size) {
+    case 1: e.sib(false, {0x88}, RCX, RSI, RAX, 0); break;
+    case 2: e.byte(0x66); e.sib(false, {0x89}, RCX, RSI, RAX, 0); break;
+    case 4: e.sib(false, {0x89}, RCX, RSI, RAX, 0); break;
+    case 8: e.sib(true, {0x89}, RCX, RSI, RAX, 0); break;
+  }
+}
+
+static void emit_li(x86_emitter_t& e, const jit_insn_t& ji)
+{
+  if (ji.rd == 0)
+    return;
+  if (ji.imm == (int32_t)ji.imm) {
+    e.mem(true, {0xc7}, 0, R8, ji.rd * 8);
+    e.imm32(ji.imm);
+  } else {
+    e.movabs(RAX, ji.imm);
+    e.mem(true, {0x89}, RAX, R8, ji.rd * 8);
+  }
+}
+
+#endif
+
+jit_t::jit_t(processor_t* proc)
+  : proc(proc), code(NULL), code_used(0), blocks(new jit_block_t[MAX_BLOCKS]),
+    blocks_used(0)
+{
+#ifdef __x86_64__
+  // The buffer is never writable and executable at once: translate() makes
+  // the pages it writes writable for as long as it writes them.
+  void* p = mmap(NULL, CODE_SIZE, PROT_READ | PROT_EXEC,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p != MAP_FAILED)
+    code = (uint8_t*)p;
+  else
+    fprintf(stderr, "warning: unable to map JIT code buffer; interpreting only\n");
+#endif
+}
+
+jit_t::~jit_t()
+{
+  if (code)
+    munmap(code, CODE_SIZE);
+  delete [] blocks;
+}
+
+void jit_t::reset()
+{
+  // Translations are only reachable from icache entries.
+  proc->get_mmu()->flush_icache(FLUSH_JIT);
+  code_used = 0;
+  blocks_used = 0;
+}
+
+bool jit_t::full()
+{
+  return blocks_used == MAX_BLOCKS ||
+         code_used + ICACHE_BLOCK_INSNS * MAX_INSN_BYTES > CODE_SIZE;
+}
+
+void jit_t::make_room()
+{
+  if (code && full())
+    reset();
+}
+
+void jit_t::translate(icache_entry_t* entry)
+{
+#ifdef __x86_64__
+  if (!code || proc->get_xlen() != 64 || full())
+    return;
+
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  size_t begin = code_used & ~(page_size - 1);
+  // full() leaves room for the block below CODE_SIZE, a multiple of the
+  // page size.
+  size_t end = (code_used + ICACHE_BLOCK_INSNS * MAX_INSN_BYTES + page_size - 1) &
+               ~(page_size - 1);
+  if (mprotect(code + begin, end - begin, PROT_READ | PROT_WRITE) != 0)
+    return;
+
+  mmu_t* mmu = proc->get_mmu();
+  reg_t* xpr = const_cast<reg_t*>(&proc->get_state()->XPR[0]);
+  jit_block_t* block = &blocks[blocks_used];
+  jit_insn_t run[ICACHE_BLOCK_INSNS];
+  size_t translated = 0;
+  block->n = 0;
+
+  // The last instruction is left to the interpreter's loop, which checks it
+  // for control transfers and serialization.
+  reg_t pc = entry->tag;
+  for (size_t i = 0; i + 1 < entry->n; ) {
+    size_t j = i;
+    reg_t npc = pc;
+    while (j + 1 < entry->n && decode(proc, entry->data[j], npc, &run[j - i])) {
+      npc += insn_length(entry->data[j].insn.bits());
+      j++;
+    }
+
+    jit_op_t* op = &block->op[block->n++];
+    op->first = i;
+    op->insn = entry->data[i].insn;
+
+    // A lone instruction costs the same call either way.
+    if (j - i < 2) {
+      op->func = entry->data[i].func;
+      pc += insn_length(entry->data[i].insn.bits());
+      op->npc = pc;
+      op->n = 1;
+      i++;
+      continue;
+    }
+
+    reg_t run_pc = pc;
+    x86_emitter_t e(code + code_used);
+    op->func = reinterpret_cast<insn_func_t>(e.p);
+    op->npc = npc;
+    op->n = j - i;
+
+    bool loads = false, stores = false;
+    for (size_t k = 0; k < j - i; k++) {
+      loads |= run[k].kind == jit_insn_t::LOAD;
+      stores |= run[k].kind == jit_insn_t::STORE;
+    }
+    e.movabs(R8, (uint64_t)xpr);
+    if (loads)
+      e.movabs(R9, (uint64_t)mmu->tlb_load_tag);
+    if (stores)
+      e.movabs(R10, (uint64_t)mmu->tlb_store_tag);
+    if (loads || stores) {
+      e.movabs(R11, (uint64_t)mmu->tlb_data);
+      // A run cannot change the context, but the block's earlier ops can.
+      e.movabs(RDI, (uint64_t)&mmu->tlb_ctx);
+      e.mem(true, {0x8b}, RDI, RDI, 0);          // mov rdi, [rdi]
+    }
+
+    std::vector<std::pair<std::vector<uint8_t*>, reg_t>> exits;
+    for (size_t k = 0; k < j - i; k++) {
+      const jit_insn_t& ji = run[k];
+      switch (ji.kind) {
+        case jit_insn_t::ALU: emit_alu(e, ji); break;
+        case jit_insn_t::LI: emit_li(e, ji); break;
+        case jit_insn_t::LOAD:
+        case jit_insn_t::STORE:
+          exits.push_back({{}, pc - run_pc});
+          emit_translate(e, ji, mmu->tlb_set_mask, mmu->tlb_way_shift,
+                         exits.back().first);
+          if (ji.kind == jit_insn_t::STORE) {
+            // While a hart holds a reservation, stores leave it to the
+            // interpreter to move the line's reservation version on.
+            e.movabs(RCX, (uint64_t)&mmu_t::reservations_live);
+            e.mem(false, {0x83}, 7, RCX, 0), e.byte(0);   // cmp dword [rcx], 0
+            exits.back().first.push_back(e.jne());
+          }
+          // Count the TLB hit as the interpreter's fast path would.
+          e.movabs(RCX, (uint64_t)&mmu->tlb_hits[ji.kind == jit_insn_t::LOAD ? LOAD : STORE]);
+          e.mem(true, {0xff}, 0, RCX, 0);                 // inc qword [rcx]
+          if (ji.kind == jit_insn_t::LOAD)
+            emit_load(e, ji);
+          else
+            emit_store(e, ji);
+          break;
+      }
+      pc += insn_length(entry->data[i + k].insn.bits());
+    }
+
+    // rdx holds the PC the run was entered at
+    e.mem(true, {0x8d}, RAX, RDX, npc - run_pc); // lea rax, [rdx + len]
+    e.byte(0xc3);
+    for (auto& exit : exits) {
+      for (auto at : exit.first)
+        x86_emitter_t::patch(at, e.p);
+      e.mem(true, {0x8d}, RAX, RDX, exit.second);
+      e.byte(0xc3);
+    }
+
+    code_used = e.p - code;
+    translated += j - i;
+    i = j;
+  }
+
+  if (mprotect(code + begin, end - begin, PROT_READ | PROT_EXEC) != 0) {
+    perror("mprotect");
+    abort();
+  }
+
+  if (translated) {
+    entry->jit = block;
+    blocks_used++;
+  }
+#endif
+}
@@ -0,0 +1,67 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_JIT_H
+#define _RISCV_JIT_H
+
+#include "mmu.h"
+#include <stddef.h>
+#include <stdint.h>
+
+// One step of a translated block.  A native op executes a run of n
+// instructions starting at block slot first; an interpreted op is a single
+// instruction's handler.  Either way, func returns npc when every instruction
+// of the op retired.  A native op that cannot complete an instruction without
+// help (a TLB miss, a misaligned access, a trigger) returns that
+// instruction's PC instead, having retired only the instructions before it.
+struct jit_op_t
+{
+  insn_func_t func;
+  insn_t insn;
+  reg_t npc;
+  size_t first;
+  size_t n;
+};
+
+// The translation of all but the last instruction of an icache block.
+struct jit_block_t
+{
+  size_t n;
+  jit_op_t op[ICACHE_BLOCK_INSNS];
+};
+
+// A translator from hot icache blocks to x86-64 code.  Only runs of integer
+// ALU instructions and scalar loads and stores that hit in the TLB are
+// translated; everything that may trap or touch other architectural state is
+// left to the interpreter, so exceptions never unwind through generated code.
+class jit_t
+{
+public:
+  jit_t(processor_t* proc);
+  ~jit_t();
+
+  // number of executions after which a block is translated
+  static const uint32_t HOT_THRESHOLD = 64;
+
+  // translate the block, setting entry->jit if anything was worth
+  // translating.  Nothing is translated while the code buffer is full.
+  void translate(icache_entry_t* entry);
+
+  // Empty the code buffer if another block might not fit.  Emptying it
+  // flushes the icache, so the caller must not be holding an icache entry.
+  void make_room();
+
+private:
+  processor_t* proc;
+
+  static const size_t CODE_SIZE = 4 << 20;
+  static const size_t MAX_BLOCKS = 4096;
+  uint8_t* code;
+  size_t code_used;
+  jit_block_t* blocks;
+  size_t blocks_used;
+
+  bool full();
+  void reset();
+};
+
+#endif
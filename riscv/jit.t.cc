@@ -0,0 +1,302 @@
+// See LICENSE for license details.
+
+// Check translated blocks against the interpreter: run a loop past
+// HOT_THRESHOLD on a hart with the JIT and on one without, and compare the
+// integer registers, pc and minstret as they go, and memory at the end.  The
+// loop uses every instruction the JIT's decode() accepts, including writes
+// to x0, and its loads and stores take every way out of translated code:
+// misaligned accesses, TLB misses, pages in a way other than the most
+// recently used one of their set, and stores while a reservation is held.
+
+#include "config.h"
+#include "processor.h"
+#include "mmu.h"
+#include "jit.h"
+#include "test_sim.h"
+#include <cinttypes>
+#include <memory>
+
+enum {
+  RA = 1, SP = 2, T0 = 5, T1 = 6, T2 = 7, S0 = 8, S1 = 9, A0 = 10, A1 = 11,
+  A2 = 12, A3 = 13, A4 = 14, A5 = 15, S2 = 18, S3 = 19, S4 = 20, S10 = 26,
+  S11 = 27, T3 = 28, T4 = 29, T5 = 30, T6 = 31
+};
+
+static const reg_t CODE = test_sim_t::MEM_BASE;
+static const reg_t DATA0 = test_sim_t::MEM_BASE + 0x1000; // sp
+static const reg_t DATA1 = test_sim_t::MEM_BASE + 0x2000; // s0
+// With a TLB of 4 sets of 2 ways, these three pages share set 3 (as does
+// the page after DATA1), so they keep evicting each other.
+static const reg_t CONFLICT[] = {
+  test_sim_t::MEM_BASE + 0x3000, test_sim_t::MEM_BASE + 0x7000,
+  test_sim_t::MEM_BASE + 0xb000
+};
+static const size_t MEM_SIZE = 0x10000;
+
+static insn_bits_t r(insn_bits_t match, unsigned rd, unsigned rs1, unsigned rs2)
+{
+  return match | rd << 7 | rs1 << 15 | rs2 << 20;
+}
+
+static insn_bits_t i(insn_bits_t match, unsigned rd, unsigned rs1, uint32_t imm)
+{
+  return match | rd << 7 | rs1 << 15 | (imm & 0xfff) << 20;
+}
+
+static insn_bits_t s(insn_bits_t match, unsigned rs2, unsigned rs1, uint32_t imm)
+{
+  return match | (imm & 0x1f) << 7 | rs1 << 15 | rs2 << 20 | (imm >> 5 & 0x7f) << 25;
+}
+
+static insn_bits_t u(insn_bits_t match, unsigned rd, uint32_t imm)
+{
+  return match | rd << 7 | imm << 12;
+}
+
+static insn_bits_t j(unsigned rd, uint32_t imm)
+{
+  return MATCH_JAL | rd << 7 | (imm >> 12 & 0xff) << 12 | (imm >> 11 & 1) << 20 |
+         (imm >> 1 & 0x3ff) << 21 | (imm >> 20 & 1) << 31;
+}
+
+// c.addi, c.li, c.lui, c.addiw, c.slli
+static insn_bits_t ci(insn_bits_t match, unsigned rd, uint32_t imm)
+{
+  return match | (imm >> 5 & 1) << 12 | rd << 7 | (imm & 0x1f) << 2;
+}
+
+// c.srli, c.srai, c.andi
+static insn_bits_t cb(insn_bits_t match, unsigned rd, uint32_t imm)
+{
+  return match | (imm >> 5 & 1) << 12 | (rd - 8) << 7 | (imm & 0x1f) << 2;
+}
+
+// c.sub, c.xor, c.or, c.and, c.subw, c.addw
+static insn_bits_t ca(insn_bits_t match, unsigned rd, unsigned rs2)
+{
+  return match | (rd - 8) << 7 | (rs2 - 8) << 2;
+}
+
+// c.mv, c.add
+static insn_bits_t cr(insn_bits_t match, unsigned rd, unsigned rs2)
+{
+  return match | rd << 7 | rs2 << 2;
+}
+
+// c.lw, c.sw
+static insn_bits_t cw(insn_bits_t match, unsigned r, unsigned rs1, unsigned off)
+{
+  return match | (off >> 3 & 7) << 10 | (rs1 - 8) << 7 | (off >> 2 & 1) << 6 |
+         (off >> 6 & 1) << 5 | (r - 8) << 2;
+}
+
+// c.ld, c.sd
+static insn_bits_t cd(insn_bits_t match, unsigned r, unsigned rs1, unsigned off)
+{
+  return match | (off >> 3 & 7) << 10 | (rs1 - 8) << 7 | (off >> 6 & 3) << 5 | (r - 8) << 2;
+}
+
+struct program_t
+{
+  std::vector<uint16_t> parcels;
+  size_t insns = 0;
+
+  reg_t pc() { return CODE + 2 * parcels.size(); }
+
+  program_t& operator<<(insn_bits_t bits)
+  {
+    parcels.push_back(bits);
+    if (insn_length(bits) == 4)
+      parcels.push_back(bits >> 16);
+    insns++;
+    return *this;
+  }
+};
+
+static program_t assemble()
+{
+  program_t prog;
+  reg_t top = prog.pc();
+
+  // integer ALU, with t0 moving on every pass so that shift amounts and
+  // signs vary
+  prog << i(MATCH_ADDI, T0, T0, 0x5a5)
+       << u(MATCH_AUIPC, T1, 0x12345)
+       << r(MATCH_XOR, T1, T1, T0)
+       << u(MATCH_LUI, T2, 0x80000)
+       << r(MATCH_OR, T2, T2, T0)
+       << r(MATCH_MUL, A0, T0, T1)
+       << r(MATCH_MULW, A1, T1, T2)
+       << r(MATCH_ADD, A2, A0, A1)
+       << r(MATCH_SUB, A3, A2, T2)
+       << r(MATCH_SLL, A4, A0, T0)
+       << r(MATCH_SRL, A5, A1, T1)
+       << r(MATCH_SRA, T3, A0, A3)
+       << r(MATCH_SLT, T4, A0, A1)
+       << r(MATCH_SLTU, T5, A0, A1)
+       << r(MATCH_AND, T6, A2, A3)
+       << i(MATCH_SLTI, RA, A3, -1)
+       << i(MATCH_SLTIU, T4, A4, -2048)
+       << i(MATCH_XORI, A0, A0, -1)
+       << i(MATCH_ORI, A1, A1, 0x7ff)
+       << i(MATCH_ANDI, A2, A2, -16)
+       << i(MATCH_SLLI, A3, A3, 63)
+       << i(MATCH_SRLI, A4, A4, 1)
+       << i(MATCH_SRAI, A5, A5, 33)
+       << i(MATCH_ADDIW, T3, T3, 0x7ff)
+       << i(MATCH_SLLIW, T5, T6, 31)
+       << i(MATCH_SRLIW, T6, A0, 1)
+       << i(MATCH_SRAIW, RA, A1, 7)
+       << r(MATCH_ADDW, A0, A0, T0)
+       << r(MATCH_SUBW, A1, A1, T1)
+       << r(MATCH_SLLW, A2, A3, T0)
+       << r(MATCH_SRLW, A3, A0, T1)
+       << r(MATCH_SRAW, A4, A1, T2)
+       << r(MATCH_ADD, 0, T0, T1)
+       << u(MATCH_LUI, 0, 0x12)
+       << i(MATCH_SLLI, 0, T0, 3);
+
+  // compressed ALU
+  prog << ci(MATCH_C_ADDI, A0, -7)
+       << ci(MATCH_C_LI, A1, 31)
+       << ci(MATCH_C_LUI, A2, 0x1f)
+       << ci(MATCH_C_LUI, A3, 0x20)
+       << ci(MATCH_C_ADDIW, A3, -1)
+       << ci(MATCH_C_SLLI, A4, 13)
+       << cb(MATCH_C_SRLI, A5, 3)
+       << cb(MATCH_C_SRAI, A0, 60)
+       << cb(MATCH_C_ANDI, A1, -3)
+       << ca(MATCH_C_SUB, A2, A3)
+       << ca(MATCH_C_XOR, A3, A4)
+       << ca(MATCH_C_OR, A4, A5)
+       << ca(MATCH_C_AND, A5, A0)
+       << ca(MATCH_C_SUBW, A0, A1)
+       << ca(MATCH_C_ADDW, A1, A2)
+       << cr(MATCH_C_MV, RA, A0)
+       << cr(MATCH_C_ADD, T3, A1)
+       << (MATCH_C_ADDI16SP | 1 << 6)                 // c.addi16sp sp, 16
+       << (MATCH_C_ADDI4SPN | 1 << 11 | (A0 - 8) << 2) // c.addi4spn a0, sp, 16
+       << (MATCH_C_ADDI16SP | 1 << 12 | 0x1f << 2)     // c.addi16sp sp, -16
+       << r(MATCH_ADD, T0, T0, A0);
+
+  // aligned stores and loads of every size
+  prog << s(MATCH_SB, A0, S0, 0)
+       << s(MATCH_SH, A1, S0, 2)
+       << s(MATCH_SW, A2, S0, 4)
+       << s(MATCH_SD, A3, S0, 8)
+       << cw(MATCH_C_SW, A4, S0, 16)
+       << cd(MATCH_C_SD, A5, S0, 24)
+       << (MATCH_C_SWSP | (32 >> 2) << 9 | T3 << 2)    // c.swsp t3, 32(sp)
+       << (MATCH_C_SDSP | (40 >> 3) << 10 | T4 << 2)   // c.sdsp t4, 40(sp)
+       << i(MATCH_LB, T5, S0, 3)
+       << i(MATCH_LBU, T6, S0, 7)
+       << i(MATCH_LH, RA, S0, 2)
+       << i(MATCH_LHU, A0, S0, 6)
+       << i(MATCH_LW, A1, S0, 4)
+       << i(MATCH_LWU, A2, S0, 12)
+       << i(MATCH_LD, A3, S0, 8)
+       << cw(MATCH_C_LW, A4, S0, 16)
+       << cd(MATCH_C_LD, A5, S0, 24)
+       << (MATCH_C_LWSP | 1 << 12 | T1 << 7)           // c.lwsp t1, 32(sp)
+       << (MATCH_C_LDSP | 1 << 12 | T2 << 7 | 1 << 5)  // c.ldsp t2, 40(sp)
+       << i(MATCH_LD, 0, S0, 0)
+       << r(MATCH_ADD, T0, T0, A3);
+
+  // misaligned accesses, one of them across a page
+  prog << i(MATCH_LH, A0, S0, 1)
+       << s(MATCH_SW, A1, S0, 5)
+       << i(MATCH_LD, A2, SP, 3)
+       << s(MATCH_SD, A3, S1, 4)
+       << i(MATCH_LD, A4, S1, 4)
+       << r(MATCH_ADD, T0, T0, A4);
+
+  // TLB misses, and hits in the less recently used way of a set
+  prog << s(MATCH_SD, T0, S2, 0)
+       << i(MATCH_LD, A5, S3, 8)
+       << s(MATCH_SW, A0, S4, 16)
+       << i(MATCH_LD, A1, S3, 8)
+       << i(MATCH_LW, A2, S4, 16)
+       << i(MATCH_LD, A3, S3, 8)
+       << r(MATCH_ADD, T0, T0, A5);
+
+  // Stores to another line leave a reservation alone; one to the reserved
+  // line fails the SC.  The TLB misses above stop runs short, so later
+  // blocks start wherever the interpreter picked up; a jump to the next
+  // instruction makes this section a block of its own, hot enough to run
+  // its stores natively.
+  prog << j(0, 4)
+       << (MATCH_LR_D | T1 << 7 | SP << 15)
+       << s(MATCH_SD, T2, SP, 64)
+       << r(MATCH_ADD, T2, T2, T0)
+       << s(MATCH_SD, T2, SP, 128)
+       << r(MATCH_SC_D, S10, SP, T1)
+       << (MATCH_LR_D | T1 << 7 | SP << 15)
+       << s(MATCH_SD, T2, SP, 192)
+       << s(MATCH_SW, T2, SP, 8)
+       << r(MATCH_SC_D, S11, SP, T1);
+
+  prog << j(0, top - prog.pc());
+  return prog;
+}
+
+static void check_same(processor_t* a, processor_t* b, reg_t code_end)
+{
+  state_t* sa = a->get_state();
+  state_t* sb = b->get_state();
+  TEST_CHECK(sa->pc >= CODE && sa->pc < code_end);
+  TEST_CHECK(sa->pc == sb->pc);
+  TEST_CHECK(sa->minstret == sb->minstret);
+  for (size_t i = 0; i < NXPR; i++) {
+    if (sa->XPR[i] != sb->XPR[i]) {
+      TEST_CHECK(sa->XPR[i] == sb->XPR[i]);
+      printf("  x%zu, pc 0x%016" PRIx64 ", minstret %" PRIu64 "\n",
+             i, sa->pc, sa->minstret);
+    }
+  }
+}
+
+int main()
+{
+  program_t prog = assemble();
+  reg_t code_end = prog.pc();
+  reg_t insns = prog.insns * 4 * jit_t::HOT_THRESHOLD;
+
+  std::unique_ptr<test_sim_t> sims[2];
+  std::unique_ptr<processor_t> procs[2];
+  for (int k = 0; k < 2; k++) {
+    sims[k].reset(new test_sim_t(MEM_SIZE));
+    procs[k].reset(new processor_t(DEFAULT_ISA, DEFAULT_VARCH, sims[k].get(), 0));
+    processor_t* p = procs[k].get();
+    memcpy(sims[k]->addr_to_mem(CODE), prog.parcels.data(), 2 * prog.parcels.size());
+
+    p->set_csr(CSR_PMPADDR0, reg_t(-1));
+    p->set_csr(CSR_PMPCFG0, PMP_NAPOT | PMP_R | PMP_W | PMP_X);
+    p->get_mmu()->set_misaligned_enabled(true);
+    p->get_mmu()->set_tlb_size(4, 2);
+    p->set_jit(k == 1);
+
+    state_t* state = p->get_state();
+    state->pc = CODE;
+    state->XPR.write(SP, DATA0);
+    state->XPR.write(S0, DATA1);
+    state->XPR.write(S1, DATA1 + PGSIZE - 8);
+    for (int c = 0; c < 3; c++)
+      state->XPR.write(S2 + c, CONFLICT[c]);
+  }
+
+  // Stop at odd counts as well, so that some blocks are cut short.
+  static const size_t steps[] = {1000, 37, 3, 250};
+  for (size_t k = 0; procs[0]->get_state()->minstret < insns; k++) {
+    for (auto& p : procs)
+      p->step(steps[k % 4]);
+    check_same(procs[0].get(), procs[1].get(), code_end);
+  }
+
+  TEST_CHECK(memcmp(sims[0]->addr_to_mem(CODE), sims[1]->addr_to_mem(CODE), MEM_SIZE) == 0);
+  for (auto& p : procs) {
+    TEST_CHECK(p->get_state()->XPR[S10] == 0);
+    TEST_CHECK(p->get_state()->XPR[S11] == 1);
+  }
+
+  return test_finish("jit");
+}
@@ -0,0 +1,71 @@
+// See LICENSE for license details.
+
+// Check that LR/SC stays atomic when harts run on separate host threads:
+// harts that each add to a shared counter with an LR/SC loop must not lose
+// an update.  Also check that any store to the reserved word fails the SC,
+// even one that leaves it holding the value LR read.
+
+#include "config.h"
+#include "processor.h"
+#include "mmu.h"
+#include "test_sim.h"
+#include <memory>
+#include <thread>
+
+static const reg_t COUNTER = test_sim_t::MEM_BASE;
+static const size_t HARTS = 4;
+static const size_t INCREMENTS = 200000;
+
+static void check_aba(processor_t* p0, processor_t* p1)
+{
+  mmu_t* m0 = p0->get_mmu();
+  mmu_t* m1 = p1->get_mmu();
+  uint64_t val = m0->load_reserved_int64(COUNTER);
+  TEST_CHECK(m0->store_conditional_uint64(COUNTER, val + 1));
+
+  val = m0->load_reserved_int64(COUNTER);
+  m1->store_uint64(COUNTER, val + 100);
+  m1->store_uint64(COUNTER, val);
+  TEST_CHECK(!m0->store_conditional_uint64(COUNTER, val + 1));
+
+  val = m0->load_reserved_int64(COUNTER);
+  m1->store_uint64(COUNTER, val);
+  TEST_CHECK(!m0->store_conditional_uint64(COUNTER, val + 1));
+
+  val = m0->load_reserved_int64(COUNTER);
+  m1->store_uint64(COUNTER + 128, 1);
+  TEST_CHECK(m0->store_conditional_uint64(COUNTER, val + 1));
+
+  TEST_CHECK(m0->load_uint64(COUNTER) == 2);
+  m0->store_uint64(COUNTER, 0);
+}
+
+static void increment(processor_t* p)
+{
+  mmu_t* mmu = p->get_mmu();
+  for (size_t i = 0; i < INCREMENTS; i++) {
+    uint64_t val;
+    do {
+      val = mmu->load_reserved_int64(COUNTER);
+    } while (!mmu->store_conditional_uint64(COUNTER, val + 1));
+  }
+}
+
+int main()
+{
+  test_sim_t sim(1 << 20);
+  std::vector<std::unique_ptr<processor_t>> procs;
+  for (size_t i = 0; i < HARTS; i++)
+    procs.emplace_back(new processor_t(DEFAULT_ISA, DEFAULT_VARCH, &sim, i));
+
+  check_aba(procs[0].get(), procs[1].get());
+
+  std::vector<std::thread> threads;
+  for (auto& p : procs)
+    threads.emplace_back(increment, p.get());
+  for (auto& t : threads)
+    t.join();
+  TEST_CHECK(sim.read64(COUNTER) == HARTS * INCREMENTS);
+
+  return test_finish("lrsc");
+}
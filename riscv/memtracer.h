@@ -21,6 +21,8 @@ class memtracer_t
 
   virtual bool interested_in_range(uint64_t begin, uint64_t end, access_type type) = 0;
   virtual void trace(uint64_t addr, size_t bytes, access_type type) = 0;
+  // How many of the accesses traced so far missed in a cache model.
+  virtual uint64_t misses() { return 0; }
 };
 
 class memtracer_list_t : public memtracer_t
@@ -39,6 +41,13 @@ class memtracer_list_t : public memtracer_t
     for (std::vector<memtracer_t*>::iterator it = list.begin(); it != list.end(); ++it)
       (*it)->trace(addr, bytes, type);
   }
+  uint64_t misses()
+  {
+    uint64_t n = 0;
+    for (std::vector<memtracer_t*>::iterator it = list.begin(); it != list.end(); ++it)
+      n += (*it)->misses();
+    return n;
+  }
   void hook(memtracer_t* h)
   {
     list.push_back(h);
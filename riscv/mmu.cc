@@ -3,49 +3,344 @@
 #include "mmu.h"
 #include "simif.h"
 #include "processor.h"
+#include <algorithm>
+
+const char* const flush_reason_names[FLUSH_REASONS] = {
+  "sfence.vma", "sfence.vma page", "sfence.vma asid", "fence.i", "pmp",
+  "trigger", "misa", "reset", "jit", "other"
+};
+
+uint32_t mmu_t::reservation_versions[mmu_t::RESERVATION_VERSIONS];
+unsigned mmu_t::reservations_live;
 
 mmu_t::mmu_t(simif_t* sim, processor_t* proc)
  : sim(sim), proc(proc),
+#ifdef RISCV_ENABLE_DIRTY
+  dirty_enabled(true),
+#else
+  dirty_enabled(false),
+#endif
+#ifdef RISCV_ENABLE_MISALIGNED
+  misaligned_enabled(true),
+#else
+  misaligned_enabled(false),
+#endif
   check_triggers_fetch(false),
   check_triggers_load(false),
   check_triggers_store(false),
   matched_trigger(NULL)
 {
-  flush_tlb();
+  faulted = false;
+  tlb_data = NULL;
+  tlb_insn_tag = tlb_load_tag = tlb_store_tag = NULL;
+  tlb_slice_shift = NULL;
+  translated_shift = 0;
+  for (size_t i = 0; i < ICACHE_ENTRIES; i++)
+    icache[i].tag = -1;
+  icache_gen = 0;
+  memset(tlb_misses, 0, sizeof(tlb_misses));
+  memset(cache_misses, 0, sizeof(cache_misses));
+  memset(icache_refills, 0, sizeof(icache_refills));
+  memset(tlb_hits, 0, sizeof(tlb_hits));
+  memset(tlb_slow_paths, 0, sizeof(tlb_slow_paths));
+  memset(tlb_flushes, 0, sizeof(tlb_flushes));
+  memset(icache_flushes, 0, sizeof(icache_flushes));
+  set_tlb_size(DEFAULT_TLB_SETS, DEFAULT_TLB_WAYS);
+  load_reservation_host = NULL;
   yield_load_reservation();
 }
 
 mmu_t::~mmu_t()
 {
+  yield_load_reservation();
+  delete [] tlb_data;
+  delete [] tlb_insn_tag;
+  delete [] tlb_load_tag;
+  delete [] tlb_store_tag;
+  delete [] tlb_slice_shift;
 }
 
-void mmu_t::flush_icache()
+void mmu_t::set_tlb_size(size_t sets, size_t ways)
 {
-  for (size_t i = 0; i < ICACHE_ENTRIES; i++)
-    icache[i].tag = -1;
+  assert(sets && (sets & (sets - 1)) == 0);
+  assert(ways && (ways & (ways - 1)) == 0);
+
+  delete [] tlb_data;
+  delete [] tlb_insn_tag;
+  delete [] tlb_load_tag;
+  delete [] tlb_store_tag;
+  delete [] tlb_slice_shift;
+
+  tlb_sets = sets;
+  tlb_ways = ways;
+  tlb_set_mask = sets - 1;
+  tlb_way_shift = 0;
+  while ((size_t(1) << tlb_way_shift) < ways)
+    tlb_way_shift++;
+  tlb_data = new tlb_entry_t[sets * ways];
+  tlb_insn_tag = new reg_t[sets * ways];
+  tlb_load_tag = new reg_t[sets * ways];
+  tlb_store_tag = new reg_t[sets * ways];
+  tlb_slice_shift = new uint8_t[sets * ways];
+  tlb_slice_listed.assign(sets, false);
+  reset_tlb();
+}
+
+void mmu_t::flush_icache(flush_reason_t reason)
+{
+  icache_flushes[reason]++;
+  icache_gen++;
+  icache_ctx = tlb_ctx | icache_gen;
 }
 
-void mmu_t::flush_tlb()
+void mmu_t::flush_tlb(flush_reason_t reason)
 {
-  memset(tlb_insn_tag, -1, sizeof(tlb_insn_tag));
-  memset(tlb_load_tag, -1, sizeof(tlb_load_tag));
-  memset(tlb_store_tag, -1, sizeof(tlb_store_tag));
+  tlb_flushes[reason]++;
+  tlb_recent_used = 0;
+  clear_superpages();
+  clear_pwc();
+  update_context();
+}
 
-  flush_icache();
+void mmu_t::set_dirty_enabled(bool value)
+{
+  dirty_enabled = value;
+  flush_tlb();
+}
+
+void mmu_t::flush_tlb_page(reg_t vaddr)
+{
+  tlb_flushes[FLUSH_SFENCE_VMA_PAGE]++;
+
+  for (size_t i = 0; i < TLB_SUPERPAGES; i++)
+    if ((vaddr >> tlb_superpage[i].shift) == tlb_superpage[i].vpn)
+      tlb_superpage[i].types = 0;
+
+  // Only leaf PTEs are ordered by an address-specific fence, but dropping
+  // the tables above vaddr as well costs little.
+  for (size_t i = 0; i < PWC_ENTRIES; i++)
+    if (pwc[i].valid && (vaddr >> pwc[i].shift) == pwc[i].vpn)
+      pwc[i].valid = false;
+
+  // vaddr's own page can only be in its set, but the slices of a superpage
+  // that covers vaddr may be in any of the sets that hold slices.
+  reg_t page = vaddr >> PGSHIFT;
+  size_t idx = tlb_index(page);
+  for (size_t i = idx; i < idx + tlb_ways; i++)
+    tlb_flush_way(i, page, 0);
+
+  for (size_t k = 0; k < tlb_slice_sets.size(); ) {
+    size_t set = tlb_slice_sets[k];
+    bool slices = false;
+    size_t first = set << tlb_way_shift;
+    for (size_t i = first; i < first + tlb_ways; i++) {
+      if (tlb_slice_shift[i])
+        tlb_flush_way(i, page, tlb_slice_shift[i] - PGSHIFT);
+      slices |= tlb_slice_shift[i] != 0;
+    }
+    if (slices) {
+      k++;
+    } else {
+      tlb_slice_listed[set] = false;
+      tlb_slice_sets[k] = tlb_slice_sets.back();
+      tlb_slice_sets.pop_back();
+    }
+  }
+
+  // Every icache block in a superpage that may cover vaddr goes as well.
+  unsigned shift = tlb_superpage_shift ? tlb_superpage_shift - PGSHIFT : 0;
+  reg_t vpn = page >> shift;
+
+  // A block never spans more than one page boundary, at its last instruction.
+  for (size_t i = 0; i < ICACHE_ENTRIES; i++) {
+    icache_entry_t* entry = &icache[i];
+    if (entry->tag == reg_t(-1))
+      continue;
+    if ((entry->tag >> PGSHIFT >> shift) == vpn ||
+        ((entry->npc - 1) >> PGSHIFT >> shift) == vpn)
+      entry->tag = -1;
+  }
+}
+
+void mmu_t::tlb_flush_way(size_t idx, reg_t vpn, unsigned shift)
+{
+  if ((tlb_insn_tag[idx] & TLB_VPN_MASK) >> shift == vpn >> shift)
+    tlb_insn_tag[idx] = -1;
+  if ((tlb_load_tag[idx] & TLB_VPN_MASK) >> shift == vpn >> shift)
+    tlb_load_tag[idx] = -1;
+  if ((tlb_store_tag[idx] & TLB_VPN_MASK) >> shift == vpn >> shift)
+    tlb_store_tag[idx] = -1;
+  if (tlb_insn_tag[idx] == reg_t(-1) && tlb_load_tag[idx] == reg_t(-1) &&
+      tlb_store_tag[idx] == reg_t(-1))
+    tlb_slice_shift[idx] = 0;
+}
+
+void mmu_t::flush_tlb_asid(reg_t asid)
+{
+  // satp implements no ASID bits (ASIDLEN is 0), so every bit of asid is
+  // ignored and every context that translates at all belongs to it.  Bare
+  // and M-mode contexts, whose satp is recorded as 0, survive.
+  tlb_flushes[FLUSH_SFENCE_VMA_ASID]++;
+  size_t n = 0;
+  for (size_t i = 0; i < tlb_recent_used; i++) {
+    if (tlb_recent_ctx[i].satp == 0) {
+      tlb_recent_ctx[n] = tlb_recent_ctx[i];
+      tlb_recent_id[n] = tlb_recent_id[i];
+      n++;
+    }
+  }
+  tlb_recent_used = n;
+  clear_superpages();
+  clear_pwc();
+  update_context();
+}
+
+void mmu_t::reset_tlb()
+{
+  memset(tlb_insn_tag, -1, tlb_sets * tlb_ways * sizeof(reg_t));
+  memset(tlb_load_tag, -1, tlb_sets * tlb_ways * sizeof(reg_t));
+  memset(tlb_store_tag, -1, tlb_sets * tlb_ways * sizeof(reg_t));
+  memset(tlb_slice_shift, 0, tlb_sets * tlb_ways);
+  tlb_slice_sets.clear();
+  tlb_slice_listed.assign(tlb_sets, false);
+
+  tlb_recent_used = 0;
+  tlb_recent_next = 0;
+  tlb_next_id = 0;
+  tlb_superpage_next = 0;
+  clear_superpages();
+  clear_pwc();
+  // icache entries are tagged with context IDs, which are about to be reused
+  icache_gen++;
+  update_context();
+}
+
+void mmu_t::update_context()
+{
+  tlb_context_t ctx = {PRV_M, PRV_M, 0, 0};
+  if (proc) {
+    ctx.prv = ctx.data_prv = proc->state.prv;
+    if (!proc->state.dcsr.cause && get_field(proc->state.mstatus, MSTATUS_MPRV))
+      ctx.data_prv = get_field(proc->state.mstatus, MSTATUS_MPP);
+    // satp, SUM and MXR are irrelevant when nothing is translated
+    reg_t mode = get_field(proc->state.satp,
+                           proc->max_xlen == 32 ? SATP32_MODE : SATP64_MODE);
+    if ((ctx.prv != PRV_M || ctx.data_prv != PRV_M) && mode != SATP_MODE_OFF) {
+      ctx.satp = proc->state.satp;
+      ctx.mstatus = proc->state.mstatus & (MSTATUS_SUM | MSTATUS_MXR);
+    }
+  }
+
+  size_t i = 0;
+  while (i < tlb_recent_used && !(tlb_recent_ctx[i] == ctx))
+    i++;
+
+  if (i == tlb_recent_used) {
+    if (tlb_next_id > TLB_MAX_CTX)
+      return reset_tlb();
+    if (tlb_recent_used < TLB_RECENT_CTXS)
+      tlb_recent_used++;
+    else
+      i = tlb_recent_next++ % TLB_RECENT_CTXS;
+    tlb_recent_ctx[i] = ctx;
+    tlb_recent_id[i] = tlb_next_id++;
+  }
+
+  tlb_ctx = tlb_recent_id[i] << TLB_CTX_SHIFT;
+  icache_ctx = tlb_ctx | icache_gen;
+}
+
+bool mmu_t::tlb_promote(reg_t vpn)
+{
+  size_t idx = tlb_index(vpn);
+  for (size_t w = 1; w < tlb_ways; w++) {
+    if (tlb_holds(idx + w, vpn | tlb_ctx)) {
+      tlb_rotate(idx, w);
+      return true;
+    }
+  }
+  return false;
+}
+
+void mmu_t::tlb_rotate(size_t idx, size_t w)
+{
+  tlb_entry_t data = tlb_data[idx + w];
+  reg_t insn_tag = tlb_insn_tag[idx + w];
+  reg_t load_tag = tlb_load_tag[idx + w];
+  reg_t store_tag = tlb_store_tag[idx + w];
+  uint8_t slice_shift = tlb_slice_shift[idx + w];
+  memmove(&tlb_data[idx + 1], &tlb_data[idx], w * sizeof(tlb_entry_t));
+  memmove(&tlb_insn_tag[idx + 1], &tlb_insn_tag[idx], w * sizeof(reg_t));
+  memmove(&tlb_load_tag[idx + 1], &tlb_load_tag[idx], w * sizeof(reg_t));
+  memmove(&tlb_store_tag[idx + 1], &tlb_store_tag[idx], w * sizeof(reg_t));
+  memmove(&tlb_slice_shift[idx + 1], &tlb_slice_shift[idx], w);
+  tlb_data[idx] = data;
+  tlb_insn_tag[idx] = insn_tag;
+  tlb_load_tag[idx] = load_tag;
+  tlb_store_tag[idx] = store_tag;
+  tlb_slice_shift[idx] = slice_shift;
+}
+
+void mmu_t::clear_superpages()
+{
+  for (size_t i = 0; i < TLB_SUPERPAGES; i++)
+    tlb_superpage[i].types = 0;
+  tlb_superpage_shift = 0;
+}
+
+void mmu_t::clear_pwc()
+{
+  for (size_t i = 0; i < PWC_ENTRIES; i++)
+    pwc[i].valid = false;
+}
+
+bool mmu_t::lookup_superpage(reg_t addr, access_type type, reg_t* paddr)
+{
+  if (!tlb_superpage_shift)
+    return false;
+
+  for (size_t i = 0; i < TLB_SUPERPAGES; i++) {
+    tlb_superpage_t* sp = &tlb_superpage[i];
+    if ((sp->types & (1 << type)) && sp->ctx == tlb_ctx &&
+        (addr >> sp->shift) == sp->vpn) {
+      *paddr = addr + sp->target_offset;
+      translated_shift = sp->shift;
+      return true;
+    }
+  }
+  return false;
+}
+
+void mmu_t::refill_superpage(reg_t addr, access_type type, reg_t paddr, unsigned shift)
+{
+  tlb_superpage_t* sp = NULL;
+  for (size_t i = 0; i < TLB_SUPERPAGES && !sp; i++) {
+    tlb_superpage_t* p = &tlb_superpage[i];
+    if (p->types && p->ctx == tlb_ctx && p->shift == shift &&
+        p->vpn == addr >> shift && p->target_offset == paddr - addr)
+      sp = p;
+  }
+  if (!sp) {
+    sp = &tlb_superpage[tlb_superpage_next++ % TLB_SUPERPAGES];
+    *sp = {tlb_ctx, addr >> shift, shift, 0, paddr - addr};
+  }
+  sp->types |= 1 << type;
+  tlb_superpage_shift = std::max(tlb_superpage_shift, shift);
 }
 
-static void throw_access_exception(reg_t addr, access_type type)
+void mmu_t::access_fault(reg_t addr, access_type type, bool defer)
 {
   switch (type) {
-    case FETCH: throw trap_instruction_access_fault(addr);
-    case LOAD: throw trap_load_access_fault(addr);
-    case STORE: throw trap_store_access_fault(addr);
+    case FETCH: return fault(trap_instruction_access_fault(addr), defer);
+    case LOAD: return fault(trap_load_access_fault(addr), defer);
+    case STORE: return fault(trap_store_access_fault(addr), defer);
     default: abort();
   }
 }
 
-reg_t mmu_t::translate(reg_t addr, reg_t len, access_type type)
+reg_t mmu_t::translate(reg_t addr, reg_t len, access_type type, bool defer)
 {
+  translated_shift = 0;
   if (!proc)
     return addr;
 
@@ -55,14 +350,49 @@ reg_t mmu_t::translate(reg_t addr, reg_t len, access_type type)
       mode = get_field(proc->state.mstatus, MSTATUS_MPP);
   }
 
-  reg_t paddr = walk(addr, type, mode) | (addr & (PGSIZE-1));
-  if (!pmp_ok(paddr, len, type, mode))
-    throw_access_exception(addr, type);
+  reg_t paddr;
+  if (!lookup_superpage(addr, type, &paddr)) {
+    paddr = walk(addr, type, mode, defer) | (addr & (PGSIZE-1));
+    if (unlikely(faulted))
+      return 0;
+  }
+  if (!pmp_ok(paddr, len, type, mode)) {
+    access_fault(addr, type, defer);
+    return 0;
+  }
   return paddr;
 }
 
+bool mmu_t::peek(reg_t addr, size_t len, void* bytes)
+{
+  reg_t vpn = addr >> PGSHIFT;
+  if (((addr + len - 1) >> PGSHIFT) != vpn)
+    return false;
+
+  char* host_addr = NULL;
+  size_t idx = tlb_index(vpn);
+  for (size_t w = 0; w < tlb_ways && !host_addr; w++) {
+    if (tlb_load_tag[idx + w] == (vpn | tlb_ctx))
+      host_addr = tlb_data[idx + w].host_offset + addr;
+  }
+
+  if (!host_addr) {
+    reg_t mode = proc->state.prv;
+    if (!proc->state.dcsr.cause && get_field(proc->state.mstatus, MSTATUS_MPRV))
+      mode = get_field(proc->state.mstatus, MSTATUS_MPP);
+    if (decode_vm_info(proc->max_xlen, mode, proc->state.satp).levels == 0)
+      host_addr = sim->addr_to_mem(addr);
+  }
+
+  if (!host_addr)
+    return false;
+  memcpy(bytes, host_addr, len);
+  return true;
+}
+
 tlb_entry_t mmu_t::fetch_slow_path(reg_t vaddr)
 {
+  tlb_slow_paths[FETCH]++;
   reg_t paddr = translate(vaddr, sizeof(fetch_temp), FETCH);
 
   if (auto host_addr = sim->addr_to_mem(paddr)) {
@@ -101,18 +431,21 @@ reg_t reg_from_bytes(size_t len, const uint8_t* bytes)
   abort();
 }
 
-void mmu_t::load_slow_path(reg_t addr, reg_t len, uint8_t* bytes)
+void mmu_t::load_slow_path(reg_t addr, reg_t len, uint8_t* bytes, bool defer)
 {
-  reg_t paddr = translate(addr, len, LOAD);
+  tlb_slow_paths[LOAD]++;
+  reg_t paddr = translate(addr, len, LOAD, defer);
+  if (unlikely(faulted))
+    return;
 
   if (auto host_addr = sim->addr_to_mem(paddr)) {
     memcpy(bytes, host_addr, len);
     if (tracer.interested_in_range(paddr, paddr + PGSIZE, LOAD))
-      tracer.trace(paddr, len, LOAD);
+      trace(paddr, len, LOAD);
     else
       refill_tlb(addr, paddr, host_addr, LOAD);
   } else if (!sim->mmio_load(paddr, len, bytes)) {
-    throw trap_load_access_fault(addr);
+    return fault(trap_load_access_fault(addr), defer);
   }
 
   if (!matched_trigger) {
@@ -123,9 +456,12 @@ void mmu_t::load_slow_path(reg_t addr, reg_t len, uint8_t* bytes)
   }
 }
 
-void mmu_t::store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes)
+void mmu_t::store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes, bool defer)
 {
-  reg_t paddr = translate(addr, len, STORE);
+  tlb_slow_paths[STORE]++;
+  reg_t paddr = translate(addr, len, STORE, defer);
+  if (unlikely(faulted))
+    return;
 
   if (!matched_trigger) {
     reg_t data = reg_from_bytes(len, bytes);
@@ -135,20 +471,51 @@ void mmu_t::store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes)
   }
 
   if (auto host_addr = sim->addr_to_mem(paddr)) {
+    note_store(host_addr);
     memcpy(host_addr, bytes, len);
     if (tracer.interested_in_range(paddr, paddr + PGSIZE, STORE))
-      tracer.trace(paddr, len, STORE);
+      trace(paddr, len, STORE);
     else
       refill_tlb(addr, paddr, host_addr, STORE);
   } else if (!sim->mmio_store(paddr, len, bytes)) {
-    throw trap_store_access_fault(addr);
+    return fault(trap_store_access_fault(addr), defer);
+  }
+}
+
+char* mmu_t::amo_host_addr_slow(reg_t addr, reg_t len)
+{
+  if (tlb_promote(addr >> PGSHIFT))
+    return amo_host_addr(addr, len);
+
+  reg_t paddr = translate(addr, len, STORE);
+  auto host_addr = sim->addr_to_mem(paddr);
+  if (!host_addr || check_triggers_store)
+    return NULL;
+  // Stores that come back NULL count when they take store_slow_path.
+  tlb_slow_paths[STORE]++;
+
+  // A traced page stays out of the TLB, but the update must still be made in
+  // place to be atomic with respect to harts on other host threads.
+  if (tracer.interested_in_range(paddr, paddr + PGSIZE, STORE)) {
+    trace(paddr, len, STORE);
+    return host_addr;
   }
+
+  refill_tlb(addr, paddr, host_addr, STORE);
+  return host_addr;
 }
 
 tlb_entry_t mmu_t::refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type)
 {
-  reg_t idx = (vaddr >> PGSHIFT) % TLB_ENTRIES;
-  reg_t expected_tag = vaddr >> PGSHIFT;
+  tlb_misses[event_prv()][type]++;
+
+  reg_t vpn = vaddr >> PGSHIFT;
+  size_t idx = tlb_index(vpn);
+  reg_t expected_tag = vpn | tlb_ctx;
+
+  // make room in the most recently used way, evicting the least recently used
+  if (!tlb_holds(idx, expected_tag) && !tlb_promote(vpn))
+    tlb_rotate(idx, tlb_ways - 1);
 
   if ((tlb_load_tag[idx] & ~TLB_CHECK_TRIGGERS) != expected_tag)
     tlb_load_tag[idx] = -1;
@@ -157,6 +524,19 @@ tlb_entry_t mmu_t::refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_
   if ((tlb_insn_tag[idx] & ~TLB_CHECK_TRIGGERS) != expected_tag)
     tlb_insn_tag[idx] = -1;
 
+  // translate() has just found the page vaddr is in.  Translations of the
+  // other access types kept in this way came from the same page table, but
+  // keep the larger shift should they disagree.
+  bool kept = tlb_load_tag[idx] != reg_t(-1) ||
+              tlb_store_tag[idx] != reg_t(-1) || tlb_insn_tag[idx] != reg_t(-1);
+  if (!kept || translated_shift > tlb_slice_shift[idx])
+    tlb_slice_shift[idx] = translated_shift;
+  size_t set = idx >> tlb_way_shift;
+  if (tlb_slice_shift[idx] && !tlb_slice_listed[set]) {
+    tlb_slice_listed[set] = true;
+    tlb_slice_sets.push_back(set);
+  }
+
   if ((check_triggers_fetch && type == FETCH) ||
       (check_triggers_load && type == LOAD) ||
       (check_triggers_store && type == STORE))
@@ -173,94 +553,107 @@ tlb_entry_t mmu_t::refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_
   return entry;
 }
 
-reg_t mmu_t::pmp_ok(reg_t addr, reg_t len, access_type type, reg_t mode)
+void mmu_t::update_pmp()
 {
-  if (!proc)
-    return true;
+  const size_t n = state_t::n_pmp;
+  bool active[n];
+  reg_t first[n], last[n];
+  std::vector<reg_t> starts(1, 0);
 
   reg_t base = 0;
-  for (size_t i = 0; i < proc->state.n_pmp; i++) {
+  for (size_t i = 0; i < n; i++) {
     reg_t tor = proc->state.pmpaddr[i] << PMP_SHIFT;
     uint8_t cfg = proc->state.pmpcfg[i];
+    active[i] = false;
 
-    if (cfg & PMP_A) {
-      bool is_tor = (cfg & PMP_A) == PMP_TOR;
+    if ((cfg & PMP_A) == PMP_TOR) {
+      active[i] = base < tor;
+      first[i] = base;
+      last[i] = tor - 1;
+    } else if (cfg & PMP_A) {
       bool is_na4 = (cfg & PMP_A) == PMP_NA4;
-
       reg_t mask = (proc->state.pmpaddr[i] << 1) | (!is_na4);
       mask = ~(mask & ~(mask + 1)) << PMP_SHIFT;
-
-      // Check each 4-byte sector of the access
-      bool any_match = false;
-      bool all_match = true;
-      for (reg_t offset = 0; offset < len; offset += 1 << PMP_SHIFT) {
-        reg_t cur_addr = addr + offset;
-        bool napot_match = ((cur_addr ^ tor) & mask) == 0;
-        bool tor_match = base <= cur_addr && cur_addr < tor;
-        bool match = is_tor ? tor_match : napot_match;
-        any_match |= match;
-        all_match &= match;
-      }
-
-      if (any_match) {
-        // If the PMP matches only a strict subset of the access, fail it
-        if (!all_match)
-          return false;
-
-        return
-          (mode == PRV_M && !(cfg & PMP_L)) ||
-          (type == LOAD && (cfg & PMP_R)) ||
-          (type == STORE && (cfg & PMP_W)) ||
-          (type == FETCH && (cfg & PMP_X));
-      }
+      active[i] = true;
+      first[i] = tor & mask;
+      last[i] = first[i] | ~mask;
     }
 
+    if (active[i]) {
+      starts.push_back(first[i]);
+      if (last[i] != reg_t(-1))
+        starts.push_back(last[i] + 1);
+    }
     base = tor;
   }
 
-  return mode == PRV_M;
+  std::sort(starts.begin(), starts.end());
+  starts.erase(std::unique(starts.begin(), starts.end()), starts.end());
+
+  const uint8_t all = (1 << LOAD) | (1 << STORE) | (1 << FETCH);
+  pmp_regions.clear();
+  for (reg_t start : starts) {
+    int entry = -1;
+    for (size_t i = 0; i < n && entry < 0; i++)
+      if (active[i] && first[i] <= start && start <= last[i])
+        entry = i;
+
+    // adjacent pieces matched by the same entry behave identically
+    if (!pmp_regions.empty() && pmp_regions.back().entry == entry)
+      continue;
+
+    pmp_region_t region = {start, entry, {0, all}};
+    if (entry >= 0) {
+      uint8_t cfg = proc->state.pmpcfg[entry];
+      region.perm[0] = ((cfg & PMP_R) ? 1 << LOAD : 0) |
+                       ((cfg & PMP_W) ? 1 << STORE : 0) |
+                       ((cfg & PMP_X) ? 1 << FETCH : 0);
+      region.perm[1] = (cfg & PMP_L) ? region.perm[0] : all;
+    }
+    pmp_regions.push_back(region);
+  }
+  pmp_last = 0;
 }
 
-reg_t mmu_t::pmp_homogeneous(reg_t addr, reg_t len)
+size_t mmu_t::pmp_region(reg_t addr)
 {
-  if ((addr | len) & (len - 1))
-    abort();
+  size_t r = pmp_last;
+  if (addr < pmp_regions[r].start ||
+      (r + 1 < pmp_regions.size() && addr >= pmp_regions[r + 1].start)) {
+    auto it = std::upper_bound(pmp_regions.begin(), pmp_regions.end(), addr,
+      [](reg_t a, const pmp_region_t& region) { return a < region.start; });
+    pmp_last = r = it - pmp_regions.begin() - 1;
+  }
+  return r;
+}
 
+reg_t mmu_t::pmp_ok(reg_t addr, reg_t len, access_type type, reg_t mode)
+{
   if (!proc)
     return true;
 
-  reg_t base = 0;
-  for (size_t i = 0; i < proc->state.n_pmp; i++) {
-    reg_t tor = proc->state.pmpaddr[i] << PMP_SHIFT;
-    uint8_t cfg = proc->state.pmpcfg[i];
-
-    if (cfg & PMP_A) {
-      bool is_tor = (cfg & PMP_A) == PMP_TOR;
-      bool is_na4 = (cfg & PMP_A) == PMP_NA4;
-
-      bool begins_after_lower = addr >= base;
-      bool begins_after_upper = addr >= tor;
-      bool ends_before_lower = (addr & -len) < (base & -len);
-      bool ends_before_upper = (addr & -len) < (tor & -len);
-      bool tor_homogeneous = ends_before_lower || begins_after_upper ||
-        (begins_after_lower && ends_before_upper);
+  // An access that straddles two regions is matched only in part by the
+  // lower-numbered of their entries, which fails it.
+  size_t r = pmp_region(addr);
+  if (r + 1 < pmp_regions.size() && addr + len - 1 >= pmp_regions[r + 1].start)
+    return false;
 
-      reg_t mask = (proc->state.pmpaddr[i] << 1) | (!is_na4);
-      mask = ~(mask & ~(mask + 1)) << PMP_SHIFT;
-      bool mask_homogeneous = ~(mask << 1) & len;
-      bool napot_homogeneous = mask_homogeneous || ((addr ^ tor) / len) != 0;
+  return (pmp_regions[r].perm[mode == PRV_M] >> type) & 1;
+}
 
-      if (!(is_tor ? tor_homogeneous : napot_homogeneous))
-        return false;
-    }
+reg_t mmu_t::pmp_homogeneous(reg_t addr, reg_t len)
+{
+  if ((addr | len) & (len - 1))
+    abort();
 
-    base = tor;
-  }
+  if (!proc)
+    return true;
 
-  return true;
+  size_t r = pmp_region(addr);
+  return r + 1 == pmp_regions.size() || addr + len - 1 < pmp_regions[r + 1].start;
 }
 
-reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode)
+reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode, bool defer)
 {
   vm_info vm = decode_vm_info(proc->max_xlen, mode, proc->get_state()->satp);
   if (vm.levels == 0)
@@ -277,22 +670,53 @@ reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode)
   if (masked_msbs != 0 && masked_msbs != mask)
     vm.levels = 0;
 
+  reg_t satp = proc->get_state()->satp;
   reg_t base = vm.ptbase;
-  for (int i = vm.levels - 1; i >= 0; i--) {
+  char* host_base = NULL;
+  int i = vm.levels - 1;
+
+  // start from the lowest-level table the page-walk cache knows
+  for (int level = 1; level < vm.levels; level++) {
+    unsigned shift = PGSHIFT + level * vm.idxbits;
+    pwc_entry_t* e = pwc_entry(addr, shift);
+    if (e->valid && e->satp == satp && e->shift == shift && e->vpn == addr >> shift) {
+      base = e->base;
+      host_base = e->host_base;
+      i = level - 1;
+      break;
+    }
+  }
+
+  for (; i >= 0; i--) {
     int ptshift = i * vm.idxbits;
     reg_t idx = (addr >> (PGSHIFT + ptshift)) & ((1 << vm.idxbits) - 1);
 
     // check that physical address of PTE is legal
     auto pte_paddr = base + idx * vm.ptesize;
-    auto ppte = sim->addr_to_mem(pte_paddr);
-    if (!ppte || !pmp_ok(pte_paddr, vm.ptesize, LOAD, PRV_S))
-      throw_access_exception(addr, type);
+    char* ppte;
+    if (host_base) {
+      ppte = host_base + idx * vm.ptesize;
+    } else {
+      ppte = sim->addr_to_mem(pte_paddr);
+      if (!ppte || !pmp_ok(pte_paddr, vm.ptesize, LOAD, PRV_S)) {
+        access_fault(addr, type, defer);
+        return 0;
+      }
+    }
 
     reg_t pte = vm.ptesize == 4 ? *(uint32_t*)ppte : *(uint64_t*)ppte;
     reg_t ppn = pte >> PTE_PPN_SHIFT;
 
     if (PTE_TABLE(pte)) { // next level of page table
       base = ppn << PGSHIFT;
+      host_base = sim->addr_to_mem(base);
+      if (host_base && !(pmp_homogeneous(base, PGSIZE) &&
+                         pmp_ok(base, vm.ptesize, LOAD, PRV_S)))
+        host_base = NULL;
+      if (i > 0) {
+        unsigned shift = PGSHIFT + ptshift;
+        *pwc_entry(addr, shift) = {true, satp, addr >> shift, shift, base, host_base};
+      }
     } else if ((pte & PTE_U) ? s_mode && (type == FETCH || !sum) : !s_mode) {
       break;
     } else if (!(pte & PTE_V) || (!(pte & PTE_R) && (pte & PTE_W))) {
@@ -305,31 +729,38 @@ reg_t mmu_t::walk(reg_t addr, access_type type, reg_t mode)
       break;
     } else {
       reg_t ad = PTE_A | ((type == STORE) * PTE_D);
-#ifdef RISCV_ENABLE_DIRTY
-      // set accessed and possibly dirty bits.
-      if ((pte & ad) != ad) {
-        if (!pmp_ok(pte_paddr, vm.ptesize, STORE, PRV_S))
-          throw_access_exception(addr, type);
-        *(uint32_t*)ppte |= ad;
+      if (dirty_enabled) {
+        // set accessed and possibly dirty bits.
+        if ((pte & ad) != ad) {
+          if (!pmp_ok(pte_paddr, vm.ptesize, STORE, PRV_S)) {
+            access_fault(addr, type, defer);
+            return 0;
+          }
+          *(uint32_t*)ppte |= ad;
+        }
+      } else {
+        // take exception if access or possibly dirty bit is not set.
+        if ((pte & ad) != ad)
+          break;
       }
-#else
-      // take exception if access or possibly dirty bit is not set.
-      if ((pte & ad) != ad)
-        break;
-#endif
       // for superpage mappings, make a fake leaf PTE for the TLB's benefit.
       reg_t vpn = addr >> PGSHIFT;
       reg_t value = (ppn | (vpn & ((reg_t(1) << ptshift) - 1))) << PGSHIFT;
+      if (ptshift) {
+        refill_superpage(addr, type, value | (addr & (PGSIZE-1)), PGSHIFT + ptshift);
+        translated_shift = PGSHIFT + ptshift;
+      }
       return value;
     }
   }
 
   switch (type) {
-    case FETCH: throw trap_instruction_page_fault(addr);
-    case LOAD: throw trap_load_page_fault(addr);
-    case STORE: throw trap_store_page_fault(addr);
+    case FETCH: fault(trap_instruction_page_fault(addr), defer); break;
+    case LOAD: fault(trap_load_page_fault(addr), defer); break;
+    case STORE: fault(trap_store_page_fault(addr), defer); break;
     default: abort();
   }
+  return 0;
 }
 
 void mmu_t::register_memtracer(memtracer_t* t)
@@ -337,3 +768,10 @@ void mmu_t::register_memtracer(memtracer_t* t)
   flush_tlb();
   tracer.hook(t);
 }
+
+void mmu_t::trace(reg_t paddr, size_t len, access_type type)
+{
+  uint64_t misses = tracer.misses();
+  tracer.trace(paddr, len, type);
+  cache_misses[event_prv()][type] += tracer.misses() - misses;
+}
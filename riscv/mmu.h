@@ -24,10 +24,26 @@ struct insn_fetch_t
   insn_t insn;
 };
 
+// maximum number of instructions in a decoded basic block
+const size_t ICACHE_BLOCK_INSNS = 16;
+
+// A basic block of decoded instructions.  A block starts at tag and runs
+// until the first instruction that may redirect control flow or alter
+// translation state, the end of the page, or ICACHE_BLOCK_INSNS instructions.
+// It is only valid in the translation context and icache generation it was
+// decoded in, which ctx records.
 struct icache_entry_t {
   reg_t tag;
-  struct icache_entry_t* next;
-  insn_fetch_t data;
+  reg_t ctx;
+  reg_t npc; // fall-through PC following the last instruction
+  reg_t paddr; // physical address of the first instruction
+  size_t n;
+  // successors last reached via a taken (0) or not-taken (1) exit
+  struct icache_entry_t* succ[2];
+  // execution count and native translation, see jit.h
+  uint32_t hits;
+  struct jit_block_t* jit;
+  insn_fetch_t data[ICACHE_BLOCK_INSNS];
 };
 
 struct tlb_entry_t {
@@ -48,6 +64,23 @@ class trigger_matched_t
     reg_t data;
 };
 
+// Why the TLB or the icache was flushed, as counted for the simulator's own
+// statistics.
+enum flush_reason_t {
+  FLUSH_SFENCE_VMA,      // sfence.vma of every address and ASID
+  FLUSH_SFENCE_VMA_PAGE, // sfence.vma of one address
+  FLUSH_SFENCE_VMA_ASID, // sfence.vma of one ASID
+  FLUSH_FENCE_I,
+  FLUSH_PMP,
+  FLUSH_TRIGGER,
+  FLUSH_MISA,
+  FLUSH_RESET,
+  FLUSH_JIT,             // the JIT was turned off or ran out of space
+  FLUSH_OTHER,           // logging, tracers and other simulator settings
+  FLUSH_REASONS
+};
+extern const char* const flush_reason_names[FLUSH_REASONS];
+
 // this class implements a processor's port into the virtual memory system.
 // an MMU and instruction cache are maintained for simulator performance.
 class mmu_t
@@ -56,38 +89,52 @@ public:
   mmu_t(simif_t* sim, processor_t* proc);
   ~mmu_t();
 
-  inline reg_t misaligned_load(reg_t addr, size_t size)
+  // Set when an access made with defer set faulted: the fault is the hart's
+  // deferred trap, and the access did nothing.  See MMU_LOAD in decode.h.
+  bool faulted;
+
+  inline reg_t misaligned_load(reg_t addr, size_t size, bool defer = false)
   {
-#ifdef RISCV_ENABLE_MISALIGNED
+    if (!misaligned_enabled) {
+      fault(trap_load_address_misaligned(addr), defer);
+      return 0;
+    }
     reg_t res = 0;
-    for (size_t i = 0; i < size; i++)
-      res += (reg_t)load_uint8(addr + i) << (i * 8);
+    for (size_t i = 0; i < size; i++) {
+      res += (reg_t)load_uint8(addr + i, defer) << (i * 8);
+      if (unlikely(faulted))
+        return 0;
+    }
     return res;
-#else
-    throw trap_load_address_misaligned(addr);
-#endif
   }
 
-  inline void misaligned_store(reg_t addr, reg_t data, size_t size)
+  inline void misaligned_store(reg_t addr, reg_t data, size_t size, bool defer = false)
   {
-#ifdef RISCV_ENABLE_MISALIGNED
-    for (size_t i = 0; i < size; i++)
-      store_uint8(addr + i, data >> (i * 8));
-#else
-    throw trap_store_address_misaligned(addr);
-#endif
+    if (!misaligned_enabled)
+      return fault(trap_store_address_misaligned(addr), defer);
+    for (size_t i = 0; i < size; i++) {
+      store_uint8(addr + i, data >> (i * 8), defer);
+      if (unlikely(faulted))
+        return;
+    }
   }
 
-  // template for functions that load an aligned value from memory
+  // template for functions that load an aligned value from memory. With
+  // defer set, a page, access or misaligned fault sets faulted rather than
+  // being thrown.
   #define load_func(type) \
-    inline type##_t load_##type(reg_t addr) { \
+    inline type##_t load_##type(reg_t addr, bool defer = false) { \
       if (unlikely(addr & (sizeof(type##_t)-1))) \
-        return misaligned_load(addr, sizeof(type##_t)); \
+        return misaligned_load(addr, sizeof(type##_t), defer); \
       reg_t vpn = addr >> PGSHIFT; \
-      if (likely(tlb_load_tag[vpn % TLB_ENTRIES] == vpn)) \
-        return *(type##_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr); \
-      if (unlikely(tlb_load_tag[vpn % TLB_ENTRIES] == (vpn | TLB_CHECK_TRIGGERS))) { \
-        type##_t data = *(type##_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr); \
+      size_t idx = tlb_index(vpn); \
+      if (likely(tlb_load_tag[idx] == (vpn | tlb_ctx))) { \
+        tlb_hits[LOAD]++; \
+        return *(type##_t*)(tlb_data[idx].host_offset + addr); \
+      } \
+      if (unlikely(tlb_load_tag[idx] == (vpn | tlb_ctx | TLB_CHECK_TRIGGERS))) { \
+        tlb_hits[LOAD]++; \
+        type##_t data = *(type##_t*)(tlb_data[idx].host_offset + addr); \
         if (!matched_trigger) { \
           matched_trigger = trigger_exception(OPERATION_LOAD, addr, data); \
           if (matched_trigger) \
@@ -95,8 +142,10 @@ public:
         } \
         return data; \
       } \
-      type##_t res; \
-      load_slow_path(addr, sizeof(type##_t), (uint8_t*)&res); \
+      if (tlb_promote(vpn)) \
+        return load_##type(addr, defer); \
+      type##_t res = 0; \
+      load_slow_path(addr, sizeof(type##_t), (uint8_t*)&res, defer); \
       return res; \
     }
 
@@ -112,27 +161,37 @@ public:
   load_func(int32)
   load_func(int64)
 
-  // template for functions that store an aligned value to memory
+  // template for functions that store an aligned value to memory, which
+  // defer faults as the loads do
   #define store_func(type) \
-    void store_##type(reg_t addr, type##_t val) { \
+    void store_##type(reg_t addr, type##_t val, bool defer = false) { \
       if (unlikely(addr & (sizeof(type##_t)-1))) \
-        return misaligned_store(addr, val, sizeof(type##_t)); \
+        return misaligned_store(addr, val, sizeof(type##_t), defer); \
       reg_t vpn = addr >> PGSHIFT; \
-      if (likely(tlb_store_tag[vpn % TLB_ENTRIES] == vpn)) \
-        *(type##_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr) = val; \
-      else if (unlikely(tlb_store_tag[vpn % TLB_ENTRIES] == (vpn | TLB_CHECK_TRIGGERS))) { \
+      size_t idx = tlb_index(vpn); \
+      if (likely(tlb_store_tag[idx] == (vpn | tlb_ctx))) { \
+        tlb_hits[STORE]++; \
+        note_store(tlb_data[idx].host_offset + addr); \
+        *(type##_t*)(tlb_data[idx].host_offset + addr) = val; \
+      } else if (unlikely(tlb_store_tag[idx] == (vpn | tlb_ctx | TLB_CHECK_TRIGGERS))) { \
+        tlb_hits[STORE]++; \
         if (!matched_trigger) { \
           matched_trigger = trigger_exception(OPERATION_STORE, addr, val); \
           if (matched_trigger) \
             throw *matched_trigger; \
         } \
-        *(type##_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr) = val; \
+        note_store(tlb_data[idx].host_offset + addr); \
+        *(type##_t*)(tlb_data[idx].host_offset + addr) = val; \
       } \
+      else if (tlb_promote(vpn)) \
+        store_##type(addr, val, defer); \
       else \
-        store_slow_path(addr, sizeof(type##_t), (const uint8_t*)&val); \
+        store_slow_path(addr, sizeof(type##_t), (const uint8_t*)&val, defer); \
     }
 
-  // template for functions that perform an atomic memory operation
+  // template for functions that perform an atomic memory operation. Other
+  // harts may be running on other host threads, so when the word is in host
+  // memory it is updated with a compare-and-swap loop.
   #define amo_func(type) \
     template<typename op> \
     type##_t amo_##type(reg_t addr, op f) { \
@@ -140,6 +199,13 @@ public:
         throw trap_store_address_misaligned(addr); \
       try { \
         auto lhs = load_##type(addr); \
+        if (auto host_addr = (type##_t*)amo_host_addr(addr, sizeof(type##_t))) { \
+          note_store(host_addr); \
+          while (!__atomic_compare_exchange_n(host_addr, &lhs, f(lhs), false, \
+                                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) \
+            ; \
+          return lhs; \
+        } \
         store_##type(addr, f(lhs)); \
         return lhs; \
       } catch (trap_load_page_fault& t) { \
@@ -153,20 +219,16 @@ public:
 
   void store_float128(reg_t addr, float128_t val)
   {
-#ifndef RISCV_ENABLE_MISALIGNED
-    if (unlikely(addr & (sizeof(float128_t)-1)))
+    if (unlikely(addr & (sizeof(float128_t)-1)) && !misaligned_enabled)
       throw trap_store_address_misaligned(addr);
-#endif
     store_uint64(addr, val.v[0]);
     store_uint64(addr + 8, val.v[1]);
   }
 
   float128_t load_float128(reg_t addr)
   {
-#ifndef RISCV_ENABLE_MISALIGNED
-    if (unlikely(addr & (sizeof(float128_t)-1)))
+    if (unlikely(addr & (sizeof(float128_t)-1)) && !misaligned_enabled)
       throw trap_load_address_misaligned(addr);
-#endif
     return (float128_t){load_uint64(addr), load_uint64(addr + 8)};
   }
 
@@ -180,18 +242,103 @@ public:
   amo_func(uint32)
   amo_func(uint64)
 
+  // template for LR: take a reservation and remember the value read
+  #define load_reserved_func(type) \
+    type##_t load_reserved_##type(reg_t addr) { \
+      acquire_load_reservation(addr); \
+      type##_t val = load_##type(addr); \
+      load_reservation_value = val; \
+      return val; \
+    }
+
+  // template for SC. The store succeeds only if no store has reached the
+  // reserved line since LR, as its reservation version tells.  The SC holds
+  // the version odd while it writes, so a store on another host thread that
+  // bumps it meanwhile waits for the SC.  The write is still a
+  // compare-and-swap with the value LR read, for a store that raced the LR
+  // itself and missed reservations_live.
+  #define store_conditional_func(type) \
+    bool store_conditional_##type(reg_t addr, type##_t val) { \
+      bool have_reservation = check_load_reservation(addr); \
+      if (addr & (sizeof(type##_t)-1)) \
+        throw trap_store_address_misaligned(addr); \
+      if (have_reservation) { \
+        uint32_t* version = reservation_version(load_reservation_host); \
+        uint32_t expected_version = load_reservation_version; \
+        type##_t expected = load_reservation_value; \
+        if (auto host_addr = (type##_t*)amo_host_addr(addr, sizeof(type##_t))) { \
+          bool locked = __atomic_compare_exchange_n(version, &expected_version, \
+                                                    expected_version + 1, false, \
+                                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED); \
+          have_reservation = locked && \
+            __atomic_compare_exchange_n(host_addr, &expected, val, false, \
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST); \
+          if (locked) \
+            __atomic_fetch_add(version, 1, __ATOMIC_RELEASE); \
+        } else if ((have_reservation = __atomic_load_n(version, __ATOMIC_ACQUIRE) == expected_version)) { \
+          /* triggers are armed, so the store takes the slow path */ \
+          store_##type(addr, val); \
+        } \
+      } \
+      yield_load_reservation(); \
+      return have_reservation; \
+    }
+
+  load_reserved_func(int32)
+  load_reserved_func(int64)
+  store_conditional_func(uint32)
+  store_conditional_func(uint64)
+
+  // host address of an aligned word that an AMO or SC may update in place,
+  // or NULL if the store must take the slow path (MMIO, triggers, tracers)
+  inline char* amo_host_addr(reg_t addr, reg_t len)
+  {
+    reg_t vpn = addr >> PGSHIFT;
+    size_t idx = tlb_index(vpn);
+    if (likely(tlb_store_tag[idx] == (vpn | tlb_ctx))) {
+      tlb_hits[STORE]++;
+      return tlb_data[idx].host_offset + addr;
+    }
+    return amo_host_addr_slow(addr, len);
+  }
+
   inline void yield_load_reservation()
   {
     load_reservation_address = (reg_t)-1;
+    if (load_reservation_host) {
+      load_reservation_host = NULL;
+      __atomic_fetch_sub(&reservations_live, 1, __ATOMIC_RELAXED);
+    }
   }
 
   inline void acquire_load_reservation(reg_t vaddr)
   {
     reg_t paddr = translate(vaddr, 1, LOAD);
-    if (auto host_addr = sim->addr_to_mem(paddr))
+    if (auto host_addr = sim->addr_to_mem(paddr)) {
       load_reservation_address = refill_tlb(vaddr, paddr, host_addr, LOAD).target_offset + vaddr;
-    else
+      if (!load_reservation_host)
+        __atomic_fetch_add(&reservations_live, 1, __ATOMIC_SEQ_CST);
+      load_reservation_host = host_addr;
+      // an odd version is an SC part way through its write
+      uint32_t* version = reservation_version(host_addr);
+      while ((load_reservation_version = __atomic_load_n(version, __ATOMIC_ACQUIRE)) & 1)
+        ;
+    } else {
       throw trap_load_access_fault(vaddr); // disallow LR to I/O space
+    }
+  }
+
+  // Every store to host memory comes through here before it writes, while
+  // any hart holds a reservation, to move the version of its line on; see
+  // store_conditional_func.
+  inline void note_store(const void* host_addr)
+  {
+    if (likely(!__atomic_load_n(&reservations_live, __ATOMIC_RELAXED)))
+      return;
+    uint32_t* version = reservation_version(host_addr);
+    if (__atomic_fetch_add(version, 2, __ATOMIC_ACQ_REL) & 1)
+      while (__atomic_load_n(version, __ATOMIC_ACQUIRE) & 1)
+        ;
   }
 
   inline bool check_load_reservation(reg_t vaddr)
@@ -210,7 +357,37 @@ public:
     return (addr / PC_ALIGN) % ICACHE_ENTRIES;
   }
 
-  inline icache_entry_t* refill_icache(reg_t addr, icache_entry_t* entry)
+  // Whether insn must be the last instruction of a decoded block: control
+  // transfers, fences, SYSTEM and custom instructions may leave the block or
+  // invalidate it.
+  inline bool insn_ends_block(insn_bits_t insn)
+  {
+    switch (insn_length(insn)) {
+      case 2: {
+        unsigned funct3 = (insn >> 13) & 7;
+        if ((insn & 3) == 1) // c.jal (RV32), c.j, c.beqz, c.bnez
+          return funct3 == 5 || funct3 >= 6 || (funct3 == 1 && proc->get_xlen() == 32);
+        if ((insn & 3) == 2) // c.jr, c.jalr, c.ebreak
+          return funct3 == 4 && ((insn >> 2) & 0x1f) == 0;
+        return false;
+      }
+      case 4:
+        switch (insn & 0x7f) {
+          case 0x0f: // MISC-MEM
+          case 0x63: // BRANCH
+          case 0x67: // JALR
+          case 0x6f: // JAL
+          case 0x73: // SYSTEM
+          case 0x0b: case 0x2b: case 0x5b: case 0x7b: // custom-0..3
+            return true;
+        }
+        return false;
+      default:
+        return true;
+    }
+  }
+
+  inline icache_entry_t* refill_icache(reg_t addr, icache_entry_t* entry, size_t max_insns = ICACHE_BLOCK_INSNS)
   {
     auto tlb_entry = translate_insn_addr(addr);
     insn_bits_t insn = *(uint16_t*)(tlb_entry.host_offset + addr);
@@ -232,100 +409,328 @@ public:
 
     insn_fetch_t fetch = {proc->decode_insn(insn), insn};
     entry->tag = addr;
-    entry->next = &icache[icache_index(addr + length)];
-    entry->data = fetch;
-
-    reg_t paddr = tlb_entry.target_offset + addr;;
+    entry->ctx = icache_ctx;
+    entry->npc = addr + length;
+    entry->paddr = tlb_entry.target_offset + addr;
+    entry->n = 1;
+    entry->succ[0] = entry->succ[1] = entry;
+    entry->hits = 0;
+    entry->jit = NULL;
+    entry->data[0] = fetch;
+
+    reg_t paddr = entry->paddr;
+    reg_t vpn = addr >> PGSHIFT;
     if (tracer.interested_in_range(paddr, paddr + 1, FETCH)) {
       entry->tag = -1;
-      tracer.trace(paddr, length, FETCH);
+      trace(paddr, length, FETCH);
+      return entry;
+    }
+
+    // The rest of the block may only be fetched straight from host memory if
+    // the page is in the ITLB, i.e. it is not MMIO, not covered by an
+    // execute trigger and homogeneous with respect to PMP.
+    if (tlb_insn_tag[tlb_index(vpn)] != (vpn | tlb_ctx) ||
+        tracer.interested_in_range(paddr & PGMASK, (paddr & PGMASK) + PGSIZE, FETCH))
+      return entry;
+
+    while (entry->n < max_insns && !insn_ends_block(insn) &&
+           (entry->npc >> PGSHIFT) == vpn) {
+      reg_t pc = entry->npc;
+      insn = *(const uint16_t*)(tlb_entry.host_offset + pc);
+      length = insn_length(insn);
+      if (length == 2)
+        insn = (int16_t)insn;
+      else if (length == 4 && (pc & (PGSIZE-1)) + length <= PGSIZE)
+        insn |= (insn_bits_t)*(const int16_t*)(tlb_entry.host_offset + pc + 2) << 16;
+      else
+        break;
+
+      entry->data[entry->n++] = {proc->decode_insn(insn), insn};
+      entry->npc = pc + length;
     }
     return entry;
   }
 
+  inline bool icache_hit(icache_entry_t* entry, reg_t addr)
+  {
+    return entry->tag == addr && entry->ctx == icache_ctx;
+  }
+
   inline icache_entry_t* access_icache(reg_t addr)
   {
     icache_entry_t* entry = &icache[icache_index(addr)];
-    if (likely(entry->tag == addr))
+    if (likely(icache_hit(entry, addr)))
       return entry;
+    icache_refills[event_prv()]++;
     return refill_icache(addr, entry);
   }
 
-  inline insn_fetch_t load_insn(reg_t addr)
+  // Fetch and decode the instruction at addr, and if paddr isn't NULL, say
+  // where it lives in physical memory.
+  inline insn_fetch_t load_insn(reg_t addr, reg_t* paddr = NULL)
   {
     icache_entry_t entry;
-    return refill_icache(addr, &entry)->data;
+    refill_icache(addr, &entry, 1);
+    if (paddr)
+      *paddr = entry.paddr;
+    return entry.data[0];
   }
 
-  void flush_tlb();
-  void flush_icache();
+  // Read len bytes at addr the way a load would, but only if that needs no
+  // page table walk, MMIO access or trigger check: the translation must
+  // already be in the TLB, or translation must be off.  Nothing the target
+  // can observe changes.  Returns false if the bytes couldn't be read.
+  bool peek(reg_t addr, size_t len, void* bytes);
+
+  // resize the TLB to sets sets of ways ways each, both powers of 2
+  void set_tlb_size(size_t sets, size_t ways);
+  static const size_t DEFAULT_TLB_SETS = 256;
+  static const size_t DEFAULT_TLB_WAYS = 4;
+
+  void flush_tlb(flush_reason_t reason = FLUSH_OTHER);
+  // invalidate the translations of one virtual page, in every context
+  void flush_tlb_page(reg_t vaddr);
+  // invalidate the translations of every context that uses the given ASID
+  void flush_tlb_asid(reg_t asid);
+  void flush_icache(flush_reason_t reason = FLUSH_OTHER);
+  // called whenever the privilege mode, mstatus.MPRV/MPP/SUM/MXR, satp or
+  // debug mode change, all of which affect address translation
+  void update_context();
 
   void register_memtracer(memtracer_t*);
 
-  int is_dirty_enabled()
-  {
-#ifdef RISCV_ENABLE_DIRTY
-    return 1;
-#else
-    return 0;
-#endif
-  }
-
-  int is_misaligned_enabled()
-  {
-#ifdef RISCV_ENABLE_MISALIGNED
-    return 1;
-#else
-    return 0;
-#endif
-  }
+  // Event counts for the hardware performance counters, by the privilege
+  // mode the hart was in.  TLB misses are TLB refills; cache misses are
+  // those of the cache models among the memtracers.
+  uint64_t get_tlb_misses(reg_t prv, access_type type) { return tlb_misses[prv][type]; }
+  uint64_t get_cache_misses(reg_t prv, access_type type) { return cache_misses[prv][type]; }
+  uint64_t get_icache_refills(reg_t prv) { return icache_refills[prv]; }
+
+  // Counts of the simulator's own work, for tuning it rather than the
+  // target.  An access hits if the fast path finds its translation in the
+  // TLB, possibly after moving it to the front of its set, and otherwise
+  // takes the slow path, which may walk the page table, go to MMIO or go to
+  // a traced page.  The fast paths in JIT-compiled code count their hits
+  // too.
+  uint64_t get_tlb_hits(access_type type) { return tlb_hits[type]; }
+  uint64_t get_tlb_slow_paths(access_type type) { return tlb_slow_paths[type]; }
+  uint64_t get_tlb_flushes(flush_reason_t reason) { return tlb_flushes[reason]; }
+  uint64_t get_icache_flushes(flush_reason_t reason) { return icache_flushes[reason]; }
+
+  // called whenever a pmpcfg or pmpaddr CSR changes
+  void update_pmp();
+
+  // Whether the page-table walker sets PTE A and D bits itself rather than
+  // raising a page fault, and whether misaligned loads and stores are
+  // emulated rather than trapped. configure's --enable-dirty and
+  // --enable-misaligned set the defaults.
+  bool is_dirty_enabled() { return dirty_enabled; }
+  bool is_misaligned_enabled() { return misaligned_enabled; }
+  void set_dirty_enabled(bool value);
+  void set_misaligned_enabled(bool value) { misaligned_enabled = value; }
 
 private:
   simif_t* sim;
   processor_t* proc;
+  bool dirty_enabled;
+  bool misaligned_enabled;
   memtracer_list_t tracer;
+  uint64_t tlb_misses[PRV_M + 1][3];
+  uint64_t cache_misses[PRV_M + 1][3];
+  uint64_t icache_refills[PRV_M + 1];
+  uint64_t tlb_hits[3];
+  uint64_t tlb_slow_paths[3];
+  uint64_t tlb_flushes[FLUSH_REASONS];
+  uint64_t icache_flushes[FLUSH_REASONS];
+  reg_t event_prv() { return proc ? proc->state.prv : PRV_M; }
+  void trace(reg_t paddr, size_t len, access_type type);
   reg_t load_reservation_address;
+  reg_t load_reservation_value;
+  char* load_reservation_host;
+  uint32_t load_reservation_version;
+
+  // LR/SC reservations are kept per 64-byte line of host memory, hashed
+  // into a table of versions shared by every hart, so that they hold
+  // across host threads.  A collision only makes an SC fail spuriously.
+  static const size_t RESERVATION_VERSIONS = 4096;
+  static uint32_t reservation_versions[RESERVATION_VERSIONS];
+  static unsigned reservations_live; // harts holding a reservation
+  static uint32_t* reservation_version(const void* host_addr)
+  {
+    return &reservation_versions[((uintptr_t)host_addr >> 6) % RESERVATION_VERSIONS];
+  }
   uint16_t fetch_temp;
 
   // implement an instruction cache for simulator performance
   icache_entry_t icache[ICACHE_ENTRIES];
+  // flush_icache bumps the generation rather than visiting every entry
+  reg_t icache_gen;
+  reg_t icache_ctx; // tlb_ctx | icache_gen
 
   // implement a TLB for simulator performance
-  static const reg_t TLB_ENTRIES = 256;
   // If a TLB tag has TLB_CHECK_TRIGGERS set, then the MMU must check for a
   // trigger match before completing an access.
   static const reg_t TLB_CHECK_TRIGGERS = reg_t(1) << 63;
-  tlb_entry_t tlb_data[TLB_ENTRIES];
-  reg_t tlb_insn_tag[TLB_ENTRIES];
-  reg_t tlb_load_tag[TLB_ENTRIES];
-  reg_t tlb_store_tag[TLB_ENTRIES];
+
+  // TLB tags hold the ID of the translation context they were filled in
+  // above the VPN, which never has more than 52 bits.  Switching to a
+  // context seen recently reuses its ID and whatever the TLB still holds for
+  // it; flush_tlb just retires every ID handed out so far.  The tag arrays
+  // are only cleared when the IDs run out.
+  struct tlb_context_t {
+    reg_t prv, data_prv, satp, mstatus;
+    bool operator==(const tlb_context_t& o) const {
+      return prv == o.prv && data_prv == o.data_prv && satp == o.satp &&
+             mstatus == o.mstatus;
+    }
+  };
+  static const reg_t TLB_CTX_SHIFT = 52;
+  static const reg_t TLB_MAX_CTX = (TLB_CHECK_TRIGGERS >> TLB_CTX_SHIFT) - 2;
+  static const size_t TLB_RECENT_CTXS = 8;
+  tlb_context_t tlb_recent_ctx[TLB_RECENT_CTXS];
+  reg_t tlb_recent_id[TLB_RECENT_CTXS];
+  size_t tlb_recent_used;
+  size_t tlb_recent_next;
+  reg_t tlb_next_id;
+  reg_t tlb_ctx; // ID of the current context << TLB_CTX_SHIFT
+  static const reg_t TLB_VPN_MASK = (reg_t(1) << TLB_CTX_SHIFT) - 1;
+
+  // The TLB is set-associative.  The ways of a set are stored contiguously
+  // from most to least recently used, so the fast paths only ever look at
+  // the first way of a set; a hit in any other way moves it to the front.
+  size_t tlb_sets;
+  size_t tlb_ways;
+  reg_t tlb_set_mask;
+  unsigned tlb_way_shift;
+  tlb_entry_t* tlb_data;
+  reg_t* tlb_insn_tag;
+  reg_t* tlb_load_tag;
+  reg_t* tlb_store_tag;
+
+  // The shift of the superpage each way's translation is a slice of, or 0,
+  // and the sets that may hold such slices, so that a single-page flush
+  // only has to visit those sets besides the page's own.  A set leaves the
+  // list when a flush finds no slice left in it.
+  uint8_t* tlb_slice_shift;
+  std::vector<size_t> tlb_slice_sets;
+  std::vector<bool> tlb_slice_listed; // by set
+  // the shift of the page that translate() last found, 0 for a 4 KiB page
+  unsigned translated_shift;
+
+  // index of the most recently used way of vpn's set
+  inline size_t tlb_index(reg_t vpn)
+  {
+    return (vpn & tlb_set_mask) << tlb_way_shift;
+  }
+
+  // whether the way at index idx holds a translation with the given tag
+  inline bool tlb_holds(size_t idx, reg_t tag)
+  {
+    return (tlb_insn_tag[idx] & ~TLB_CHECK_TRIGGERS) == tag ||
+           (tlb_load_tag[idx] & ~TLB_CHECK_TRIGGERS) == tag ||
+           (tlb_store_tag[idx] & ~TLB_CHECK_TRIGGERS) == tag;
+  }
+
+  // if another way of vpn's set holds vpn, make it the most recently used
+  bool tlb_promote(reg_t vpn);
+  // make way w of the set at index idx the most recently used
+  void tlb_rotate(size_t idx, size_t w);
+  // invalidate the translations in the way at index idx of pages whose
+  // numbers match vpn above bit shift
+  void tlb_flush_way(size_t idx, reg_t vpn, unsigned shift);
+
+  // Superpage translations found by walk, so that a TLB miss anywhere in a
+  // megapage or gigapage costs no page table walk once one access to it has
+  // been translated.  Each entry records the access types it was walked for,
+  // since permissions and the translating privilege mode differ by type.
+  // The TLB itself still holds 4 KiB slices; tlb_slice_shift marks them.
+  struct tlb_superpage_t {
+    reg_t ctx;
+    reg_t vpn; // vaddr >> shift
+    unsigned shift;
+    unsigned types; // bit mask of access_type
+    reg_t target_offset;
+  };
+  static const size_t TLB_SUPERPAGES = 16;
+  tlb_superpage_t tlb_superpage[TLB_SUPERPAGES];
+  size_t tlb_superpage_next;
+  unsigned tlb_superpage_shift; // largest shift cached since the last flush
+
+  // Page-walk cache: the lower-level page tables that recent walks passed
+  // through, so that a TLB miss normally reads only the leaf PTE.  An entry
+  // maps the VA bits above shift, under a given satp, to the physical base of
+  // the table that translates them and, if PMP lets S-mode read that whole
+  // table, its host address.  Entries are keyed by satp, so satp writes need
+  // not invalidate them; SFENCE.VMA and PMP changes do.
+  struct pwc_entry_t {
+    bool valid;
+    reg_t satp;
+    reg_t vpn; // vaddr >> shift
+    unsigned shift;
+    reg_t base;
+    char* host_base;
+  };
+  static const size_t PWC_ENTRIES = 64;
+  pwc_entry_t pwc[PWC_ENTRIES];
+
+  inline pwc_entry_t* pwc_entry(reg_t addr, unsigned shift)
+  {
+    return &pwc[((addr >> shift) ^ shift) % PWC_ENTRIES];
+  }
+
+  void clear_pwc();
+
+  void clear_superpages();
+  bool lookup_superpage(reg_t addr, access_type type, reg_t* paddr);
+  void refill_superpage(reg_t addr, access_type type, reg_t paddr, unsigned shift);
+
+  // invalidate every TLB entry and start handing out context IDs afresh
+  void reset_tlb();
 
   // finish translation on a TLB miss and update the TLB
   tlb_entry_t refill_tlb(reg_t vaddr, reg_t paddr, char* host_addr, access_type type);
   const char* fill_from_mmio(reg_t vaddr, reg_t paddr);
 
   // perform a page table walk for a given VA; set referenced/dirty bits
-  reg_t walk(reg_t addr, access_type type, reg_t prv);
+  reg_t walk(reg_t addr, access_type type, reg_t prv, bool defer);
 
   // handle uncommon cases: TLB misses, page faults, MMIO
   tlb_entry_t fetch_slow_path(reg_t addr);
-  void load_slow_path(reg_t addr, reg_t len, uint8_t* bytes);
-  void store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes);
-  reg_t translate(reg_t addr, reg_t len, access_type type);
+  void load_slow_path(reg_t addr, reg_t len, uint8_t* bytes, bool defer);
+  void store_slow_path(reg_t addr, reg_t len, const uint8_t* bytes, bool defer);
+  char* amo_host_addr_slow(reg_t addr, reg_t len);
+  reg_t translate(reg_t addr, reg_t len, access_type type, bool defer = false);
+
+  // Throw t, or with defer set, make it the hart's deferred trap and set
+  // faulted, leaving the caller to abandon the access.
+  template<class T> void fault(T t, bool defer)
+  {
+    if (!defer)
+      throw t;
+    proc->state.deferred_trap = {t.cause(), t.get_tval(), t.has_tval(), t.name()};
+    faulted = true;
+  }
+  void access_fault(reg_t addr, access_type type, bool defer);
 
   // ITLB lookup
   inline tlb_entry_t translate_insn_addr(reg_t addr) {
     reg_t vpn = addr >> PGSHIFT;
-    if (likely(tlb_insn_tag[vpn % TLB_ENTRIES] == vpn))
-      return tlb_data[vpn % TLB_ENTRIES];
+    size_t idx = tlb_index(vpn);
+    if (likely(tlb_insn_tag[idx] == (vpn | tlb_ctx))) {
+      tlb_hits[FETCH]++;
+      return tlb_data[idx];
+    }
     tlb_entry_t result;
-    if (unlikely(tlb_insn_tag[vpn % TLB_ENTRIES] != (vpn | TLB_CHECK_TRIGGERS))) {
+    if (unlikely(tlb_insn_tag[idx] != (vpn | tlb_ctx | TLB_CHECK_TRIGGERS))) {
+      if (tlb_promote(vpn))
+        return translate_insn_addr(addr);
       result = fetch_slow_path(addr);
     } else {
-      result = tlb_data[vpn % TLB_ENTRIES];
+      tlb_hits[FETCH]++;
+      result = tlb_data[idx];
     }
-    if (unlikely(tlb_insn_tag[vpn % TLB_ENTRIES] == (vpn | TLB_CHECK_TRIGGERS))) {
-      uint16_t* ptr = (uint16_t*)(tlb_data[vpn % TLB_ENTRIES].host_offset + addr);
+    if (unlikely(tlb_insn_tag[idx] == (vpn | tlb_ctx | TLB_CHECK_TRIGGERS))) {
+      uint16_t* ptr = (uint16_t*)(tlb_data[idx].host_offset + addr);
       int match = proc->trigger_match(OPERATION_EXECUTE, addr, *ptr);
       if (match >= 0) {
         throw trigger_matched_t(match, OPERATION_EXECUTE, addr, *ptr);
@@ -356,6 +761,20 @@ private:
   reg_t pmp_homogeneous(reg_t addr, reg_t len);
   reg_t pmp_ok(reg_t addr, reg_t len, access_type type, reg_t mode);
 
+  // The PMP configuration, compiled into disjoint regions sorted by start
+  // address.  Each region extends to the start of the next, is matched by a
+  // single PMP entry (or none), and carries the access types it allows.
+  struct pmp_region_t {
+    reg_t start;
+    int entry; // lowest-numbered matching PMP entry, or -1
+    uint8_t perm[2]; // bit masks of access_type, below M-mode and in M-mode
+  };
+  std::vector<pmp_region_t> pmp_regions;
+  size_t pmp_last; // region found by the last lookup
+
+  // index of the region containing addr
+  size_t pmp_region(reg_t addr);
+
   bool check_triggers_fetch;
   bool check_triggers_load;
   bool check_triggers_store;
@@ -363,6 +782,7 @@ private:
   trigger_matched_t *matched_trigger;
 
   friend class processor_t;
+  friend class jit_t;
 };
 
 struct vm_info {
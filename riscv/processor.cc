@@ -6,6 +6,10 @@
 #include "config.h"
 #include "simif.h"
 #include "mmu.h"
+#include "jit.h"
+#include "commit_log.h"
+#include "profiler.h"
+#include "callgraph.h"
 #include "disasm.h"
 #include <cinttypes>
 #include <cmath>
@@ -22,10 +26,22 @@
 
 processor_t::processor_t(const char* isa, const char* varch, simif_t* sim,
                          uint32_t id, bool halt_on_reset)
-  : debug(false), halt_request(false), sim(sim), ext(NULL), id(id),
-  halt_on_reset(halt_on_reset), last_pc(1), executions(1)
+  : debug(false), tracing(false), halt_request(false), yielded(false), sim(sim), jit(NULL), commit_log(NULL),
+  flight_dump_cause(-1), profiler(NULL), profile_next(0),
+  callgraph(NULL), ext(NULL), id(id), histogram_enabled(false),
+#ifdef RISCV_ENABLE_COMMITLOG
+  log_commits_enabled(true),
+#else
+  log_commits_enabled(false),
+#endif
+  halt_on_reset(halt_on_reset), trace_window_enabled(false),
+  trace_pc_start(0), trace_pc_len(0), insn_mix_requested(false),
+  insn_mix_enabled(false), hpm_active(0), hpm_insn_mix(0), executing(false), interrupt_pending(false), spin_head(0), spin_count(0), histogram_npc(-1),
+  last_pc(1), executions(1)
 {
   VU.p = this;
+  memset(trap_counts, 0, sizeof(trap_counts));
+  memset(&host_stats, 0, sizeof(host_stats));
   parse_isa_string(isa);
   parse_varch_string(varch);
   register_base_instructions();
@@ -41,15 +57,9 @@ processor_t::processor_t(const char* isa, const char* varch, simif_t* sim,
 
 processor_t::~processor_t()
 {
-#ifdef RISCV_ENABLE_HISTOGRAM
-  if (histogram_enabled)
-  {
-    fprintf(stderr, "PC Histogram size:%zu\n", pc_histogram.size());
-    for (auto it : pc_histogram)
-      fprintf(stderr, "%0" PRIx64 " %" PRIu64 "\n", it.first, it.second);
-  }
-#endif
-
+  delete commit_log;
+  delete callgraph;
+  delete jit;
   delete mmu;
   delete disassembler;
 }
@@ -225,30 +235,114 @@ void processor_t::set_debug(bool value)
     ext->set_debug(value);
 }
 
+void processor_t::set_trace_window(const trace_window_t& window)
+{
+  trace_window = window;
+  trace_window_enabled = true;
+  if (window.pc_start != 0 || window.pc_end != reg_t(-1)) {
+    trace_pc_start = window.pc_start;
+    trace_pc_len = window.pc_end - window.pc_start;
+  }
+}
+
 void processor_t::set_histogram(bool value)
 {
   histogram_enabled = value;
-#ifndef RISCV_ENABLE_HISTOGRAM
-  if (value) {
-    fprintf(stderr, "PC Histogram support has not been properly enabled;");
-    fprintf(stderr, " please re-build the riscv-isa-sim project using \"configure --enable-histogram\".\n");
+}
+
+void processor_t::set_profiler(profiler_t* profiler)
+{
+  this->profiler = profiler;
+  profile_next = state.minstret + profiler->get_interval();
+}
+
+void processor_t::set_insn_mix(bool value)
+{
+  insn_mix_requested = value;
+  insn_mix_enabled = insn_mix_requested || hpm_insn_mix;
+}
+
+void processor_t::set_callgraph(bool value)
+{
+  if (value && !callgraph) {
+    callgraph = new callgraph_t;
+  } else if (!value && callgraph) {
+    delete callgraph;
+    callgraph = NULL;
   }
+}
+
+// Commit logging switches the decoder to the logged handlers, so the
+// instructions already decoded into the icache have to go. A binary commit
+// log's memtracer only wants to see accesses while logging is enabled, so
+// the TLB is flushed as well.
+void processor_t::set_log_commits(bool value)
+{
+  if (value != log_commits_enabled) {
+    log_commits_enabled = value;
+    mmu->flush_icache();
+    mmu->flush_tlb();
+  }
+}
+
+void processor_t::set_commit_log(commit_log_writer_t* writer)
+{
+  assert(!commit_log);
+  commit_log = new commit_log_buffer_t(writer, this, id);
+  mmu->register_memtracer(commit_log);
+  set_log_commits(true);
+}
+
+// Commit logging runs on the slow path, which never enters translated
+// blocks, so the JIT simply sits idle while it is enabled.
+void processor_t::set_jit(bool value)
+{
+#if defined(__x86_64__)
+  if (value && !jit) {
+    jit = new jit_t(this);
+  } else if (!value && jit) {
+    delete jit;
+    jit = NULL;
+    mmu->flush_icache(FLUSH_JIT);
+  }
+#else
+  if (value)
+    fprintf(stderr, "The JIT requires an x86-64 host; ignoring --jit.\n");
 #endif
 }
 
 void processor_t::reset()
 {
   state.reset(max_isa);
+  reset_hpm();
   state.dcsr.halt = halt_on_reset;
   halt_on_reset = false;
   set_csr(CSR_MSTATUS, state.mstatus);
+  mmu->update_pmp();
+  mmu->flush_tlb(FLUSH_RESET);
   VU.reset();
 
   if (ext)
     ext->reset(); // reset the extension
 
-  if (sim)
+  if (sim) {
     sim->proc_reset(id);
+    sim->proc_wake(this);
+  }
+}
+
+void processor_t::set_mip(reg_t mask, reg_t val)
+{
+  reg_t old = __atomic_load_n(&state.mip, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&state.mip, &old, (old & ~mask) | (val & mask),
+                                      true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    ;
+
+  if (val & mask & ~old & state.mie) {
+    __atomic_store_n(&interrupt_pending, true, __ATOMIC_RELEASE);
+    if (unlikely(state.wfi))
+      sim->proc_wake(this);
+  }
 }
 
 // Count number of contiguous 0 bits starting from the LSB.
@@ -261,7 +355,24 @@ static int ctz(reg_t val)
   return res;
 }
 
+bool processor_t::take_pending_interrupt()
+{
+  reg_t cause = interrupt_cause(state.mip & state.mie);
+  if (likely(!cause))
+    return false;
+
+  trap_t t(cause);
+  take_trap(t, state.pc);
+  return true;
+}
+
 void processor_t::take_interrupt(reg_t pending_interrupts)
+{
+  if (reg_t cause = interrupt_cause(pending_interrupts))
+    throw trap_t(cause);
+}
+
+reg_t processor_t::interrupt_cause(reg_t pending_interrupts)
 {
   reg_t mie = get_field(state.mstatus, MSTATUS_MIE);
   reg_t m_enabled = state.prv < PRV_M || (state.prv == PRV_M && mie);
@@ -275,9 +386,9 @@ void processor_t::take_interrupt(reg_t pending_interrupts)
 
   if (state.dcsr.cause == 0 && enabled_interrupts) {
     // nonstandard interrupts have highest priority
-    if (enabled_interrupts >> IRQ_M_EXT)
-      enabled_interrupts = enabled_interrupts >> IRQ_M_EXT << IRQ_M_EXT;
-    // standard interrupt priority is MEI, MSI, MTI, SEI, SSI, STI
+    if ((enabled_interrupts & ~MIP_LCOFIP) >> IRQ_M_EXT)
+      enabled_interrupts = (enabled_interrupts & ~MIP_LCOFIP) >> IRQ_M_EXT << IRQ_M_EXT;
+    // standard interrupt priority is MEI, MSI, MTI, SEI, SSI, STI, LCOFI
     else if (enabled_interrupts & MIP_MEIP)
       enabled_interrupts = MIP_MEIP;
     else if (enabled_interrupts & MIP_MSIP)
@@ -290,11 +401,14 @@ void processor_t::take_interrupt(reg_t pending_interrupts)
       enabled_interrupts = MIP_SSIP;
     else if (enabled_interrupts & MIP_STIP)
       enabled_interrupts = MIP_STIP;
+    else if (enabled_interrupts & MIP_LCOFIP)
+      enabled_interrupts = MIP_LCOFIP;
     else
       abort();
 
-    throw trap_t(((reg_t)1 << (max_xlen-1)) | ctz(enabled_interrupts));
+    return ((reg_t)1 << (max_xlen-1)) | ctz(enabled_interrupts);
   }
+  return 0;
 }
 
 static int xlen_to_uxl(int xlen)
@@ -321,8 +435,8 @@ reg_t processor_t::legalize_privilege(reg_t prv)
 
 void processor_t::set_privilege(reg_t prv)
 {
-  mmu->flush_tlb();
   state.prv = legalize_privilege(prv);
+  mmu->update_context();
 }
 
 void processor_t::enter_debug_mode(uint8_t cause)
@@ -336,6 +450,10 @@ void processor_t::enter_debug_mode(uint8_t cause)
 
 void processor_t::take_trap(trap_t& t, reg_t epc)
 {
+  flight.record_trap(epc, t.cause(), t.get_tval());
+  if (unlikely(t.cause() == flight_dump_cause))
+    flight.dump(this, stderr);
+
   if (debug) {
     fprintf(stderr, "core %3d: exception %s, epc 0x%016" PRIx64 "\n",
             id, t.name(), epc);
@@ -367,6 +485,7 @@ void processor_t::take_trap(trap_t& t, reg_t epc)
   bool interrupt = (bit & ((reg_t)1 << (max_xlen-1))) != 0;
   if (interrupt)
     deleg = state.mideleg, bit &= ~((reg_t)1 << (max_xlen-1));
+  trap_counts[state.prv][interrupt][bit % 64]++;
   if (state.prv <= PRV_S && bit < max_xlen && ((deleg >> bit) & 1)) {
     // handle the trap in S-mode
     state.pc = state.stvec;
@@ -394,6 +513,19 @@ void processor_t::take_trap(trap_t& t, reg_t epc)
     set_csr(CSR_MSTATUS, s);
     set_privilege(PRV_M);
   }
+
+  if (unlikely(callgraph != NULL))
+    callgraph->trap(state.pc, epc);
+}
+
+uint64_t processor_t::get_traps_taken()
+{
+  uint64_t n = 0;
+  for (auto& by_mode : trap_counts)
+    for (auto& by_kind : by_mode)
+      for (uint64_t count : by_kind)
+        n += count;
+  return n;
 }
 
 void processor_t::disasm(insn_t insn)
@@ -420,10 +552,131 @@ int processor_t::paddr_bits()
   return max_xlen == 64 ? 50 : 34;
 }
 
+// Whether the instruction mix counts event, which it only does while it is
+// enabled.
+static bool hpm_event_in_insn_mix(reg_t event)
+{
+  return (event >= HPM_EVENT_CLASS && event < HPM_EVENT_CLASS + insn_mix_t::NCLASSES) ||
+         event == HPM_EVENT_INSTRET || event == HPM_EVENT_TAKEN;
+}
+
+static bool hpm_event_valid(reg_t event)
+{
+  return hpm_event_in_insn_mix(event) ||
+         (event >= HPM_EVENT_TLB_MISS && event <= HPM_EVENT_ICACHE_REFILL) ||
+         (event >= HPM_EVENT_CACHE_MISS && event <= HPM_EVENT_CACHE_MISS + FETCH) ||
+         (event >= HPM_EVENT_EXCEPTION && event < HPM_EVENT_INTERRUPT + 64);
+}
+
+uint64_t processor_t::hpm_event_count(reg_t event, reg_t prv)
+{
+  if (event >= HPM_EVENT_CLASS && event < HPM_EVENT_CLASS + insn_mix_t::NCLASSES)
+    return insn_mix.get(prv, event - HPM_EVENT_CLASS);
+  if (event >= HPM_EVENT_TLB_MISS && event <= HPM_EVENT_TLB_MISS + FETCH)
+    return mmu->get_tlb_misses(prv, access_type(event - HPM_EVENT_TLB_MISS));
+  if (event >= HPM_EVENT_CACHE_MISS && event <= HPM_EVENT_CACHE_MISS + FETCH)
+    return mmu->get_cache_misses(prv, access_type(event - HPM_EVENT_CACHE_MISS));
+  if (event >= HPM_EVENT_EXCEPTION && event < HPM_EVENT_INTERRUPT + 64)
+    return trap_counts[prv][event >= HPM_EVENT_INTERRUPT][event % 64];
+
+  switch (event) {
+    case HPM_EVENT_INSTRET: return insn_mix.get_total(prv);
+    case HPM_EVENT_TAKEN: return insn_mix.get_taken(prv);
+    case HPM_EVENT_ICACHE_REFILL: return mmu->get_icache_refills(prv);
+  }
+  return 0;
+}
+
+bool processor_t::hpm_counts_in(size_t i, reg_t prv)
+{
+  static const reg_t inhibit[PRV_M + 1] = {MHPMEVENT_UINH, MHPMEVENT_SINH, 0, MHPMEVENT_MINH};
+  return !((state.mcountinhibit >> (i + 3)) & 1) && !(state.mhpmevent[i] & inhibit[prv]);
+}
+
+reg_t processor_t::hpm_delta(size_t i)
+{
+  reg_t event = state.mhpmevent[i] & HPM_EVENT_MASK;
+  reg_t delta = 0;
+  if (event != HPM_EVENT_NONE) {
+    for (reg_t prv = PRV_U; prv <= PRV_M; prv++)
+      if (prv != PRV_H && hpm_counts_in(i, prv))
+        delta += hpm_event_count(event, prv) - state.hpm_base[i][prv];
+  }
+  return delta;
+}
+
+// The instruction mix counts each instruction before it executes, so while
+// a csr instruction reads a counter, the counts of instructions retired and
+// of system instructions already include it.  It hasn't retired yet, so
+// it mustn't see itself.
+reg_t processor_t::read_hpm(size_t i)
+{
+  reg_t event = state.mhpmevent[i] & HPM_EVENT_MASK;
+  reg_t count = get_hpm(i);
+  if (executing && hpm_counts_in(i, state.prv) &&
+      (event == HPM_EVENT_INSTRET || event == HPM_EVENT_CLASS + insn_mix_t::SYSTEM))
+    count--;
+  return count;
+}
+
+void processor_t::set_hpm(size_t i, reg_t val)
+{
+  reg_t event = state.mhpmevent[i] & HPM_EVENT_MASK;
+  state.hpm_count[i] = val;
+  for (reg_t prv = PRV_U; prv <= PRV_M; prv++)
+    state.hpm_base[i][prv] = hpm_event_count(event, prv);
+}
+
+// An event that isn't implemented reads back as no event at all.
+void processor_t::set_hpm_event(size_t i, reg_t val)
+{
+  reg_t count = get_hpm(i);
+  reg_t event = val & HPM_EVENT_MASK;
+  if (!hpm_event_valid(event))
+    event = HPM_EVENT_NONE;
+
+  reg_t mask = MHPMEVENT_OF | MHPMEVENT_MINH;
+  if (supports_extension('S'))
+    mask |= MHPMEVENT_SINH;
+  if (supports_extension('U'))
+    mask |= MHPMEVENT_UINH;
+  state.mhpmevent[i] = (val & mask) | event;
+
+  hpm_active = (hpm_active & ~(1U << i)) | (uint32_t(event != HPM_EVENT_NONE) << i);
+  hpm_insn_mix = (hpm_insn_mix & ~(1U << i)) | (uint32_t(hpm_event_in_insn_mix(event)) << i);
+  insn_mix_enabled = insn_mix_requested || hpm_insn_mix;
+  set_hpm(i, count);
+}
+
+void processor_t::reset_hpm()
+{
+  hpm_active = 0;
+  hpm_insn_mix = 0;
+  insn_mix_enabled = insn_mix_requested;
+}
+
+// A counter that wraps while its OF bit is clear sets the bit and raises a
+// local counter overflow interrupt, as Sscofpmf has it.  Overflow is only
+// looked for at the end of each batch, so the interrupt may come up to a
+// batch of instructions after the counter wrapped.
+void processor_t::check_hpm_overflow()
+{
+  for (size_t i = 0; i < state.n_hpm; i++) {
+    if (!((hpm_active >> i) & 1) || (state.mhpmevent[i] & MHPMEVENT_OF))
+      continue;
+    reg_t delta = hpm_delta(i);
+    if (delta > ~state.hpm_count[i]) {
+      set_hpm(i, state.hpm_count[i] + delta);
+      state.mhpmevent[i] |= MHPMEVENT_OF;
+      set_mip(MIP_LCOFIP, MIP_LCOFIP);
+    }
+  }
+}
+
 void processor_t::set_csr(int which, reg_t val)
 {
   val = zext_xlen(val);
-  reg_t delegable_ints = MIP_SSIP | MIP_STIP | MIP_SEIP
+  reg_t delegable_ints = MIP_SSIP | MIP_STIP | MIP_SEIP | MIP_LCOFIP
                        | ((ext != NULL) << IRQ_COP);
   reg_t all_ints = delegable_ints | MIP_MSIP | MIP_MTIP;
 
@@ -435,7 +688,8 @@ void processor_t::set_csr(int which, reg_t val)
     if (!locked && !(next_locked && next_tor))
       state.pmpaddr[i] = val;
 
-    mmu->flush_tlb();
+    mmu->update_pmp();
+    mmu->flush_tlb(FLUSH_PMP);
   }
 
   if (which >= CSR_PMPCFG0 && which < CSR_PMPCFG0 + state.n_pmp / 4) {
@@ -446,7 +700,31 @@ void processor_t::set_csr(int which, reg_t val)
         state.pmpcfg[i] = cfg;
       }
     }
-    mmu->flush_tlb();
+    mmu->update_pmp();
+    mmu->flush_tlb(FLUSH_PMP);
+  }
+
+  if (which >= CSR_MHPMCOUNTER3 && which <= CSR_MHPMCOUNTER31) {
+    size_t i = which - CSR_MHPMCOUNTER3;
+    if (xlen == 32)
+      set_hpm(i, (read_hpm(i) >> 32 << 32) | (val & 0xffffffffU));
+    else
+      set_hpm(i, val);
+  }
+  if (xlen == 32 && which >= CSR_MHPMCOUNTER3H && which <= CSR_MHPMCOUNTER31H) {
+    size_t i = which - CSR_MHPMCOUNTER3H;
+    set_hpm(i, (val << 32) | (read_hpm(i) << 32 >> 32));
+  }
+  if (which >= CSR_MHPMEVENT3 && which <= CSR_MHPMEVENT31) {
+    size_t i = which - CSR_MHPMEVENT3;
+    if (xlen == 32)
+      set_hpm_event(i, (state.mhpmevent[i] >> 32 << 32) | (val & 0xffffffffU));
+    else
+      set_hpm_event(i, val);
+  }
+  if (xlen == 32 && which >= CSR_MHPMEVENT3H && which <= CSR_MHPMEVENT31H) {
+    size_t i = which - CSR_MHPMEVENT3H;
+    set_hpm_event(i, (val << 32) | (state.mhpmevent[i] << 32 >> 32));
   }
 
   switch (which)
@@ -465,9 +743,8 @@ void processor_t::set_csr(int which, reg_t val)
       state.frm = (val & FSR_RD) >> FSR_RD_SHIFT;
       break;
     case CSR_MSTATUS: {
-      if ((val ^ state.mstatus) &
-          (MSTATUS_MPP | MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR))
-        mmu->flush_tlb();
+      bool vm_changed = (val ^ state.mstatus) &
+          (MSTATUS_MPP | MSTATUS_MPRV | MSTATUS_SUM | MSTATUS_MXR);
 
       reg_t mask = MSTATUS_SIE | MSTATUS_SPIE | MSTATUS_MIE | MSTATUS_MPIE
                  | MSTATUS_FS | MSTATUS_MPRV | MSTATUS_SUM
@@ -494,11 +771,13 @@ void processor_t::set_csr(int which, reg_t val)
       state.mstatus = set_field(state.mstatus, MSTATUS_SXL, xlen_to_uxl(max_xlen));
       // U-XLEN == S-XLEN == M-XLEN
       xlen = max_xlen;
+
+      if (vm_changed)
+        mmu->update_context();
       break;
     }
     case CSR_MIP: {
-      reg_t mask = MIP_SSIP | MIP_STIP;
-      state.mip = (state.mip & ~mask) | (val & mask);
+      set_mip(MIP_SSIP | MIP_STIP | MIP_LCOFIP, val);
       break;
     }
     case CSR_MIE:
@@ -541,26 +820,35 @@ void processor_t::set_csr(int which, reg_t val)
     case CSR_MCOUNTEREN:
       state.mcounteren = val;
       break;
+    case CSR_MCOUNTINHIBIT:
+      // Settle the counters under the old inhibit bits first.  mcycle and
+      // minstret can't be stopped.
+      for (size_t i = 0; i < state.n_hpm; i++)
+        set_hpm(i, get_hpm(i));
+      state.mcountinhibit = val & ~reg_t(7);
+      break;
     case CSR_SSTATUS: {
       reg_t mask = SSTATUS_SIE | SSTATUS_SPIE | SSTATUS_SPP | SSTATUS_FS
                  | SSTATUS_XS | SSTATUS_SUM | SSTATUS_MXR;
       return set_csr(CSR_MSTATUS, (state.mstatus & ~mask) | (val & mask));
     }
     case CSR_SIP: {
-      reg_t mask = MIP_SSIP & state.mideleg;
+      reg_t mask = (MIP_SSIP | MIP_LCOFIP) & state.mideleg;
       return set_csr(CSR_MIP, (state.mip & ~mask) | (val & mask));
     }
     case CSR_SIE:
       return set_csr(CSR_MIE,
                      (state.mie & ~state.mideleg) | (val & state.mideleg));
     case CSR_SATP: {
-      mmu->flush_tlb();
       if (max_xlen == 32)
         state.satp = val & (SATP32_PPN | SATP32_MODE);
       if (max_xlen == 64 && (get_field(val, SATP64_MODE) == SATP_MODE_OFF ||
                              get_field(val, SATP64_MODE) == SATP_MODE_SV39 ||
                              get_field(val, SATP64_MODE) == SATP_MODE_SV48))
         state.satp = val & (SATP64_PPN | SATP64_MODE);
+      // Translations cached for the old satp stay tagged with its context
+      // until software issues an SFENCE.VMA.
+      mmu->update_context();
       break;
     }
     case CSR_SEPC: state.sepc = val & ~(reg_t)1; break;
@@ -590,7 +878,11 @@ void processor_t::set_csr(int which, reg_t val)
       mask |= 1L << ('C' - 'A');
       mask &= max_isa;
 
+      reg_t old_misa = state.misa;
       state.misa = (val & mask) | (state.misa & ~mask);
+      // translated blocks assume the extensions enabled when they were made
+      if (state.misa != old_misa)
+        mmu->flush_icache(FLUSH_MISA);
       break;
     }
     case CSR_TSELECT:
@@ -685,16 +977,18 @@ reg_t processor_t::get_csr(int which)
 
   if (ctr_ok) {
     if (which >= CSR_HPMCOUNTER3 && which <= CSR_HPMCOUNTER31)
-      return 0;
+      return read_hpm(which - CSR_HPMCOUNTER3);
     if (xlen == 32 && which >= CSR_HPMCOUNTER3H && which <= CSR_HPMCOUNTER31H)
-      return 0;
+      return read_hpm(which - CSR_HPMCOUNTER3H) >> 32;
   }
   if (which >= CSR_MHPMCOUNTER3 && which <= CSR_MHPMCOUNTER31)
-    return 0;
+    return read_hpm(which - CSR_MHPMCOUNTER3);
   if (xlen == 32 && which >= CSR_MHPMCOUNTER3H && which <= CSR_MHPMCOUNTER31H)
-    return 0;
+    return read_hpm(which - CSR_MHPMCOUNTER3H) >> 32;
   if (which >= CSR_MHPMEVENT3 && which <= CSR_MHPMEVENT31)
-    return 0;
+    return state.mhpmevent[which - CSR_MHPMEVENT3];
+  if (xlen == 32 && which >= CSR_MHPMEVENT3H && which <= CSR_MHPMEVENT31H)
+    return state.mhpmevent[which - CSR_MHPMEVENT3H] >> 32;
 
   if (which >= CSR_PMPADDR0 && which < CSR_PMPADDR0 + state.n_pmp)
     return state.pmpaddr[which - CSR_PMPADDR0];
@@ -745,6 +1039,17 @@ reg_t processor_t::get_csr(int which)
       break;
     case CSR_SCOUNTEREN: return state.scounteren;
     case CSR_MCOUNTEREN: return state.mcounteren;
+    case CSR_MCOUNTINHIBIT: return state.mcountinhibit;
+    case CSR_SCOUNTOVF: {
+      if (!supports_extension('S'))
+        break;
+      reg_t ovf = 0;
+      for (size_t i = 0; i < state.n_hpm; i++)
+        ovf |= (state.mhpmevent[i] >> 63) << (i + 3);
+      if (state.prv < PRV_M)
+        ovf &= state.mcounteren;
+      return ovf;
+    }
     case CSR_SSTATUS: {
       reg_t mask = SSTATUS_SIE | SSTATUS_SPIE | SSTATUS_SPP | SSTATUS_FS
                  | SSTATUS_XS | SSTATUS_SUM | SSTATUS_MXR | SSTATUS_UXL;
@@ -856,30 +1161,19 @@ reg_t illegal_instruction(processor_t* p, insn_t insn, reg_t pc)
 
 insn_func_t processor_t::decode_insn(insn_t insn)
 {
-  // look up opcode in hash table
-  size_t idx = insn.bits() % OPCODE_CACHE_SIZE;
-  insn_desc_t desc = opcode_cache[idx];
-
-  if (unlikely(insn.bits() != desc.match)) {
-    // fall back to linear search
-    insn_desc_t* p = &instructions[0];
-    while ((insn.bits() & p->mask) != p->match)
-      p++;
-    desc = *p;
-
-    if (p->mask != 0 && p > &instructions[0]) {
-      if (p->match != (p-1)->match && p->match != (p+1)->match) {
-        // move to front of opcode list to reduce miss penalty
-        while (--p >= &instructions[0])
-          *(p+1) = *p;
-        instructions[0] = desc;
-      }
-    }
-
-    opcode_cache[idx] = desc;
-    opcode_cache[idx].match = insn.bits();
+  const decode_node_t* node = &decode_tree[0];
+  host_stats.decodes++;
+  while (node->mask) {
+    node = &decode_tree[node->next + ((insn.bits() >> node->shift) & node->mask)];
+    host_stats.decode_steps++;
   }
+  const insn_desc_t& desc = instructions[node->next];
 
+  if (unlikely(log_commits_enabled)) {
+    insn_func_t logged = xlen == 64 ? desc.logged_rv64 : desc.logged_rv32;
+    if (logged)
+      return logged;
+  }
   return xlen == 64 ? desc.rv64 : desc.rv32;
 }
 
@@ -888,6 +1182,48 @@ void processor_t::register_insn(insn_desc_t desc)
   instructions.push_back(desc);
 }
 
+// Build the subtree for the instructions in candidates, which are listed in
+// decreasing priority and agree with every bit in known on the path to it,
+// and return its root.  The first candidate is the answer once all of its
+// mask bits are known; until then, branch on the lowest run of its unknown
+// bits.
+processor_t::decode_node_t processor_t::build_decode_tree(
+  const std::vector<size_t>& candidates, insn_bits_t known,
+  std::map<std::pair<std::vector<size_t>, insn_bits_t>, decode_node_t>& built)
+{
+  auto key = std::make_pair(candidates, known);
+  auto it = built.find(key);
+  if (it != built.end())
+    return it->second;
+
+  const insn_desc_t& first = instructions[candidates[0]];
+  insn_bits_t todo = first.mask & ~known;
+  if (!todo)
+    return built[key] = {0, 0, uint32_t(candidates[0])};
+
+  const unsigned max_width = 8;
+  unsigned shift = ctz(todo), width = 0;
+  while (width < max_width && shift + width < 8 * sizeof(insn_bits_t) &&
+         ((todo >> (shift + width)) & 1))
+    width++;
+  insn_bits_t mask = (insn_bits_t(1) << width) - 1;
+
+  size_t children = decode_tree.size();
+  decode_tree.resize(children + mask + 1);
+  for (insn_bits_t field = 0; field <= mask; field++) {
+    std::vector<size_t> matching;
+    for (size_t i : candidates) {
+      insn_bits_t m = (instructions[i].mask >> shift) & mask;
+      if ((field & m) == ((instructions[i].match >> shift) & m))
+        matching.push_back(i);
+    }
+    decode_node_t child = build_decode_tree(matching, known | (mask << shift), built);
+    decode_tree[children + field] = child;
+  }
+
+  return built[key] = {uint8_t(shift), uint8_t(mask), uint32_t(children)};
+}
+
 void processor_t::build_opcode_map()
 {
   struct cmp {
@@ -899,8 +1235,14 @@ void processor_t::build_opcode_map()
   };
   std::sort(instructions.begin(), instructions.end(), cmp());
 
-  for (size_t i = 0; i < OPCODE_CACHE_SIZE; i++)
-    opcode_cache[i] = {0, 0, &illegal_instruction, &illegal_instruction};
+  // the catch-all illegal_instruction entry sorts last, so no leaf is empty
+  std::vector<size_t> candidates;
+  for (size_t i = 0; i < instructions.size(); i++)
+    candidates.push_back(i);
+  std::map<std::pair<std::vector<size_t>, insn_bits_t>, decode_node_t> built;
+  decode_tree.assign(1, decode_node_t());
+  decode_node_t root = build_decode_tree(candidates, 0, built);
+  decode_tree[0] = root;
 }
 
 void processor_t::register_extension(extension_t* x)
@@ -954,7 +1296,7 @@ bool processor_t::store(reg_t addr, size_t len, const uint8_t* bytes)
   {
     case 0:
       if (len <= 4) {
-        state.mip = set_field(state.mip, MIP_MSIP, bytes[0]);
+        set_mip(MIP_MSIP, set_field(reg_t(0), MIP_MSIP, bytes[0]));
         return true;
       }
       break;
@@ -965,7 +1307,7 @@ bool processor_t::store(reg_t addr, size_t len, const uint8_t* bytes)
 
 void processor_t::trigger_updated()
 {
-  mmu->flush_tlb();
+  mmu->flush_tlb(FLUSH_TRIGGER);
   mmu->check_triggers_fetch = false;
   mmu->check_triggers_load = false;
   mmu->check_triggers_store = false;
@@ -6,6 +6,9 @@
 #include "config.h"
 #include "devices.h"
 #include "trap.h"
+#include "flight_recorder.h"
+#include "histogram.h"
+#include "insn_mix.h"
 #include <string>
 #include <vector>
 #include <map>
@@ -14,10 +17,15 @@
 
 class processor_t;
 class mmu_t;
+class jit_t;
 typedef reg_t (*insn_func_t)(processor_t*, insn_t, reg_t);
 class simif_t;
 class trap_t;
 class extension_t;
+class commit_log_buffer_t;
+class commit_log_writer_t;
+class profiler_t;
+class callgraph_t;
 class disassembler_t;
 
 struct insn_desc_t
@@ -26,6 +34,10 @@ struct insn_desc_t
   insn_bits_t mask;
   insn_func_t rv32;
   insn_func_t rv64;
+  // handlers that also record register writes for the commit log; an
+  // extension that leaves these NULL is run unlogged
+  insn_func_t logged_rv32;
+  insn_func_t logged_rv64;
 };
 
 struct commit_log_reg_t
@@ -226,6 +238,14 @@ struct state_t
   reg_t mideleg;
   uint32_t mcounteren;
   uint32_t scounteren;
+  uint32_t mcountinhibit;
+
+  // mhpmcounter3..31 read as hpm_count plus the events counted since
+  // hpm_base was taken, in each mode they count in; see get_hpm().
+  static const int n_hpm = 29;
+  reg_t mhpmevent[n_hpm];
+  reg_t hpm_count[n_hpm];
+  reg_t hpm_base[n_hpm][PRV_M + 1];
   reg_t sepc;
   reg_t stval;
   reg_t sscratch;
@@ -246,6 +266,8 @@ struct state_t
   uint32_t fflags;
   uint32_t frm;
   bool serialized; // whether timer CSRs are in a well-defined state
+  trap_info_t deferred_trap; // taken when an insn returns PC_SERIALIZE_TRAP
+  bool wfi; // stalled in WFI
 
   // When true, execute a single instruction and then enter debug mode.  This
   // can only be set by executing dret.
@@ -255,12 +277,10 @@ struct state_t
       STEP_STEPPED
   } single_step;
 
-#ifdef RISCV_ENABLE_COMMITLOG
   commit_log_reg_t log_reg_write;
   reg_t last_inst_priv;
   int last_inst_xlen;
   int last_inst_flen;
-#endif
 };
 
 typedef enum {
@@ -278,6 +298,50 @@ static int cto(reg_t val)
   return res;
 }
 
+// The part of a run that -l disassembles: the instructions a hart executes
+// at a pc in [pc_start, pc_end), in a privilege mode in priv_mask, while its
+// minstret is in [instret_start, instret_end).
+struct trace_window_t
+{
+  trace_window_t()
+    : pc_start(0), pc_end(-1), instret_start(0), instret_end(-1),
+      priv_mask((1 << PRV_U) | (1 << PRV_S) | (1 << PRV_M)) {}
+  reg_t pc_start;
+  reg_t pc_end;
+  reg_t instret_start;
+  reg_t instret_end;
+  unsigned priv_mask;
+};
+
+// The events that bits 15:0 of mhpmevent3..31 select.  Where an event
+// takes an offset, the offset is an insn_mix_t class, an access_type or a
+// trap cause.
+enum hpm_event_t {
+  HPM_EVENT_NONE = 0x00,
+  HPM_EVENT_CLASS = 0x01,          // + class: instructions retired
+  HPM_EVENT_INSTRET = 0x10,        // instructions retired
+  HPM_EVENT_TAKEN = 0x11,          // branches and jumps taken
+  HPM_EVENT_TLB_MISS = 0x20,       // + access_type: TLB refills
+  HPM_EVENT_ICACHE_REFILL = 0x23,  // decoded instruction cache refills
+  HPM_EVENT_CACHE_MISS = 0x30,     // + access_type: misses in --dc and --ic
+  HPM_EVENT_EXCEPTION = 0x100,     // + cause: exceptions taken
+  HPM_EVENT_INTERRUPT = 0x140,     // + cause: interrupts taken
+  HPM_EVENT_MASK = 0xffff
+};
+
+// What the simulator did on a hart's behalf, for tuning the simulator
+// rather than the target.  The hart's mmu keeps the TLB and icache counts.
+struct host_stats_t
+{
+  uint64_t decodes;           // instructions decoded into the icache
+  uint64_t decode_steps;      // decode tree nodes visited to decode them
+  uint64_t slow_path_batches; // batches that step() ran on the slow path
+  uint64_t slow_path_insns;   // instructions fetched in them
+  uint64_t traps_thrown;      // traps that unwound step() as exceptions
+  uint64_t host_ns;           // host time the hart spent in step()
+  uint64_t host_insns;        // instructions step() retired
+};
+
 // this class represents one processor in a RISC-V machine.
 class processor_t : public abstract_device_t
 {
@@ -287,13 +351,50 @@ public:
   ~processor_t();
 
   void set_debug(bool value);
+  // Disassemble only the instructions in window, as if set_debug(true) were
+  // in effect inside it. Everything outside stays on the fast path.
+  void set_trace_window(const trace_window_t& window);
   void set_histogram(bool value);
+  void set_log_commits(bool value);
+  bool get_histogram() { return histogram_enabled; }
+  // How many times each block was entered, by physical address, while the
+  // histogram was enabled.
+  const pc_histogram_t& get_pc_histogram() { return pc_histogram; }
+  bool get_log_commits() { return log_commits_enabled; }
+  // Send the commit log to writer in binary rather than to stderr as text.
+  void set_commit_log(commit_log_writer_t* writer);
+  commit_log_buffer_t* get_commit_log() { return commit_log; }
+  // Keep the last size runs of instructions and traps in the flight
+  // recorder, and dump it whenever a trap with the given cause is taken.
+  void set_flight_recorder(size_t size) { flight.resize(size); }
+  void set_flight_dump_cause(reg_t cause) { flight_dump_cause = cause; }
+  void dump_flight_recorder(FILE* out) { flight.dump(this, out); }
+  // Hand the hart to profiler every profiler->get_interval() instructions.
+  void set_profiler(profiler_t* profiler);
+  // Count the instructions retired in each privilege mode by class.  The
+  // count also runs while an hpm counter needs it.
+  void set_insn_mix(bool value);
+  const insn_mix_t& get_insn_mix() { return insn_mix; }
+  // Keep a shadow call stack and count instructions along the call graph.
+  void set_callgraph(bool value);
+  callgraph_t* get_callgraph() { return callgraph; }
+  const host_stats_t& get_host_stats() { return host_stats; }
+  // Charge ns of host time spent in step() to the hart.
+  void add_host_time(uint64_t ns) { host_stats.host_ns += ns; }
+  // The number of traps the hart has taken.
+  uint64_t get_traps_taken();
+  void set_jit(bool value);
   void reset();
   void step(size_t n); // run for n cycles
   void set_csr(int which, reg_t val);
   reg_t get_csr(int which);
+  // Set the mip bits in mask to the corresponding bits of val. The CLINT
+  // writes mip on behalf of harts that may be running on other host
+  // threads, so every update is an atomic read-modify-write.
+  void set_mip(reg_t mask, reg_t val);
   mmu_t* get_mmu() { return mmu; }
   state_t* get_state() { return &state; }
+  uint32_t get_id() { return id; }
   unsigned get_xlen() { return xlen; }
   unsigned get_max_xlen() { return max_xlen; }
   std::string get_isa_string() { return isa_string; }
@@ -316,7 +417,6 @@ public:
   }
   reg_t legalize_privilege(reg_t);
   void set_privilege(reg_t);
-  void update_histogram(reg_t pc);
   const disassembler_t* get_disassembler() { return disassembler; }
 
   void register_insn(insn_desc_t);
@@ -328,10 +428,20 @@ public:
 
   // When true, display disassembly of each instruction that's executed.
   bool debug;
+  // When true, the hart is inside its trace window, which has the same
+  // effect as debug.
+  bool tracing;
   // When true, take the slow simulation path.
   bool slow_path();
   bool halted() { return state.dcsr.cause ? true : false; }
   bool halt_request;
+  // Whether the last step() returned early because the hart was spinning.
+  bool yielded;
+  // A hart stalled in WFI stays stalled until an interrupt is pending and
+  // enabled in mie, or a debugger wants its attention.
+  bool waiting_for_interrupt() {
+    return state.wfi && !(state.mip & state.mie) && !halted() && !halt_request;
+  }
 
   // Return the index of a trigger that matched, or -1.
   inline int trigger_match(trigger_operation_t operation, reg_t address, reg_t data)
@@ -418,6 +528,13 @@ public:
 private:
   simif_t* sim;
   mmu_t* mmu; // main memory is always accessed via the mmu
+  jit_t* jit; // translates hot blocks to host code, if enabled
+  commit_log_buffer_t* commit_log; // binary commit log, if enabled
+  flight_recorder_t flight;
+  reg_t flight_dump_cause;
+  profiler_t* profiler; // sampling profiler, if enabled
+  reg_t profile_next; // minstret at which to take the next sample
+  callgraph_t* callgraph; // shadow call stack, if enabled
   extension_t* ext;
   disassembler_t* disassembler;
   state_t state;
@@ -427,16 +544,130 @@ private:
   reg_t max_isa;
   std::string isa_string;
   bool histogram_enabled;
+  bool log_commits_enabled;
   bool halt_on_reset;
 
-  std::vector<insn_desc_t> instructions;
-  std::map<reg_t,uint64_t> pc_histogram;
+  // See set_trace_window(). step() decides whether the hart is tracing at
+  // the start of each batch, and ends a batch early at the edges of the
+  // window: at the minstret boundaries, when the fast path reaches
+  // [trace_pc_start, trace_pc_start + trace_pc_len), whether at the start of
+  // a block or part way through one, which it cuts short there, and when
+  // the slow path leaves the window.
+  bool trace_window_enabled;
+  trace_window_t trace_window;
+  reg_t trace_pc_start;
+  reg_t trace_pc_len; // 0 unless the window has a pc range
+  bool in_trace_window() {
+    return state.pc - trace_window.pc_start < trace_window.pc_end - trace_window.pc_start &&
+           ((trace_window.priv_mask >> state.prv) & 1) &&
+           state.minstret - trace_window.instret_start <
+             trace_window.instret_end - trace_window.instret_start;
+  }
+  bool entering_trace_pc(reg_t pc) {
+    return unlikely(pc - trace_pc_start < trace_pc_len);
+  }
+  size_t insns_before_trace_pc(reg_t pc, const insn_fetch_t* fetch, size_t len);
+
+  // step() hands each run of instructions from one icache block to the
+  // flight recorder and the instruction mix before executing it, and cuts
+  // the run short if fewer than len instructions retire.  It checks the
+  // last instruction of each run for a taken branch.
+  bool insn_mix_requested;
+  bool insn_mix_enabled; // requested, or needed by an hpm counter
+  insn_mix_t insn_mix;
+  void start_run(reg_t pc, reg_t paddr, const insn_fetch_t* fetch, size_t len) {
+    flight.record(pc, paddr, len);
+    if (unlikely(insn_mix_enabled))
+      insn_mix.start(fetch, len, state.prv, xlen);
+  }
+  void truncate_run(size_t n) {
+    flight.truncate(n);
+    if (unlikely(insn_mix_enabled))
+      insn_mix.truncate(n);
+  }
+  void count_taken(insn_bits_t bits, reg_t npc) {
+    if (npc != state.pc + insn_length(bits) && !invalid_pc(npc))
+      insn_mix.taken(state.prv);
+  }
 
-  static const size_t OPCODE_CACHE_SIZE = 8191;
-  insn_desc_t opcode_cache[OPCODE_CACHE_SIZE];
+  // The hardware performance counters.  A counter's value is only worked
+  // out when it is read, from the event counts kept by the instruction
+  // mix, the mmu and take_trap(), and step() checks the counters with an
+  // event selected for overflow at the end of every batch.
+  uint64_t trap_counts[PRV_M + 1][2][64]; // by mode, interrupt and cause
+  host_stats_t host_stats;
+  uint32_t hpm_active; // counters with an event selected
+  uint32_t hpm_insn_mix; // counters whose event the instruction mix counts
+  bool executing; // in step(), so the csr instruction in flight is counted
+  uint64_t hpm_event_count(reg_t event, reg_t prv);
+  bool hpm_counts_in(size_t i, reg_t prv);
+  reg_t hpm_delta(size_t i);
+  reg_t get_hpm(size_t i) { return state.hpm_count[i] + hpm_delta(i); }
+  reg_t read_hpm(size_t i);
+  void set_hpm(size_t i, reg_t val);
+  void set_hpm_event(size_t i, reg_t val);
+  void reset_hpm();
+  void check_hpm_overflow();
+
+  // Set by set_mip(), possibly from another hart's thread, when it raises
+  // an interrupt that mie enables. step() checks it at the end of every
+  // block, so a running hart notices a new interrupt within
+  // ICACHE_BLOCK_INSNS instructions rather than at its next step().
+  bool interrupt_pending;
+  bool check_interrupts() {
+    return unlikely(__atomic_load_n(&interrupt_pending, __ATOMIC_ACQUIRE));
+  }
+
+  // Spin-loop detection. step() calls spinning() when a block ends with a
+  // jump back to or before its own start. A hart that keeps coming back to
+  // the same pc with the same integer and FP registers, without storing
+  // to memory, is waiting for another hart or a device to change memory,
+  // so there is no point in simulating more iterations of its loop for
+  // now.  A loop that stores, even an AMO that leaves the word as it was,
+  // is taken to be doing work.
+  static const unsigned SPIN_ITERATIONS = 16;
+  reg_t spin_head; // target of the last backward jump
+  unsigned spin_count; // consecutive backward jumps to spin_head
+  reg_t spin_regs[NXPR];
+  freg_t spin_fregs[NFPR];
+  uint64_t spin_stores; // the mmu's count of stores
+  bool spinning(reg_t pc) {
+    if (pc != spin_head) {
+      spin_head = pc;
+      spin_count = 0;
+      return false;
+    }
+    return ++spin_count >= SPIN_ITERATIONS && spin_state_unchanged();
+  }
+  bool spin_state_unchanged();
+
+  std::vector<insn_desc_t> instructions;
 
-  void take_pending_interrupt() { take_interrupt(state.mip & state.mie); }
-  void take_interrupt(reg_t mask); // take first enabled interrupt in mask
+  // The fast path counts the start of every icache block it runs. The slow
+  // path counts every instruction other than the fall-through of one that
+  // could not end a block, which it remembers in histogram_npc.
+  pc_histogram_t pc_histogram;
+  reg_t histogram_npc;
+
+  // A decision tree over the instruction bits, built from the masks of
+  // instructions.  An inner node selects one of its children, which are
+  // stored contiguously from next, by the field (bits >> shift) & mask; a
+  // leaf (mask 0) names the instruction at index next.
+  // Identical subtrees are shared.
+  struct decode_node_t {
+    uint8_t shift;
+    uint8_t mask;
+    uint32_t next;
+  };
+  std::vector<decode_node_t> decode_tree;
+  decode_node_t build_decode_tree(const std::vector<size_t>& candidates, insn_bits_t known,
+    std::map<std::pair<std::vector<size_t>, insn_bits_t>, decode_node_t>& built);
+
+  bool take_pending_interrupt(); // take first enabled interrupt, if any
+  void take_interrupt(reg_t mask); // throw first enabled interrupt in mask
+  reg_t interrupt_cause(reg_t mask); // cause of first enabled interrupt, or 0
+  void take_deferred_trap();
+  void end_step_on_trap();
   void take_trap(trap_t& t, reg_t epc); // take an exception
   void disasm(insn_t insn); // disassemble and print an instruction
   int paddr_bits();
@@ -446,6 +677,9 @@ private:
   friend class mmu_t;
   friend class clint_t;
   friend class extension_t;
+  friend class decode_test_t; // decode.t.cc
+  friend class insn_mix_test_t; // insn_mix.t.cc
+  friend class flight_recorder_t;
 
   void parse_varch_string(const char* isa);
   void parse_isa_string(const char* isa);
@@ -464,6 +698,9 @@ reg_t illegal_instruction(processor_t* p, insn_t insn, reg_t pc);
 #define REGISTER_INSN(proc, name, match, mask) \
   extern reg_t rv32_##name(processor_t*, insn_t, reg_t); \
   extern reg_t rv64_##name(processor_t*, insn_t, reg_t); \
-  proc->register_insn((insn_desc_t){match, mask, rv32_##name, rv64_##name});
+  extern reg_t logged_rv32_##name(processor_t*, insn_t, reg_t); \
+  extern reg_t logged_rv64_##name(processor_t*, insn_t, reg_t); \
+  proc->register_insn((insn_desc_t){match, mask, rv32_##name, rv64_##name, \
+                                    logged_rv32_##name, logged_rv64_##name});
 
 #endif
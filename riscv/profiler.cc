@@ -0,0 +1,109 @@
+// See LICENSE for license details.
+
+#include "profiler.h"
+#include "processor.h"
+#include "mmu.h"
+#include "callgraph.h"
+#include "symtab.h"
+#include <algorithm>
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <set>
+#include <tuple>
+
+// Append the return addresses of the frames linked from s0.
+static void walk_frames(processor_t* p, std::vector<reg_t>& stack, size_t max_depth)
+{
+  mmu_t* mmu = p->get_mmu();
+  size_t size = p->get_xlen() / 8;
+  reg_t fp = p->get_state()->XPR[8];
+  while (stack.size() < max_depth && fp != 0 && fp % size == 0) {
+    uint64_t ra = 0, prev_fp = 0;
+    if (!mmu->peek(fp - size, size, &ra) || !mmu->peek(fp - 2 * size, size, &prev_fp) ||
+        ra == 0)
+      break;
+    // ra - 1 lies in the call rather than in whatever follows it, which
+    // matters when the call is the last instruction of a function.
+    stack.push_back(ra - 1);
+    // Callers' frames are further up the stack; anything else means that
+    // s0 isn't a frame pointer.
+    if (prev_fp <= fp)
+      break;
+    fp = prev_fp;
+  }
+}
+
+void profiler_t::sample(processor_t* p)
+{
+  std::vector<reg_t> stack(1, p->get_state()->pc);
+  if (callgraph_t* callgraph = p->get_callgraph()) {
+    callgraph->backtrace(stack);
+    if (stack.size() > MAX_DEPTH)
+      stack.resize(MAX_DEPTH);
+  } else {
+    walk_frames(p, stack, MAX_DEPTH);
+  }
+
+  std::lock_guard<std::mutex> guard(lock);
+  stacks[stack]++;
+}
+
+static FILE* open_output(const std::string& path)
+{
+  FILE* out = fopen(path.c_str(), "w");
+  if (!out)
+    fprintf(stderr, "Unable to write profile %s: %s\n", path.c_str(), strerror(errno));
+  return out;
+}
+
+void profiler_t::write(const std::string& prefix, const symtab_t& symbols)
+{
+  std::lock_guard<std::mutex> guard(lock);
+
+  uint64_t total = 0;
+  std::map<std::string, uint64_t> self, inclusive, folded;
+  for (auto& s : stacks) {
+    std::vector<std::string> names;
+    for (reg_t pc : s.first)
+      names.push_back(symbols.lookup(pc));
+
+    total += s.second;
+    self[names[0]] += s.second;
+    // A recursive function is only counted once per sample.
+    for (auto& name : std::set<std::string>(names.begin(), names.end()))
+      inclusive[name] += s.second;
+
+    std::string line;
+    for (auto it = names.rbegin(); it != names.rend(); ++it)
+      line += (line.empty() ? "" : ";") + *it;
+    folded[line] += s.second;
+  }
+
+  if (FILE* out = open_output(prefix + ".flat")) {
+    std::vector<std::tuple<uint64_t, uint64_t, std::string>> rows;
+    for (auto& f : inclusive)
+      rows.emplace_back(self[f.first], f.second, f.first);
+    std::sort(rows.begin(), rows.end(), [](const std::tuple<uint64_t, uint64_t, std::string>& a,
+                                           const std::tuple<uint64_t, uint64_t, std::string>& b) {
+      return a > b;
+    });
+
+    double scale = total ? 100.0 / total : 0;
+    fprintf(out, "# %" PRIu64 " samples, one every %" PRIu64 " instructions per hart\n",
+            total, interval);
+    fprintf(out, "#     self        %%     total        %%  symbol\n");
+    for (auto& r : rows)
+      fprintf(out, "%10" PRIu64 " %7.2f%% %10" PRIu64 " %7.2f%%  %s\n",
+              std::get<0>(r), std::get<0>(r) * scale,
+              std::get<1>(r), std::get<1>(r) * scale, std::get<2>(r).c_str());
+    fclose(out);
+  }
+
+  if (FILE* out = open_output(prefix + ".folded")) {
+    for (auto& f : folded)
+      fprintf(out, "%s %" PRIu64 "\n", f.first.c_str(), f.second);
+    fclose(out);
+  }
+}
@@ -0,0 +1,45 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_PROFILER_H
+#define _RISCV_PROFILER_H
+
+#include "decode.h"
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class processor_t;
+class symtab_t;
+
+// A sampling profiler.  step() hands each hart to sample() once every
+// interval instructions it retires, which records the hart's pc along with
+// the return addresses found by following the frame pointer (s0) up the
+// stack, as code built with -fno-omit-frame-pointer leaves it, or those on
+// the hart's shadow call stack if it keeps one.  Between samples the hart
+// runs at full speed.
+class profiler_t
+{
+ public:
+  static const reg_t DEFAULT_INTERVAL = 10007;
+
+  profiler_t(reg_t interval) : interval(interval) {}
+  reg_t get_interval() const { return interval; }
+
+  // May be called from any hart's thread.
+  void sample(processor_t* p);
+
+  // Write the samples, resolved against symbols, to <prefix>.flat, a table
+  // of the samples that were in each function itself and in it or its
+  // callees, and to <prefix>.folded, one "outer;...;inner count" line per
+  // distinct call stack, which flamegraph.pl takes as it is.
+  void write(const std::string& prefix, const symtab_t& symbols);
+
+ private:
+  static const size_t MAX_DEPTH = 64;
+  reg_t interval;
+  std::mutex lock;
+  std::map<std::vector<reg_t>, uint64_t> stacks; // innermost pc first
+};
+
+#endif
@@ -4,17 +4,30 @@
 #include "mmu.h"
 #include "dts.h"
 #include "remote_bitbang.h"
+#include "commit_log.h"
+#include "profiler.h"
+#include "callgraph.h"
+#include "symtab.h"
 #include <map>
+#include <algorithm>
 #include <iostream>
 #include <sstream>
+#include <cerrno>
+#include <cinttypes>
 #include <climits>
+#include <cstdio>
+#include <cstring>
 #include <cstdlib>
 #include <cassert>
+#include <chrono>
 #include <signal.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 
+const size_t sim_t::INTERLEAVE;
+const size_t sim_t::MIN_QUANTUM;
+
 volatile bool ctrlc_pressed = false;
 static void handle_signal(int sig)
 {
@@ -30,14 +43,17 @@ sim_t::sim_t(const char* isa, const char* varch, size_t nprocs, bool halted,
              std::vector<int> const hartids,
              const debug_module_config_t &dm_config)
   : htif_t(args), mems(mems), procs(std::max(nprocs, size_t(1))),
-    start_pc(start_pc), current_step(0), current_proc(0), debug(false),
-    histogram_enabled(false), dtb_enabled(true), remote_bitbang(NULL),
+    start_pc(start_pc), round_len(0), current_step(0), current_proc(0),
+    threads(1), quantum(INTERLEAVE), round(0), groups_running(0),
+    workers_exit(false), debug(false), log(false), log_window_enabled(false),
+    histogram_enabled(false), histogram_interval(0), insn_mix_enabled(false),
+    dtb_enabled(true), remote_bitbang(NULL),
     debug_module(this, dm_config)
 {
   signal(SIGINT, &handle_signal);
 
   for (auto& x : mems)
-    bus.add_device(x.first, x.second);
+    bus.add_device(x.first, x.second, "mem");
 
   debug_module.add_device(&bus);
 
@@ -58,12 +74,20 @@ sim_t::sim_t(const char* isa, const char* varch, size_t nprocs, bool halted,
     }
   }
 
-  clint.reset(new clint_t(procs));
-  bus.add_device(CLINT_BASE, clint.get());
+  for (size_t i = 0; i < procs.size(); i++) {
+    hart_index[procs[i]] = i;
+    runnable.push_back(i);
+  }
+  parked.resize(procs.size());
+  hart_quantum.resize(procs.size(), INTERLEAVE);
+
+  clint.reset(new clint_t(procs, events, INSNS_PER_RTC_TICK));
+  bus.add_device(CLINT_BASE, clint.get(), "clint");
 }
 
 sim_t::~sim_t()
 {
+  stop_workers();
   for (size_t i = 0; i < procs.size(); i++)
     delete procs[i];
   delete debug_mmu;
@@ -76,18 +100,23 @@ void sim_thread_main(void* arg)
 
 void sim_t::main()
 {
-  if (!debug && log)
-    set_procs_debug(true);
+  if (!debug && log) {
+    if (log_window_enabled)
+      set_procs_trace_window();
+    else
+      set_procs_debug(true);
+  }
 
   while (!done())
   {
+    if (ctrlc_pressed && !debug)
+      dump_flight_recorders();
     if (debug || ctrlc_pressed)
       interactive();
+    else if (threads > 1)
+      step_parallel();
     else
       step(INTERLEAVE);
-    if (remote_bitbang) {
-      remote_bitbang->tick();
-    }
   }
 }
 
@@ -95,29 +124,203 @@ int sim_t::run()
 {
   host = context_t::current();
   target.init(sim_thread_main, this);
-  return htif_t::run();
+  int exit_code = htif_t::run();
+  if (exit_code != 0)
+    dump_flight_recorders();
+  if (histogram_enabled || !histogram_path.empty())
+    write_histogram();
+  if (profiler)
+    write_profile();
+  if (!callgraph_path.empty())
+    write_callgraph();
+  if (insn_mix_enabled)
+    print_insn_mix();
+  if (!stats_path.empty())
+    write_stats_file();
+  return exit_code;
+}
+
+void sim_t::step_hart(processor_t* p, size_t n)
+{
+  auto start = std::chrono::steady_clock::now();
+  p->step(n);
+  p->add_host_time(std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - start).count());
 }
 
 void sim_t::step(size_t n)
 {
   for (size_t i = 0, steps = 0; i < n; i += steps)
   {
-    steps = std::min(n - i, INTERLEAVE - current_step);
-    procs[current_proc]->step(steps);
+    if (current_proc == 0 && current_step == 0)
+      round_len = next_round_len(INTERLEAVE);
+
+    bool any = current_proc < runnable.size();
+    size_t hart = any ? runnable[current_proc] : 0;
+    size_t turn = any ? std::min(hart_quantum[hart], round_len) : round_len;
+    steps = std::min(n - i, turn - current_step);
+    if (any)
+      step_hart(procs[hart], steps);
 
     current_step += steps;
-    if (current_step == INTERLEAVE)
+    if (current_step == turn)
     {
       current_step = 0;
-      procs[current_proc]->get_mmu()->yield_load_reservation();
-      if (++current_proc == procs.size()) {
+      if (any) {
+        procs[hart]->get_mmu()->yield_load_reservation();
+        if (procs[hart]->yielded)
+          hart_quantum[hart] = std::max(MIN_QUANTUM, turn / 2);
+        else if (turn == hart_quantum[hart])
+          hart_quantum[hart] = std::min(INTERLEAVE, turn * 2);
+      }
+      if (++current_proc >= runnable.size()) {
         current_proc = 0;
-        clint->increment(INTERLEAVE / INSNS_PER_RTC_TICK);
+        end_round(round_len);
+        host->switch_to();
+        skip_idle_time();
       }
+    }
+  }
+}
+
+void sim_t::step_parallel()
+{
+  if (workers.empty()) {
+    for (size_t g = 1; g < threads; g++)
+      workers.emplace_back(&sim_t::worker_main, this, g, round);
+  }
 
-      host->switch_to();
+  {
+    std::lock_guard<std::mutex> lock(round_lock);
+    round_len = next_round_len(quantum);
+    groups_running = threads - 1;
+    round++;
+  }
+  round_start.notify_all();
+
+  step_group(0);
+
+  {
+    std::unique_lock<std::mutex> lock(round_lock);
+    round_end.wait(lock, [&]{ return groups_running == 0; });
+  }
+
+  end_round(round_len);
+  host->switch_to();
+  skip_idle_time();
+}
+
+// The length of the next round: limit instructions, cut short so that the
+// round ends when the next event is due.
+size_t sim_t::next_round_len(size_t limit)
+{
+  reg_t now = events.time(), next = events.next();
+  if (next <= now)
+    return 1;
+  return std::min<reg_t>(limit, next - now);
+}
+
+// Called once every runnable hart has had its turn: park the harts that are
+// stalled in WFI, advance time by the length of the round, running the
+// events that came due, and bring back the harts that were woken.
+void sim_t::end_round(size_t len)
+{
+  size_t n = 0;
+  for (size_t i : runnable) {
+    if (procs[i]->waiting_for_interrupt())
+      parked[i] = true;
+    else
+      runnable[n++] = i;
+  }
+  runnable.resize(n);
+
+  events.advance(events.time() + len);
+  wake_harts();
+}
+
+// Called after the host's turn at the end of a round. If every hart is
+// still stalled, nothing can happen before the next event, so skip straight
+// to it.  Everything that can wake a hart is either an event (the CLINT's
+// timers, the remote bitbang tick) or happens in the host's turn (HTIF and
+// the prompt), which is why the skip waits until the host has been polled
+// at the time the harts stalled.
+void sim_t::skip_idle_time()
+{
+  wake_harts();
+  if (runnable.empty() && events.next() != reg_t(-1)) {
+    events.advance(events.next());
+    wake_harts();
+  }
+}
+
+void sim_t::proc_wake(processor_t* proc)
+{
+  auto it = hart_index.find(proc);
+  if (it == hart_index.end())
+    return; // reset while sim_t is being constructed
+
+  std::lock_guard<std::mutex> lock(wake_lock);
+  woken.push_back(it->second);
+}
+
+void sim_t::wake_harts()
+{
+  std::lock_guard<std::mutex> lock(wake_lock);
+  size_t n = runnable.size();
+  for (size_t i : woken) {
+    if (parked[i]) {
+      parked[i] = false;
+      runnable.push_back(i);
     }
   }
+  woken.clear();
+
+  std::sort(runnable.begin() + n, runnable.end());
+  std::inplace_merge(runnable.begin(), runnable.begin() + n, runnable.end());
+}
+
+void sim_t::step_group(size_t group)
+{
+  auto begin = std::lower_bound(runnable.begin(), runnable.end(),
+                                procs.size() * group / threads);
+  auto end = std::lower_bound(begin, runnable.end(),
+                              procs.size() * (group + 1) / threads);
+  for (auto it = begin; it != end; ++it) {
+    step_hart(procs[*it], round_len);
+    procs[*it]->get_mmu()->yield_load_reservation();
+  }
+}
+
+void sim_t::worker_main(size_t group, size_t first_round)
+{
+  size_t last_round = first_round;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(round_lock);
+      round_start.wait(lock, [&]{ return round != last_round || workers_exit; });
+      if (workers_exit)
+        return;
+      last_round = round;
+    }
+
+    step_group(group);
+
+    std::lock_guard<std::mutex> lock(round_lock);
+    if (--groups_running == 0)
+      round_end.notify_one();
+  }
+}
+
+void sim_t::stop_workers()
+{
+  {
+    std::lock_guard<std::mutex> lock(round_lock);
+    workers_exit = true;
+  }
+  round_start.notify_all();
+  for (auto& t : workers)
+    t.join();
+  workers.clear();
 }
 
 void sim_t::set_debug(bool value)
@@ -130,6 +333,44 @@ void sim_t::set_log(bool value)
   log = value;
 }
 
+void sim_t::set_log_window(const trace_window_t& window, const std::string& symbol,
+                           const std::vector<uint32_t>& harts)
+{
+  log_window_enabled = true;
+  log_window = window;
+  log_symbol = symbol;
+  log_harts = harts;
+}
+
+// Symbols are only known once the program has been loaded, so this runs at
+// the start of the simulation rather than from set_log_window().
+void sim_t::set_procs_trace_window()
+{
+  trace_window_t window = log_window;
+  if (!log_symbol.empty()) {
+    auto& symbols = get_symbols();
+    auto it = symbols.find(log_symbol);
+    if (it == symbols.end()) {
+      std::cerr << "Symbol " << log_symbol << " not found in the program" << std::endl;
+      exit(1);
+    }
+    window.pc_start = it->second;
+    window.pc_end = -1;
+    // Assembler-local labels, like .Lpcrel_hi0, don't end a function.
+    for (auto& sym : symbols)
+      if (sym.second > window.pc_start && sym.second < window.pc_end &&
+          sym.first.compare(0, 2, ".L") != 0)
+        window.pc_end = sym.second;
+  }
+
+  for (size_t i = 0; i < procs.size(); i++) {
+    uint32_t id = procs[i]->get_id();
+    if (log_harts.empty() ||
+        std::find(log_harts.begin(), log_harts.end(), id) != log_harts.end())
+      procs[i]->set_trace_window(window);
+  }
+}
+
 void sim_t::set_histogram(bool value)
 {
   histogram_enabled = value;
@@ -138,6 +379,286 @@ void sim_t::set_histogram(bool value)
   }
 }
 
+void sim_t::set_histogram_file(const char* path, reg_t interval)
+{
+  histogram_path = path;
+  histogram_interval = interval;
+  set_histogram(true);
+  if (interval)
+    schedule_histogram_dump();
+}
+
+void sim_t::schedule_histogram_dump()
+{
+  events.schedule(events.time() + histogram_interval, [this]{
+    // A dump that failed is reported once, not every interval.
+    if (write_histogram())
+      schedule_histogram_dump();
+  });
+}
+
+// The file is written under a temporary name and renamed into place, so a
+// periodic dump never leaves a reader with half a histogram.
+bool sim_t::write_histogram()
+{
+  if (histogram_path.empty()) {
+    for (size_t i = 0; i < procs.size(); i++) {
+      auto counts = procs[i]->get_pc_histogram().sorted();
+      fprintf(stderr, "core %3d: PC histogram of %zu blocks\n", procs[i]->get_id(), counts.size());
+      for (auto& it : counts)
+        fprintf(stderr, "%016" PRIx64 " %" PRIu64 "\n", it.first, it.second);
+    }
+    return true;
+  }
+
+  std::string tmp = histogram_path + ".tmp";
+  FILE* out = fopen(tmp.c_str(), "w");
+  if (!out) {
+    std::cerr << "Unable to write histogram " << tmp << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  fprintf(out, "hart,paddr,count\n");
+  for (size_t i = 0; i < procs.size(); i++) {
+    for (auto& it : procs[i]->get_pc_histogram().sorted())
+      fprintf(out, "%u,0x%" PRIx64 ",%" PRIu64 "\n", procs[i]->get_id(), it.first, it.second);
+  }
+  fclose(out);
+  if (rename(tmp.c_str(), histogram_path.c_str()) != 0) {
+    std::cerr << "Unable to write histogram " << histogram_path << ": " << strerror(errno) << std::endl;
+    return false;
+  }
+  return true;
+}
+
+void sim_t::set_profile(const char* prefix, reg_t interval)
+{
+  profiler.reset(new profiler_t(interval));
+  profile_prefix = prefix;
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_profiler(profiler.get());
+}
+
+void sim_t::load_symbols(symtab_t& symbols)
+{
+  symbols.add(get_symbols());
+  if (!profile_map.empty() && !symbols.load_map(profile_map.c_str()))
+    std::cerr << "Unable to read " << profile_map << ": " << strerror(errno) << std::endl;
+}
+
+void sim_t::write_profile()
+{
+  symtab_t symbols;
+  load_symbols(symbols);
+  profiler->write(profile_prefix, symbols);
+}
+
+void sim_t::set_callgraph(const char* path)
+{
+  callgraph_path = path;
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_callgraph(true);
+}
+
+void sim_t::write_callgraph()
+{
+  FILE* out = fopen(callgraph_path.c_str(), "w");
+  if (!out) {
+    std::cerr << "Unable to write call graph " << callgraph_path << ": " << strerror(errno) << std::endl;
+    return;
+  }
+
+  symtab_t symbols;
+  load_symbols(symbols);
+
+  std::vector<std::pair<callgraph_t*, reg_t>> harts;
+  for (size_t i = 0; i < procs.size(); i++)
+    harts.emplace_back(procs[i]->get_callgraph(), procs[i]->get_state()->minstret);
+  callgraph_t::write(out, harts, symbols);
+  fclose(out);
+}
+
+void sim_t::set_log_commits(bool value)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_log_commits(value);
+}
+
+// Write the commit log of every hart to path in binary; see commit_log.h.
+void sim_t::set_commit_log(const char* path)
+{
+  commit_log_writer.reset(new commit_log_writer_t(path));
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_commit_log(commit_log_writer.get());
+}
+
+void sim_t::set_misaligned(bool value)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_mmu()->set_misaligned_enabled(value);
+}
+
+void sim_t::set_dirty(bool value)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_mmu()->set_dirty_enabled(value);
+}
+
+void sim_t::set_flight_recorder(size_t size)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_flight_recorder(size);
+}
+
+void sim_t::set_flight_dump_cause(reg_t cause)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_flight_dump_cause(cause);
+}
+
+void sim_t::dump_flight_recorders()
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->dump_flight_recorder(stderr);
+}
+
+void sim_t::set_insn_mix(bool value)
+{
+  insn_mix_enabled = value;
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_insn_mix(value);
+}
+
+void sim_t::print_insn_mix()
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->get_insn_mix().print(stderr, procs[i]->get_id());
+}
+
+static const char* const access_type_names[] = {"load", "store", "fetch"};
+
+static double mips(uint64_t insns, double seconds)
+{
+  return seconds > 0 ? insns / seconds / 1e6 : 0;
+}
+
+void sim_t::write_hart_stats(FILE* out, processor_t* p, const char* indent)
+{
+  mmu_t* mmu = p->get_mmu();
+  const host_stats_t& stats = p->get_host_stats();
+  double seconds = stats.host_ns / 1e9;
+
+  fprintf(out, "{\n");
+  fprintf(out, "%s  \"id\": %" PRIu32 ",\n", indent, p->get_id());
+  fprintf(out, "%s  \"instret\": %" PRIu64 ",\n", indent, p->get_state()->minstret);
+  fprintf(out, "%s  \"host_seconds\": %.6f,\n", indent, seconds);
+  fprintf(out, "%s  \"mips\": %.3f,\n", indent, mips(stats.host_insns, seconds));
+
+  fprintf(out, "%s  \"tlb\": {\n", indent);
+  for (int type = LOAD; type <= FETCH; type++) {
+    uint64_t refills = 0;
+    for (reg_t prv = 0; prv <= PRV_M; prv++)
+      refills += mmu->get_tlb_misses(prv, access_type(type));
+    fprintf(out, "%s    \"%s\": {\"hits\": %" PRIu64 ", \"slow_paths\": %" PRIu64
+            ", \"refills\": %" PRIu64 "}%s\n", indent, access_type_names[type],
+            mmu->get_tlb_hits(access_type(type)), mmu->get_tlb_slow_paths(access_type(type)),
+            refills, type == FETCH ? "" : ",");
+  }
+  fprintf(out, "%s  },\n", indent);
+
+  fprintf(out, "%s  \"tlb_flushes\": {", indent);
+  for (int r = 0; r < FLUSH_REASONS; r++)
+    fprintf(out, "%s\"%s\": %" PRIu64, r ? ", " : "", flush_reason_names[r],
+            mmu->get_tlb_flushes(flush_reason_t(r)));
+  fprintf(out, "},\n");
+
+  uint64_t refills = 0;
+  for (reg_t prv = 0; prv <= PRV_M; prv++)
+    refills += mmu->get_icache_refills(prv);
+  fprintf(out, "%s  \"icache_refills\": %" PRIu64 ",\n", indent, refills);
+  fprintf(out, "%s  \"icache_flushes\": {", indent);
+  for (int r = 0; r < FLUSH_REASONS; r++)
+    fprintf(out, "%s\"%s\": %" PRIu64, r ? ", " : "", flush_reason_names[r],
+            mmu->get_icache_flushes(flush_reason_t(r)));
+  fprintf(out, "},\n");
+
+  fprintf(out, "%s  \"decodes\": %" PRIu64 ",\n", indent, stats.decodes);
+  fprintf(out, "%s  \"decode_steps\": %" PRIu64 ",\n", indent, stats.decode_steps);
+  fprintf(out, "%s  \"slow_path\": {\"batches\": %" PRIu64 ", \"insns\": %" PRIu64 "},\n",
+          indent, stats.slow_path_batches, stats.slow_path_insns);
+  fprintf(out, "%s  \"traps\": {\"thrown\": %" PRIu64 ", \"taken\": %" PRIu64 "}\n",
+          indent, stats.traps_thrown, p->get_traps_taken());
+  fprintf(out, "%s}", indent);
+}
+
+// The overall speed is over the time the harts spent in step(), not the
+// time since the run started, which would count time at the prompt.
+void sim_t::write_stats(FILE* out)
+{
+  uint64_t ns = 0, insns = 0;
+  for (size_t i = 0; i < procs.size(); i++) {
+    ns += procs[i]->get_host_stats().host_ns;
+    insns += procs[i]->get_host_stats().host_insns;
+  }
+  double seconds = ns / 1e9;
+
+  fprintf(out, "{\n");
+  fprintf(out, "  \"host_seconds\": %.6f,\n", seconds);
+  fprintf(out, "  \"mips\": %.3f,\n", mips(insns, seconds));
+
+  fprintf(out, "  \"harts\": [\n");
+  for (size_t i = 0; i < procs.size(); i++) {
+    fprintf(out, "    ");
+    write_hart_stats(out, procs[i], "    ");
+    fprintf(out, "%s\n", i + 1 < procs.size() ? "," : "");
+  }
+  fprintf(out, "  ],\n");
+
+  auto devices = bus.get_device_stats();
+  fprintf(out, "  \"mmio\": [\n");
+  for (size_t i = 0; i < devices.size(); i++)
+    fprintf(out, "    {\"device\": \"%s\", \"base\": \"0x%" PRIx64 "\", \"loads\": %" PRIu64
+            ", \"stores\": %" PRIu64 "}%s\n", devices[i].name.c_str(), devices[i].base,
+            devices[i].loads, devices[i].stores, i + 1 < devices.size() ? "," : "");
+  fprintf(out, "  ]\n");
+  fprintf(out, "}\n");
+}
+
+void sim_t::write_stats_file()
+{
+  FILE* out = fopen(stats_path.c_str(), "w");
+  if (!out) {
+    std::cerr << "Unable to write statistics " << stats_path << ": " << strerror(errno) << std::endl;
+    return;
+  }
+  write_stats(out);
+  fclose(out);
+}
+
+void sim_t::set_jit(bool value)
+{
+  for (size_t i = 0; i < procs.size(); i++)
+    procs[i]->set_jit(value);
+}
+
+void sim_t::set_threads(size_t threads, size_t quantum)
+{
+  this->threads = std::max(size_t(1), std::min(threads, procs.size()));
+  this->quantum = quantum;
+}
+
+void sim_t::set_remote_bitbang(remote_bitbang_t* remote_bitbang)
+{
+  this->remote_bitbang = remote_bitbang;
+  events.schedule(events.time(), [this] { tick_remote_bitbang(); });
+}
+
+// Service the debug transport every INTERLEAVE instructions.
+void sim_t::tick_remote_bitbang()
+{
+  remote_bitbang->tick();
+  events.schedule(events.time() + INTERLEAVE, [this] { tick_remote_bitbang(); });
+}
+
 void sim_t::set_procs_debug(bool value)
 {
   for (size_t i=0; i< procs.size(); i++)
@@ -187,7 +708,7 @@ void sim_t::make_dtb()
   rom.resize((rom.size() + align - 1) / align * align);
 
   boot_rom.reset(new rom_device_t(rom));
-  bus.add_device(DEFAULT_RSTVEC, boot_rom.get());
+  bus.add_device(DEFAULT_RSTVEC, boot_rom.get(), "boot_rom");
 }
 
 char* sim_t::addr_to_mem(reg_t addr) {
@@ -229,4 +750,7 @@ void sim_t::write_chunk(addr_t taddr, size_t len, const void* src)
 void sim_t::proc_reset(unsigned id)
 {
   debug_module.proc_reset(id);
+
+  if (clint)
+    clint->proc_reset(id);
 }
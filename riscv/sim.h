@@ -6,16 +6,24 @@
 #include "processor.h"
 #include "devices.h"
 #include "debug_module.h"
+#include "events.h"
 #include "simif.h"
 #include <fesvr/htif.h>
 #include <fesvr/context.h>
 #include <vector>
 #include <string>
 #include <memory>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <sys/types.h>
 
 class mmu_t;
 class remote_bitbang_t;
+class commit_log_writer_t;
+class profiler_t;
+class symtab_t;
 
 // this class encapsulates the processors and memory in a RISC-V machine.
 class sim_t : public htif_t, public simif_t
@@ -31,20 +39,58 @@ public:
   int run();
   void set_debug(bool value);
   void set_log(bool value);
+  // Restrict -l to window on the harts in harts (all if empty). A symbol
+  // overrides the window's pc range with the range from that symbol's
+  // address to the next symbol's.
+  void set_log_window(const trace_window_t& window, const std::string& symbol,
+                      const std::vector<uint32_t>& harts);
   void set_histogram(bool value);
+  // Write the histogram to path as CSV when the simulation ends, and every
+  // interval instructions if interval isn't 0, rather than print it.
+  void set_histogram_file(const char* path, reg_t interval);
+  void set_log_commits(bool value);
+  void set_commit_log(const char* path);
+  void set_misaligned(bool value);
+  void set_dirty(bool value);
+  // Sample each hart every interval instructions and write the profile to
+  // files starting with prefix at exit.
+  void set_profile(const char* prefix, reg_t interval);
+  // Keep a shadow call stack on each hart and write the call graph it
+  // yields to path at exit.
+  void set_callgraph(const char* path);
+  // Name functions in profiles and call graphs from the System.map file at
+  // path as well as from the program's symbols.
+  void set_profile_map(const char* path) { profile_map = path; }
+  void set_flight_recorder(size_t size);
+  void set_flight_dump_cause(reg_t cause);
+  void dump_flight_recorders();
+  // Count the instructions each hart retires by class and privilege mode,
+  // and print the counts when the simulation ends.
+  void set_insn_mix(bool value);
+  void print_insn_mix();
+  // Write counts of the simulator's own work and its speed, as JSON, to
+  // path when the simulation ends.
+  void set_stats(const char* path) { stats_path = path; }
+  void write_stats(FILE* out);
+  void set_jit(bool value);
+  void set_threads(size_t threads, size_t quantum);
   void set_procs_debug(bool value);
   void set_dtb_enabled(bool value) {
     this->dtb_enabled = value;
   }
-  void set_remote_bitbang(remote_bitbang_t* remote_bitbang) {
-    this->remote_bitbang = remote_bitbang;
-  }
+  void set_remote_bitbang(remote_bitbang_t* remote_bitbang);
   const char* get_dts() { if (dts.empty()) reset(); return dts.c_str(); }
   processor_t* get_core(size_t i) { return procs.at(i); }
   unsigned nprocs() const { return procs.size(); }
 
+  // instructions each hart runs before the next one gets a turn
+  static const size_t INTERLEAVE = 5000;
+
   // Callback for processors to let the simulation know they were reset.
   void proc_reset(unsigned id);
+  // Callback for processors to let the simulation know a hart stalled in
+  // WFI may have something to do.
+  void proc_wake(processor_t* proc);
 
 private:
   std::vector<std::pair<reg_t, mem_t*>> mems;
@@ -54,18 +100,92 @@ private:
   std::string dts;
   std::unique_ptr<rom_device_t> boot_rom;
   std::unique_ptr<clint_t> clint;
+  std::unique_ptr<commit_log_writer_t> commit_log_writer;
   bus_t bus;
 
+  // Simulated time, in instructions per hart, and the device events due at
+  // given times. A round of hart turns ends no later than the next event,
+  // which runs when the round is over.
+  event_queue_t events;
+  size_t round_len;
+  size_t next_round_len(size_t limit);
+
   processor_t* get_core(const std::string& i);
   void step(size_t n); // step through simulation
-  static const size_t INTERLEAVE = 5000;
+  // Run a hart for n instructions, charging the host time taken to it.
+  void step_hart(processor_t* p, size_t n);
+  void end_round(size_t len);
+  void skip_idle_time();
+  void wake_harts();
+  void tick_remote_bitbang();
   static const size_t INSNS_PER_RTC_TICK = 100; // 10 MHz clock for 1 BIPS core
   static const size_t CPU_HZ = 1000000000; // 1GHz CPU
   size_t current_step;
   size_t current_proc;
+
+  // Only runnable harts are stepped. runnable holds their indices into
+  // procs in ascending order. A hart stalled in WFI is parked at the end of
+  // a round and goes back on the list at the end of the round in which
+  // proc_wake() is called for it. Harts halted in debug mode keep running
+  // the debug ROM, so they stay runnable.
+  std::vector<size_t> runnable;
+  std::vector<bool> parked;
+  std::unordered_map<const processor_t*, size_t> hart_index;
+  std::mutex wake_lock;
+  std::vector<size_t> woken; // guarded by wake_lock
+
+  // Each hart's turn in step() lasts its own quantum of instructions, or
+  // the length of the round if that is shorter. The quantum of a hart that
+  // yields because it is spinning is halved, and that of a hart that uses
+  // a whole quantum doubles, up to INTERLEAVE. Time advances by the length
+  // of the round.
+  static const size_t MIN_QUANTUM = INTERLEAVE / 16;
+  std::vector<size_t> hart_quantum;
+
+  // With more than one thread, the harts are split into that many
+  // contiguous groups. Group 0 runs on the simulation thread and every
+  // other group on a worker thread of its own. Each round, every hart runs
+  // for one quantum of instructions, or until the next event, and all
+  // groups meet at a barrier before events run and the host gets control.
+  size_t threads;
+  size_t quantum;
+  std::vector<std::thread> workers;
+  std::mutex round_lock;
+  std::condition_variable round_start;
+  std::condition_variable round_end;
+  size_t round;
+  size_t groups_running;
+  bool workers_exit;
+  void step_parallel();
+  void step_group(size_t group);
+  void worker_main(size_t group, size_t first_round);
+  void stop_workers();
+
   bool debug;
   bool log;
+  bool log_window_enabled;
+  trace_window_t log_window;
+  std::string log_symbol;
+  std::vector<uint32_t> log_harts;
+  void set_procs_trace_window();
   bool histogram_enabled; // provide a histogram of PCs
+  std::string histogram_path;
+  reg_t histogram_interval;
+  bool write_histogram(); // false if the file couldn't be written
+  void schedule_histogram_dump();
+  std::unique_ptr<profiler_t> profiler;
+  std::string profile_prefix;
+  std::string profile_map;
+  void load_symbols(symtab_t& symbols);
+  void write_profile();
+  std::string callgraph_path;
+  void write_callgraph();
+  bool insn_mix_enabled;
+  std::string stats_path;
+  void write_stats_file();
+  // one hart's statistics, as a JSON object whose lines after the first
+  // start with indent
+  static void write_hart_stats(FILE* out, processor_t* p, const char* indent);
   bool dtb_enabled;
   remote_bitbang_t* remote_bitbang;
 
@@ -95,6 +215,10 @@ private:
   void interactive_until(const std::string& cmd, const std::vector<std::string>& args, bool noisy);
   void interactive_until_silent(const std::string& cmd, const std::vector<std::string>& args);
   void interactive_until_noisy(const std::string& cmd, const std::vector<std::string>& args);
+  void interactive_mode(const std::string& cmd, const std::vector<std::string>& args);
+  void interactive_flight(const std::string& cmd, const std::vector<std::string>& args);
+  void interactive_mix(const std::string& cmd, const std::vector<std::string>& args);
+  void interactive_stats(const std::string& cmd, const std::vector<std::string>& args);
   reg_t get_reg(const std::vector<std::string>& args);
   freg_t get_freg(const std::vector<std::string>& args);
   reg_t get_mem(const std::vector<std::string>& args);
@@ -5,6 +5,8 @@
 
 #include "decode.h"
 
+class processor_t;
+
 // this is the interface to the simulator used by the processors and memory
 class simif_t
 {
@@ -16,6 +18,9 @@ public:
   virtual bool mmio_store(reg_t addr, size_t len, const uint8_t* bytes) = 0;
   // Callback for processors to let the simulation know they were reset.
   virtual void proc_reset(unsigned id) = 0;
+  // Callback for processors to let the simulation know that a hart which may
+  // be stalled in WFI has something to do.
+  virtual void proc_wake(processor_t* proc) = 0;
 };
 
 #endif
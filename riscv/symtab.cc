@@ -0,0 +1,47 @@
+// See LICENSE for license details.
+
+#include "symtab.h"
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+void symtab_t::add(const std::map<std::string, uint64_t>& symbols)
+{
+  for (auto& sym : symbols) {
+    if (sym.second == 0 || sym.first.empty() || sym.first[0] == '$' ||
+        sym.first.compare(0, 2, ".L") == 0)
+      continue;
+    by_addr.emplace(sym.second, sym.first);
+  }
+}
+
+bool symtab_t::load_map(const char* path)
+{
+  std::ifstream in(path);
+  if (!in)
+    return false;
+
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream fields(line);
+    std::string addr, type, name;
+    if (!(fields >> addr >> type >> name) || type.size() != 1)
+      continue;
+    if (type == "T" || type == "t" || type == "W" || type == "w")
+      by_addr.emplace(strtoull(addr.c_str(), NULL, 16), name);
+  }
+  return true;
+}
+
+std::string symtab_t::lookup(reg_t addr) const
+{
+  auto it = by_addr.upper_bound(addr);
+  if (it != by_addr.begin())
+    return (--it)->second;
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), "0x%" PRIx64, addr);
+  return buf;
+}
@@ -0,0 +1,31 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_SYMTAB_H
+#define _RISCV_SYMTAB_H
+
+#include "decode.h"
+#include <map>
+#include <string>
+
+// Maps code addresses back to the symbols they lie in, for the profilers.
+// A symbol is taken to extend up to the next one.
+class symtab_t
+{
+ public:
+  // Add the symbols of an ELF file, as load_elf() returns them, skipping
+  // the ones that don't start code: file and section symbols, which have
+  // address 0 or no name, assembler-local .L labels and $x mapping symbols.
+  void add(const std::map<std::string, uint64_t>& symbols);
+  // Add the text symbols of a file in the format of a Linux System.map,
+  // one "<hex address> <type> <name>" per line.  Returns false if the file
+  // can't be read.
+  bool load_map(const char* path);
+
+  // The name of the symbol addr lies in, or 0x<addr> if it lies below them all.
+  std::string lookup(reg_t addr) const;
+
+ private:
+  std::map<reg_t, std::string> by_addr;
+};
+
+#endif
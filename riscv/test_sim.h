@@ -0,0 +1,60 @@
+// See LICENSE for license details.
+
+#ifndef _RISCV_TEST_SIM_H
+#define _RISCV_TEST_SIM_H
+
+// What the unit tests need to stand up harts without a sim_t: a flat RAM and
+// a check that reports failures in the form "make check" looks for.
+
+#include "simif.h"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+class test_sim_t : public simif_t
+{
+public:
+  static const reg_t MEM_BASE = 0x80000000;
+
+  test_sim_t(size_t size) : mem(size) {}
+
+  char* addr_to_mem(reg_t addr)
+  {
+    if (addr >= MEM_BASE && addr - MEM_BASE < mem.size())
+      return &mem[addr - MEM_BASE];
+    return NULL;
+  }
+  bool mmio_load(reg_t addr, size_t len, uint8_t* bytes) { return false; }
+  bool mmio_store(reg_t addr, size_t len, const uint8_t* bytes) { return false; }
+  void proc_reset(unsigned id) {}
+  void proc_wake(processor_t* proc) {}
+
+  uint64_t read64(reg_t addr)
+  {
+    uint64_t val;
+    memcpy(&val, addr_to_mem(addr), sizeof(val));
+    return val;
+  }
+  void write64(reg_t addr, uint64_t val)
+  {
+    memcpy(addr_to_mem(addr), &val, sizeof(val));
+  }
+
+private:
+  std::vector<char> mem;
+};
+
+static int test_failures = 0;
+
+#define TEST_CHECK(cond) \
+  ((cond) ? (void)0 : (void)(test_failures++, \
+    printf("FAILED %s:%d: %s\n", __FILE__, __LINE__, #cond)))
+
+static int test_finish(const char* name)
+{
+  if (!test_failures)
+    printf("%s: passed\n", name);
+  return test_failures != 0;
+}
+
+#endif
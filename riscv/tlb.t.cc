@@ -0,0 +1,100 @@
+// See LICENSE for license details.
+
+// Check that SFENCE.VMA's flushes reach the cached translations they order,
+// and only those: TLB entries for 4 KiB pages, the 4 KiB slices of
+// superpages and the tables in the page-walk cache.
+
+#include "config.h"
+#include "processor.h"
+#include "mmu.h"
+#include "test_sim.h"
+
+static const reg_t ROOT = test_sim_t::MEM_BASE + 0x1000;  // Sv39 root table
+static const reg_t L1 = test_sim_t::MEM_BASE + 0x2000;    // VAs below 1 GiB
+static const reg_t L0 = test_sim_t::MEM_BASE + 0x3000;    // VAs below 2 MiB
+static const reg_t L0_ALT = test_sim_t::MEM_BASE + 0x4000;
+static const reg_t PAGE_A = test_sim_t::MEM_BASE + 0x10000;
+static const reg_t PAGE_B = test_sim_t::MEM_BASE + 0x11000;
+static const reg_t PAGE_C = test_sim_t::MEM_BASE + 0x12000;
+static const reg_t MEGA_A = test_sim_t::MEM_BASE + 0x200000;
+static const reg_t MEGA_B = test_sim_t::MEM_BASE + 0x400000;
+static const reg_t MEGA_VA = 0x200000;
+static const size_t MEGA_PAGES = 64;
+
+static reg_t table(reg_t paddr)
+{
+  return (paddr >> PGSHIFT) << PTE_PPN_SHIFT | PTE_V;
+}
+
+static reg_t leaf(reg_t paddr)
+{
+  return table(paddr) | PTE_R | PTE_W | PTE_A | PTE_D;
+}
+
+int main()
+{
+  test_sim_t sim(8 << 20);
+  processor_t p(DEFAULT_ISA, DEFAULT_VARCH, &sim, 0);
+  mmu_t* mmu = p.get_mmu();
+
+  p.set_csr(CSR_PMPADDR0, reg_t(-1));
+  p.set_csr(CSR_PMPCFG0, PMP_NAPOT | PMP_R | PMP_W | PMP_X);
+
+  sim.write64(ROOT, table(L1));
+  sim.write64(L1, table(L0));
+  sim.write64(L0 + 8, leaf(PAGE_A));
+  sim.write64(L0_ALT + 8, leaf(PAGE_C));
+  sim.write64(PAGE_A, 1);
+  sim.write64(PAGE_B, 2);
+  sim.write64(PAGE_C, 3);
+  for (size_t i = 0; i < MEGA_PAGES; i++) {
+    sim.write64(MEGA_A + i * PGSIZE, 100 + i);
+    sim.write64(MEGA_B + i * PGSIZE, 200 + i);
+  }
+
+  p.get_state()->prv = PRV_S;
+  p.set_csr(CSR_SATP, reg_t(SATP_MODE_SV39) << 60 | ROOT >> PGSHIFT);
+
+  // A remapped page keeps its old translation until it is flushed, and a
+  // flush of another page leaves it alone.
+  TEST_CHECK(mmu->load_uint64(0x1000) == 1);
+  sim.write64(L0 + 8, leaf(PAGE_B));
+  TEST_CHECK(mmu->load_uint64(0x1000) == 1);
+  mmu->flush_tlb_page(0x1000);
+  TEST_CHECK(mmu->load_uint64(0x1000) == 2);
+  sim.write64(L0 + 8, leaf(PAGE_A));
+  mmu->flush_tlb_page(0x2000);
+  TEST_CHECK(mmu->load_uint64(0x1000) == 2);
+  mmu->flush_tlb_page(0x1000);
+  TEST_CHECK(mmu->load_uint64(0x1000) == 1);
+
+  // satp has no ASID bits, so a flush by any ASID drops every translation.
+  sim.write64(L0 + 8, leaf(PAGE_B));
+  mmu->flush_tlb_asid(5);
+  TEST_CHECK(mmu->load_uint64(0x1000) == 2);
+  sim.write64(L0 + 8, leaf(PAGE_A));
+  mmu->flush_tlb_asid(0);
+  TEST_CHECK(mmu->load_uint64(0x1000) == 1);
+
+  // Flushing any page of a superpage drops every slice of it, whichever
+  // TLB set the slice landed in.
+  sim.write64(L1 + 8, leaf(MEGA_A));
+  for (size_t i = 0; i < MEGA_PAGES; i++)
+    TEST_CHECK(mmu->load_uint64(MEGA_VA + i * PGSIZE) == 100 + i);
+  sim.write64(L1 + 8, leaf(MEGA_B));
+  mmu->flush_tlb_page(MEGA_VA + 5 * PGSIZE);
+  for (size_t i = 0; i < MEGA_PAGES; i++)
+    TEST_CHECK(mmu->load_uint64(MEGA_VA + i * PGSIZE) == 200 + i);
+
+  // A flush by address drops the cached tables above that address, and a
+  // full flush drops all of them.
+  sim.write64(L1, table(L0_ALT));
+  mmu->flush_tlb_page(0x1000);
+  TEST_CHECK(mmu->load_uint64(0x1000) == 3);
+  sim.write64(L1, table(L0));
+  mmu->flush_tlb();
+  TEST_CHECK(mmu->load_uint64(0x1000) == 1);
+  TEST_CHECK(mmu->load_uint64(MEGA_VA) == 200);
+
+  return test_finish("tlb");
+}
@@ -11,7 +11,7 @@ struct state_t;
 class trap_t
 {
  public:
-  trap_t(reg_t which) : which(which) {}
+  trap_t(reg_t which) : _name(), which(which) {}
   virtual const char* name();
   virtual bool has_tval() { return false; }
   virtual reg_t get_tval() { return 0; }
@@ -32,6 +32,28 @@ class mem_trap_t : public trap_t
   reg_t tval;
 };
 
+// What processor_t::take_trap needs to know about a trap, as plain data, so
+// that an instruction can record a trap in state_t instead of throwing it;
+// see defer_trap() in decode.h.
+struct trap_info_t
+{
+  reg_t cause;
+  reg_t tval;
+  bool has_tval;
+  const char* name;
+};
+
+class deferred_trap_t : public trap_t
+{
+ public:
+  deferred_trap_t(const trap_info_t& info) : trap_t(info.cause), info(info) {}
+  const char* name() override { return info.name; }
+  bool has_tval() override { return info.has_tval; }
+  reg_t get_tval() override { return info.tval; }
+ private:
+  trap_info_t info;
+};
+
 #define DECLARE_TRAP(n, x) class trap_##x : public trap_t { \
  public: \
   trap_##x() : trap_t(n) {} \
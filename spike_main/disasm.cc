@@ -73,6 +73,7 @@ struct : public arg_t {
     {
       #define DECLARE_CSR(name, num) case num: return #name;
       #include "encoding.h"
+      #include "hpm_encoding.h"
       #undef DECLARE_CSR
       default:
       {
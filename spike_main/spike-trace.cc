@@ -0,0 +1,132 @@
+// See LICENSE for license details.
+
+// This little program reads a binary commit log, as written by
+//   spike --commit-log=<file>
+// and prints it in the text format of spike --log-commits.  Records come
+// out a chunk at a time, so each hart's instructions are in order but the
+// harts are only coarsely interleaved.
+
+#include "commit_log.h"
+#include <fesvr/option_parser.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static void help(int exit_code = 1)
+{
+  fprintf(stderr, "usage: spike-trace [options] <commit log>\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr, "  --hart=<id>     Only print the instructions of hart <id>\n");
+  fprintf(stderr, "  --mem           Print the physical address of each memory access\n");
+  fprintf(stderr, "  -h, --help      Print this help message\n");
+  exit(exit_code);
+}
+
+static void suggest_help()
+{
+  fprintf(stderr, "Try 'spike-trace --help' for more information.\n");
+  exit(1);
+}
+
+static bool ends_with(const std::string& s, const std::string& suffix)
+{
+  return s.size() >= suffix.size() &&
+         s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static FILE* in;
+static const char* decompressor;
+
+// Close the decompressor once it has reached the end of its output.  One
+// that failed leaves the log looking truncated, so say that it failed.
+static void finish_decompressor()
+{
+  if (!decompressor)
+    return;
+  std::string error = pclose_error(in);
+  if (!error.empty()) {
+    fprintf(stderr, "spike-trace: %s %s\n", decompressor, error.c_str());
+    exit(1);
+  }
+  decompressor = NULL;
+}
+
+static void truncated()
+{
+  finish_decompressor();
+  fprintf(stderr, "spike-trace: commit log is truncated\n");
+  exit(1);
+}
+
+int main(int argc, char** argv)
+{
+  long hart = -1;
+  bool mem = false;
+
+  option_parser_t parser;
+  parser.help(&suggest_help);
+  parser.option('h', "help", 0, [&](const char* s){help(0);});
+  parser.option(0, "hart", 1, [&](const char* s){hart = atol(s);});
+  parser.option(0, "mem", 0, [&](const char* s){mem = true;});
+  auto argv1 = parser.parse(argv);
+  if (!argv1[0] || argv1[1])
+    help();
+
+  std::string name(argv1[0]);
+  decompressor = ends_with(name, ".zst") ? "zstd -q -d -c" :
+                 ends_with(name, ".lz4") ? "lz4 -q -d -c" :
+                 ends_with(name, ".gz") ? "gzip -d -c" : NULL;
+  if (decompressor && !command_exists(decompressor)) {
+    fprintf(stderr, "spike-trace: unable to open %s: cannot run %s\n", name.c_str(), decompressor);
+    return 1;
+  }
+  if (decompressor)
+    in = popen((std::string(decompressor) + " " + shell_quote(name)).c_str(), "r");
+  else
+    in = fopen(name.c_str(), "rb");
+  if (!in) {
+    fprintf(stderr, "spike-trace: unable to open %s: %s\n", name.c_str(), strerror(errno));
+    return 1;
+  }
+
+  char magic[sizeof(COMMIT_LOG_MAGIC) - 1];
+  size_t magic_bytes = fread(magic, 1, sizeof(magic), in);
+  if (magic_bytes != sizeof(magic))
+    finish_decompressor();
+  if (magic_bytes != sizeof(magic) ||
+      memcmp(magic, COMMIT_LOG_MAGIC, sizeof(magic)) != 0) {
+    fprintf(stderr, "spike-trace: %s is not a binary commit log\n", name.c_str());
+    return 1;
+  }
+
+  std::vector<uint8_t> records;
+  commit_log_chunk_t chunk;
+  while (fread(&chunk, sizeof(chunk), 1, in) == 1) {
+    records.resize(chunk.bytes);
+    if (fread(records.data(), 1, chunk.bytes, in) != chunk.bytes)
+      truncated();
+    if (hart >= 0 && chunk.hartid != (uint32_t)hart)
+      continue;
+
+    for (size_t pos = 0; pos < records.size(); ) {
+      commit_log_record_t r;
+      commit_log_reg_t reg;
+      uint64_t mem_addr;
+      if (!commit_log_decode(records, &pos, &r, &reg, &mem_addr))
+        truncated();
+      bool has_mem = r.flags & COMMIT_LOG_MEM;
+      int xlen = r.flags & COMMIT_LOG_RV64 ? 64 : 32;
+      commit_log_print(stdout, r.priv, xlen, r.flen, r.pc, insn_t(r.insn), reg,
+                       mem && has_mem ? &mem_addr : NULL);
+    }
+  }
+
+  if (decompressor)
+    finish_decompressor();
+  else
+    fclose(in);
+  return 0;
+}
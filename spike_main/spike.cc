@@ -5,13 +5,17 @@
 #include "remote_bitbang.h"
 #include "cachesim.h"
 #include "extension.h"
+#include "profiler.h"
 #include <dlfcn.h>
+#include <inttypes.h>
 #include <fesvr/option_parser.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <vector>
 #include <string>
 #include <memory>
+#include <algorithm>
 #include "../VERSION"
 
 static void help(int exit_code = 1)
@@ -20,12 +24,54 @@ static void help(int exit_code = 1)
   fprintf(stderr, "usage: spike [host options] <target program> [target options]\n");
   fprintf(stderr, "Host Options:\n");
   fprintf(stderr, "  -p<n>                 Simulate <n> processors [default 1]\n");
+  fprintf(stderr, "  --threads=<n>         Run the processors on <n> host threads [default 1]\n");
+  fprintf(stderr, "  --quantum=<n>         With --threads, processors run <n> instructions\n");
+  fprintf(stderr, "                          between barriers [default %zu]\n", sim_t::INTERLEAVE);
   fprintf(stderr, "  -m<n>                 Provide <n> MiB of target memory [default 2048]\n");
   fprintf(stderr, "  -m<a:m,b:n,...>       Provide memory regions of size m and n bytes\n");
   fprintf(stderr, "                          at base addresses a and b (with 4 KiB alignment)\n");
   fprintf(stderr, "  -d                    Interactive debug mode\n");
-  fprintf(stderr, "  -g                    Track histogram of PCs\n");
+  fprintf(stderr, "  -g                    Count how often each block of code runs, by\n");
+  fprintf(stderr, "                          physical address, and print it at exit\n");
+  fprintf(stderr, "  --histogram=<file>    Like -g, but write it to <file> as CSV\n");
+  fprintf(stderr, "  --histogram-interval=<n> With --histogram, also write it every <n>\n");
+  fprintf(stderr, "                          instructions\n");
+  fprintf(stderr, "  --profile=<prefix>    Sample each processor's pc and call stack and write\n");
+  fprintf(stderr, "                          a flat profile to <prefix>.flat and stacks\n");
+  fprintf(stderr, "                          for flamegraph.pl to <prefix>.folded\n");
+  fprintf(stderr, "  --profile-interval=<n> Sample every <n> instructions [default %" PRIu64 "]\n",
+          profiler_t::DEFAULT_INTERVAL);
+  fprintf(stderr, "  --callgraph=<file>    Keep a shadow call stack on each processor and\n");
+  fprintf(stderr, "                          write the instructions retired along each\n");
+  fprintf(stderr, "                          call to <file>\n");
+  fprintf(stderr, "  --profile-map=<file>  Also name functions from a System.map file\n");
+  fprintf(stderr, "  --insn-mix            Print the number of instructions of each class\n");
+  fprintf(stderr, "                          retired in each privilege mode at exit\n");
+  fprintf(stderr, "  --stats=<file>        Write the simulator's TLB, icache, decode, trap,\n");
+  fprintf(stderr, "                          flush and MMIO counts and its speed in MIPS\n");
+  fprintf(stderr, "                          to <file> as JSON at exit\n");
   fprintf(stderr, "  -l                    Generate a log of execution\n");
+  fprintf(stderr, "  --log-pc=<a>:<b>      Like -l, but only log instructions at pcs in [a, b)\n");
+  fprintf(stderr, "  --log-pc=<symbol>     Like -l, but only log from <symbol> to the next one\n");
+  fprintf(stderr, "  --log-priv=<modes>    Like -l, but only log instructions executed in\n");
+  fprintf(stderr, "                          the privilege modes in <modes>, e.g. su\n");
+  fprintf(stderr, "  --log-instret=<a>:<b> Like -l, but only log while minstret is in [a, b)\n");
+  fprintf(stderr, "  --log-hart=<id,...>   Like -l, but only log the harts with these ids\n");
+  fprintf(stderr, "  --log-commits         Generate a log of commits info\n");
+  fprintf(stderr, "  --commit-log=<file>   Write the log of commits info to <file> in binary;\n");
+  fprintf(stderr, "                          .zst, .lz4 and .gz names are compressed.\n");
+  fprintf(stderr, "                          Decode it with spike-trace\n");
+  fprintf(stderr, "  --flight-recorder=<n> Remember the last <n> runs of instructions and\n");
+  fprintf(stderr, "                          traps of each processor, shown on failure,\n");
+  fprintf(stderr, "                          CTRL+C or the flight command [default %zu]\n",
+          flight_recorder_t::DEFAULT_SIZE);
+  fprintf(stderr, "  --flight-dump-cause=<n> Also show them whenever a trap with cause <n>\n");
+  fprintf(stderr, "                          is taken\n");
+  fprintf(stderr, "  --misaligned          Emulate misaligned loads and stores instead\n");
+  fprintf(stderr, "                          of trapping\n");
+  fprintf(stderr, "  --dirty               Set PTE A and D bits in hardware instead of\n");
+  fprintf(stderr, "                          raising page faults\n");
+  fprintf(stderr, "  --jit                 Translate hot code to host code (x86-64 only)\n");
   fprintf(stderr, "  -h, --help            Print this help message\n");
   fprintf(stderr, "  -H                    Start halted, allowing a debugger to connect\n");
   fprintf(stderr, "  --isa=<name>          RISC-V ISA string [default %s]\n", DEFAULT_ISA);
@@ -36,6 +82,9 @@ static void help(int exit_code = 1)
   fprintf(stderr, "  --dc=<S>:<W>:<B>        W ways, and B-byte blocks (with S and\n");
   fprintf(stderr, "  --l2=<S>:<W>:<B>        B both powers of 2).\n");
   fprintf(stderr, "  --log-cache-miss      Generate a log of cache miss\n");
+  fprintf(stderr, "  --tlb=<S>:<W>         Give each hart's simulator TLB S sets of W ways\n");
+  fprintf(stderr, "                          (both powers of 2) [default %zu:%zu]\n",
+          mmu_t::DEFAULT_TLB_SETS, mmu_t::DEFAULT_TLB_WAYS);
   fprintf(stderr, "  --extension=<name>    Specify RoCC Extension\n");
   fprintf(stderr, "  --extlib=<name>       Shared library to load\n");
   fprintf(stderr, "  --rbb-port=<port>     Listen on <port> for remote bitbang connection\n");
@@ -93,21 +142,81 @@ static std::vector<std::pair<reg_t, mem_t*>> make_mems(const char* arg)
   return res;
 }
 
+static void parse_range(const char* arg, reg_t* start, reg_t* end)
+{
+  char* p;
+  *start = strtoull(arg, &p, 0);
+  if (*p != ':')
+    help();
+  *end = strtoull(p + 1, &p, 0);
+  if (*p || *end <= *start)
+    help();
+}
+
+static unsigned parse_priv(const char* arg)
+{
+  unsigned mask = 0;
+  for (const char* p = arg; *p; p++) {
+    switch (*p) {
+      case 'u': mask |= 1 << PRV_U; break;
+      case 's': mask |= 1 << PRV_S; break;
+      case 'm': mask |= 1 << PRV_M; break;
+      default: help();
+    }
+  }
+  return mask;
+}
+
+static void parse_tlb(const char* arg, size_t* sets, size_t* ways)
+{
+  char* p;
+  *sets = strtoull(arg, &p, 0);
+  if (*p != ':')
+    help();
+  *ways = strtoull(p + 1, &p, 0);
+  if (*p || !*sets || (*sets & (*sets - 1)) || !*ways || (*ways & (*ways - 1)) ||
+      *sets * *ways > (size_t(1) << 24))
+    help();
+}
+
 int main(int argc, char** argv)
 {
   bool debug = false;
   bool halted = false;
   bool histogram = false;
+  bool jit = false;
   bool log = false;
+  bool log_commits = false;
+  bool log_window = false;
+  trace_window_t window;
+  std::string log_symbol;
+  std::vector<uint32_t> log_harts;
+  const char* commit_log = NULL;
+  const char* histogram_file = NULL;
+  const char* profile = NULL;
+  reg_t profile_interval = profiler_t::DEFAULT_INTERVAL;
+  const char* profile_map = NULL;
+  const char* callgraph = NULL;
+  bool insn_mix = false;
+  const char* stats = NULL;
+  reg_t histogram_interval = 0;
+  size_t flight_size = flight_recorder_t::DEFAULT_SIZE;
+  reg_t flight_dump_cause = reg_t(-1);
+  bool misaligned = false;
+  bool dirty = false;
   bool dump_dts = false;
   bool dtb_enabled = true;
   size_t nprocs = 1;
+  size_t threads = 1;
+  size_t quantum = sim_t::INTERLEAVE;
   reg_t start_pc = reg_t(-1);
   std::vector<std::pair<reg_t, mem_t*>> mems;
   std::unique_ptr<icache_sim_t> ic;
   std::unique_ptr<dcache_sim_t> dc;
   std::unique_ptr<cache_sim_t> l2;
   bool log_cache = false;
+  size_t tlb_sets = mmu_t::DEFAULT_TLB_SETS;
+  size_t tlb_ways = mmu_t::DEFAULT_TLB_WAYS;
   std::function<extension_t*()> extension;
   const char* isa = DEFAULT_ISA;
   const char* varch = DEFAULT_VARCH;
@@ -147,6 +256,8 @@ int main(int argc, char** argv)
   parser.option('m', 0, 1, [&](const char* s){mems = make_mems(s);});
   // I wanted to use --halted, but for some reason that doesn't work.
   parser.option('H', 0, 0, [&](const char* s){halted = true;});
+  parser.option(0, "threads", 1, [&](const char* s){threads = atoi(s);});
+  parser.option(0, "quantum", 1, [&](const char* s){quantum = strtoull(s, 0, 0);});
   parser.option(0, "rbb-port", 1, [&](const char* s){use_rbb = true; rbb_port = atoi(s);});
   parser.option(0, "pc", 1, [&](const char* s){start_pc = strtoull(s, 0, 0);});
   parser.option(0, "hartids", 1, hartids_parser);
@@ -154,6 +265,48 @@ int main(int argc, char** argv)
   parser.option(0, "dc", 1, [&](const char* s){dc.reset(new dcache_sim_t(s));});
   parser.option(0, "l2", 1, [&](const char* s){l2.reset(cache_sim_t::construct(s, "L2$"));});
   parser.option(0, "log-cache-miss", 0, [&](const char* s){log_cache = true;});
+  parser.option(0, "tlb", 1, [&](const char* s){parse_tlb(s, &tlb_sets, &tlb_ways);});
+  parser.option(0, "jit", 0, [&](const char* s){jit = true;});
+  parser.option(0, "log-pc", 1, [&](const char* s){
+    log = log_window = true;
+    if (strchr(s, ':'))
+      parse_range(s, &window.pc_start, &window.pc_end);
+    else
+      log_symbol = s;
+  });
+  parser.option(0, "log-priv", 1, [&](const char* s){
+    log = log_window = true;
+    window.priv_mask = parse_priv(s);
+  });
+  parser.option(0, "log-instret", 1, [&](const char* s){
+    log = log_window = true;
+    parse_range(s, &window.instret_start, &window.instret_end);
+  });
+  parser.option(0, "log-hart", 1, [&](const char* s){
+    log = log_window = true;
+    std::stringstream stream(s);
+    uint32_t id;
+    while (stream >> id) {
+      log_harts.push_back(id);
+      if (stream.peek() == ',') stream.ignore();
+    }
+  });
+  parser.option(0, "log-commits", 0, [&](const char* s){log_commits = true;});
+  parser.option(0, "histogram", 1, [&](const char* s){histogram_file = s;});
+  parser.option(0, "histogram-interval", 1, [&](const char* s){histogram_interval = strtoull(s, 0, 0);});
+  parser.option(0, "profile", 1, [&](const char* s){profile = s;});
+  parser.option(0, "profile-interval", 1, [&](const char* s){
+    profile_interval = std::max<reg_t>(1, strtoull(s, 0, 0));
+  });
+  parser.option(0, "profile-map", 1, [&](const char* s){profile_map = s;});
+  parser.option(0, "callgraph", 1, [&](const char* s){callgraph = s;});
+  parser.option(0, "insn-mix", 0, [&](const char* s){insn_mix = true;});
+  parser.option(0, "stats", 1, [&](const char* s){stats = s;});
+  parser.option(0, "commit-log", 1, [&](const char* s){commit_log = s;});
+  parser.option(0, "flight-recorder", 1, [&](const char* s){flight_size = strtoull(s, 0, 0);});
+  parser.option(0, "flight-dump-cause", 1, [&](const char* s){flight_dump_cause = strtoull(s, 0, 0);});
+  parser.option(0, "misaligned", 0, [&](const char* s){misaligned = true;});
+  parser.option(0, "dirty", 0, [&](const char* s){dirty = true;});
   parser.option(0, "isa", 1, [&](const char* s){isa = s;});
   parser.option(0, "varch", 1, [&](const char* s){varch = s;});
   parser.option(0, "extension", 1, [&](const char* s){extension = find_extension(s);});
@@ -191,6 +344,13 @@ int main(int argc, char** argv)
   if (!*argv1)
     help();
 
+  if (!quantum)
+    help();
+  if (threads > 1 && (ic || dc || l2 || use_rbb)) {
+    fprintf(stderr, "--threads can't be combined with cache models or --rbb-port\n");
+    exit(1);
+  }
+
   sim_t s(isa, varch, nprocs, halted, start_pc, mems, htif_args, std::move(hartids),
       dm_config);
   std::unique_ptr<remote_bitbang_t> remote_bitbang((remote_bitbang_t *) NULL);
@@ -213,6 +373,7 @@ int main(int argc, char** argv)
   if (dc) dc->set_log(log_cache);
   for (size_t i = 0; i < nprocs; i++)
   {
+    s.get_core(i)->get_mmu()->set_tlb_size(tlb_sets, tlb_ways);
     if (ic) s.get_core(i)->get_mmu()->register_memtracer(&*ic);
     if (dc) s.get_core(i)->get_mmu()->register_memtracer(&*dc);
     if (extension) s.get_core(i)->register_extension(extension());
@@ -220,6 +381,21 @@ int main(int argc, char** argv)
 
   s.set_debug(debug);
   s.set_log(log);
+  if (log_window) s.set_log_window(window, log_symbol, log_harts);
   s.set_histogram(histogram);
+  if (histogram_file) s.set_histogram_file(histogram_file, histogram_interval);
+  if (profile) s.set_profile(profile, profile_interval);
+  if (profile_map) s.set_profile_map(profile_map);
+  if (callgraph) s.set_callgraph(callgraph);
+  if (insn_mix) s.set_insn_mix(true);
+  if (stats) s.set_stats(stats);
+  if (log_commits) s.set_log_commits(true);
+  if (commit_log) s.set_commit_log(commit_log);
+  s.set_flight_recorder(flight_size);
+  s.set_flight_dump_cause(flight_dump_cause);
+  if (misaligned) s.set_misaligned(true);
+  if (dirty) s.set_dirty(true);
+  s.set_jit(jit);
+  s.set_threads(threads, quantum);
   return s.run();
 }